@@ -0,0 +1,174 @@
+#include "archivefile.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <experimental/filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+lib_pac::archive_file::archive_file()
+	: m_file(nullptr),
+	  m_mapping(nullptr),
+	  m_descriptor(-1),
+	  m_view(nullptr),
+	  m_size(0)
+{
+}
+
+#ifdef _WIN32
+
+lib_pac::archive_file::~archive_file()
+{
+	if (m_view)
+		UnmapViewOfFile(m_view);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file)
+		CloseHandle(m_file);
+}
+
+std::shared_ptr<lib_pac::archive_file>
+lib_pac::archive_file::open(const std::wstring& path, bool map)
+{
+	// Writers are kept out while the file is open, a mapped file shrinking under us would fault
+	const HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+	                                FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	std::shared_ptr<archive_file> result(new archive_file());
+	result->m_file = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+		return nullptr;
+	result->m_size = size.QuadPart;
+
+	// Empty files can't be mapped, and 32 bit builds may lack the address space for big archives
+	if (!map || !result->m_size)
+		return result;
+
+	result->m_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (result->m_mapping)
+		result->m_view = static_cast<const char*>(MapViewOfFile(result->m_mapping, FILE_MAP_READ, 0, 0, 0));
+	return result;
+}
+
+uint32_t
+lib_pac::archive_file::read(char* dst, uint64_t offset, uint32_t count) const
+{
+	if (offset >= m_size)
+		return 0;
+	count = static_cast<uint32_t>(std::min<uint64_t>(count, m_size - offset));
+
+	if (m_view)
+	{
+		std::memcpy(dst, m_view + offset, count);
+		return count;
+	}
+
+	// Reads at an explicit offset don't depend on the handle's position, they can run concurrently
+	uint32_t done = 0;
+	while (done < count)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(offset + done);
+		overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+
+		DWORD read = 0;
+		if (!ReadFile(m_file, dst + done, count - done, &read, &overlapped) || !read)
+			break;
+		done += read;
+	}
+	return done;
+}
+
+#else
+
+lib_pac::archive_file::~archive_file()
+{
+	if (m_view)
+		munmap(const_cast<char*>(m_view), m_size);
+	if (m_descriptor != -1)
+		close(m_descriptor);
+}
+
+std::shared_ptr<lib_pac::archive_file>
+lib_pac::archive_file::open(const std::wstring& path, bool map)
+{
+	const std::string name = std::experimental::filesystem::path(path).string();
+	const int descriptor = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+	if (descriptor == -1)
+		return nullptr;
+
+	std::shared_ptr<archive_file> result(new archive_file());
+	result->m_descriptor = descriptor;
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0)
+		return nullptr;
+	result->m_size = status.st_size;
+
+	if (!map || !result->m_size)
+		return result;
+
+	void* view = mmap(nullptr, result->m_size, PROT_READ, MAP_SHARED, descriptor, 0);
+	if (view != MAP_FAILED)
+		result->m_view = static_cast<const char*>(view);
+	return result;
+}
+
+uint32_t
+lib_pac::archive_file::read(char* dst, uint64_t offset, uint32_t count) const
+{
+	if (offset >= m_size)
+		return 0;
+	count = static_cast<uint32_t>(std::min<uint64_t>(count, m_size - offset));
+
+	if (m_view)
+	{
+		std::memcpy(dst, m_view + offset, count);
+		return count;
+	}
+
+	uint32_t done = 0;
+	while (done < count)
+	{
+		const ssize_t read = pread(m_descriptor, dst + done, count - done, offset + done);
+		if (read <= 0)
+			break;
+		done += static_cast<uint32_t>(read);
+	}
+	return done;
+}
+
+#endif
+
+uint64_t
+lib_pac::archive_file::size() const
+{
+	return m_size;
+}
+
+bool
+lib_pac::archive_file::mapped() const
+{
+	return m_view != nullptr;
+}
+
+const char*
+lib_pac::archive_file::view(uint64_t offset, uint64_t count) const
+{
+	if (!m_view || offset > m_size || count > m_size - offset)
+		return nullptr;
+	return m_view + offset;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "defines.h"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+namespace lib_pac
+{
+	// An archive opened once and shared by all of its entries. The whole file is memory mapped when it can be,
+	// otherwise reads go through positioned reads that leave no shared file position. Either way any number of
+	// threads can read at once.
+	class archive_file
+	{
+	private:
+		// HANDLEs of the file and its mapping on Windows, the descriptor elsewhere
+		void* m_file;
+		void* m_mapping;
+		int m_descriptor;
+
+		const char* m_view;
+		uint64_t m_size;
+
+		archive_file();
+
+	public:
+		archive_file(const archive_file&) = delete;
+		archive_file& operator=(const archive_file&) = delete;
+		EXPORTS ~archive_file();
+
+		// Null when the file can't be opened, map false always reads through the file
+		EXPORTS static std::shared_ptr<archive_file> open(const std::wstring& path, bool map = true);
+
+		EXPORTS uint64_t size() const;
+		EXPORTS bool mapped() const;
+
+		// Points at count bytes from offset in the mapping, null when the file isn't mapped or the range runs
+		// past its end. Valid as long as the archive_file lives.
+		EXPORTS const char* view(uint64_t offset, uint64_t count) const;
+
+		// Copies up to count bytes from offset, returns the bytes copied
+		EXPORTS uint32_t read(char* dst, uint64_t offset, uint32_t count) const;
+	};
+}
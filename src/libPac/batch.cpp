@@ -0,0 +1,75 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+void
+lib_pac::archive_batch::add(const std::string& name, uint64_t size, job work)
+{
+	m_jobs.push_back({ name, size, std::move(work) });
+}
+
+size_t
+lib_pac::archive_batch::size() const
+{
+	return m_jobs.size();
+}
+
+lib_pac::archive_batch::batch_info
+lib_pac::archive_batch::run(uint32_t max_parallel)
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	std::vector<entry> jobs = std::move(m_jobs);
+	m_jobs.clear();
+	std::stable_sort(jobs.begin(), jobs.end(), [](const entry& a, const entry& b) { return a.size > b.size; });
+
+	batch_info info;
+	info.archives = static_cast<uint32_t>(jobs.size());
+
+	std::atomic<size_t> next_job(0);
+	std::mutex mutex;
+
+	const auto run_jobs = [&]()
+	{
+		for (size_t i = next_job++; i < jobs.size(); i = next_job++)
+		{
+			std::string reason;
+			uint64_t bytes = 0;
+			try
+			{
+				bytes = jobs[i].work();
+			}
+			catch (const std::exception& e)
+			{
+				reason = e.what();
+			}
+			catch (...)
+			{
+				reason = "Unknown Error";
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			info.total_bytes += bytes;
+			if (!reason.empty())
+				info.failures.push_back({ jobs[i].name, reason });
+		}
+	};
+
+	const size_t n_threads = std::min<size_t>(std::max(max_parallel, 1u), jobs.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < n_threads; ++i)
+		threads.emplace_back(run_jobs);
+
+	run_jobs();
+	for (auto& thread : threads)
+		thread.join();
+
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	info.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+	return info;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "defines.h"
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace lib_pac
+{
+	// Works on several archives at once, all sharing the thread pool, so one archive's reading and writing
+	// overlaps another's compression and no archive's tail leaves the pool idle. Every running archive has
+	// a thread of its own rather than a pool task, saving blocks while its writer waits on compression.
+	class archive_batch
+	{
+	public:
+		// Processes one archive, returns the bytes of file data it went through
+		typedef std::function<uint64_t()> job;
+
+		struct failure
+		{
+			std::string name;
+			std::string reason;
+		};
+
+		struct batch_info
+		{
+			uint32_t archives = 0;
+			uint64_t total_bytes = 0;
+			uint64_t elapsed_us = 0;
+			std::vector<failure> failures;
+		};
+
+		static const uint32_t DEFAULT_PARALLEL_ARCHIVES = 4;
+
+	private:
+		struct entry
+		{
+			std::string name;
+			uint64_t size;
+			job work;
+		};
+
+		std::vector<entry> m_jobs;
+
+	public:
+		// size estimates the job's work, the biggest jobs start first so small ones fill the tail
+		EXPORTS void add(const std::string& name, uint64_t size, job work);
+		EXPORTS size_t size() const;
+
+		// Runs every job, at most max_parallel at once counting the calling thread. A job that throws is
+		// listed as failed, the others still run.
+		EXPORTS batch_info run(uint32_t max_parallel = DEFAULT_PARALLEL_ARCHIVES);
+	};
+}
@@ -1,155 +1,121 @@
 #include "bitstream.h"
 #include <algorithm>
+#include <cstring>
 
+#ifdef _MSC_VER
+#include <stdlib.h>
+#define bswap64 _byteswap_uint64
+#else
+#define bswap64 __builtin_bswap64
+#endif
 
-lib_pac::bit_writer::bit_writer(void* data)
-	: m_remainder_bits(8), m_offset(0), m_data(static_cast<uint8_t*>(data))
-{
-}
 
-void lib_pac::bit_writer::seek(size_t offset, uint8_t bit)
+static inline uint64_t
+load_be64(const uint8_t* data)
 {
-	m_offset = offset;
-	m_remainder_bits = 8 - bit;
+	uint64_t word;
+	std::memcpy(&word, data, sizeof(word));
+	return bswap64(word);
 }
 
-size_t lib_pac::bit_writer::tell(uint8_t * bit) const
+
+lib_pac::bit_writer::bit_writer(void* data)
+	: m_bits(0), m_bit_count(0), m_offset(0), m_data(static_cast<uint8_t*>(data))
 {
-	if (bit)
-		*bit = 8 - m_remainder_bits;
-	return m_offset;
 }
 
-void lib_pac::bit_writer::write_bit(bool high)
+lib_pac::bit_writer::~bit_writer()
 {
-	if (m_remainder_bits == 0)
-	{
-		m_offset++;
-		m_remainder_bits = 8;
-	}
-	m_remainder_bits--;
-
-	uint8_t curr = m_data[m_offset];
-	if (high)
-		curr |= (1 << m_remainder_bits);
-	else
-		curr &= ~(1 << m_remainder_bits);
-	m_data[m_offset] = curr;
+	flush();
 }
 
-// TODO: Aligned Writes
-void lib_pac::bit_writer::write_bits(uint32_t data, uint8_t nBits)
+void lib_pac::bit_writer::seek(size_t offset, uint8_t bit)
 {
-	nBits = std::min((uint8_t)32, nBits);
+	flush();
 
-	while(nBits > 8)
-	{
-		nBits -= 8;
-		write_byte(data >> nBits, 8);
-	}
-
-	write_byte(data, nBits);
+	// Keep the bits that precede the new position
+	m_offset = offset;
+	m_bit_count = bit;
+	m_bits = bit ? static_cast<uint64_t>(m_data[offset] & ~(0xFF >> bit)) << 56 : 0;
 }
 
-
-void lib_pac::bit_writer::write_byte(uint8_t data, uint8_t nBits)
+size_t lib_pac::bit_writer::tell(uint8_t * bit) const
 {
-	nBits = std::min((uint8_t)8, nBits);
-
-	if (nBits == 0)
-		return;
+	const size_t position = m_offset * 8 + m_bit_count;
+	if (bit)
+		*bit = position % 8;
+	return position / 8;
+}
 
-	if (m_remainder_bits == 0)
+void lib_pac::bit_writer::flush()
+{
+	while (m_bit_count >= 8)
 	{
-		m_offset++;
-		m_remainder_bits = 8;
+		m_data[m_offset++] = static_cast<uint8_t>(m_bits >> 56);
+		m_bits <<= 8;
+		m_bit_count -= 8;
 	}
 
-	int first = std::min(nBits, m_remainder_bits);
-	int second = nBits - first;
-
-	uint8_t mask, shift;
+	// The partial byte stays pending, it is rewritten once it fills up
+	if (m_bit_count)
 	{
-		mask = (1 << first) - 1;
-		shift = (m_remainder_bits - first);
-
-		uint8_t curr = m_data[m_offset];
-		curr &= ~(mask << shift);
-
-		uint8_t data0 = data >> second;
-		data0 &= mask;
-		data0 <<= shift;
-		curr |= data0;
-
-		m_data[m_offset] = curr;
-		m_remainder_bits -= first;
-	}
-	if (second)
-	{
-		m_offset++;
-		m_remainder_bits = (8 - second);
-
-		mask = (1 << second) - 1;
-		shift = m_remainder_bits;
-
-		uint8_t curr = m_data[m_offset];
-		curr &= ~(mask << shift);
-
-		uint8_t data1 = data << shift;
-		data1 &= mask << shift;
-		curr |= data1;
-
-		m_data[m_offset] = curr;
+		const uint8_t mask = 0xFF << (8 - m_bit_count);
+		const uint8_t curr = m_data[m_offset] & ~mask;
+		m_data[m_offset] = curr | static_cast<uint8_t>(m_bits >> 56);
 	}
 }
 
 
 lib_pac::bit_reader::bit_reader(const void* data)
-	: m_remainder_bits(8), m_offset(0), m_data(static_cast<const uint8_t*>(data))
+	: m_bits(0), m_bit_count(0), m_offset(0), m_size(SIZE_MAX), m_word_end(0),
+	  m_data(static_cast<const uint8_t*>(data))
 {
 }
 
-void lib_pac::bit_reader::seek(size_t offset, uint8_t bit)
+lib_pac::bit_reader::bit_reader(const void* data, size_t size)
+	: m_bits(0), m_bit_count(0), m_offset(0), m_size(size), m_word_end(size),
+	  m_data(static_cast<const uint8_t*>(data))
 {
-	m_offset = offset;
-	m_remainder_bits = 8 - bit;
 }
 
-
-bool lib_pac::bit_reader::read_bit()
+void lib_pac::bit_reader::seek(size_t offset, uint8_t bit)
 {
-	if (m_remainder_bits == 0)
+	m_bits = 0;
+	m_bit_count = 0;
+	m_offset = offset;
+	if (bit)
 	{
-		m_offset++;
-		m_remainder_bits = 8;
+		peek(bit);
+		consume(bit);
 	}
-	return ((m_data[m_offset] >> --m_remainder_bits) & 0x01) == 0x01;
 }
 
-
-uint8_t lib_pac::bit_reader::read_byte()
+size_t lib_pac::bit_reader::tell(uint8_t* bit) const
 {
-	if (m_remainder_bits == 8)
-		return m_data[m_offset++];
-	if (m_remainder_bits == 0)
-		return m_data[++m_offset];
-
-	const int first = std::min(static_cast<uint8_t>(8), m_remainder_bits);
-	const int second = 8 - first;
-
-	uint8_t value = 0;
-
-	uint8_t data0 = m_data[m_offset];
-	data0 &= (1 << first) - 1;
-	data0 <<= second;
-	value |= data0;
-
-	m_offset++;
+	const size_t position = m_offset * 8 - m_bit_count;
+	if (bit)
+		*bit = position % 8;
+	return position / 8;
+}
 
-	uint8_t data1 = m_data[m_offset];
-	data1 &= (1 << second) - 1 << first;
-	data1 >>= first;
-	value |= data1;
+void lib_pac::bit_reader::refill(uint32_t n_bits)
+{
+	if (m_offset + 8 <= m_word_end)
+	{
+		// Bits past the claimed bytes are real data too, the next refill ORs the same values over them
+		m_bits |= load_be64(m_data + m_offset) >> m_bit_count;
+		const uint32_t n_bytes = (63 - m_bit_count) / 8;
+		m_offset += n_bytes;
+		m_bit_count += n_bytes * 8;
+		return;
+	}
 
-	return value;
+	// Tail, byte at a time
+	while (m_bit_count < n_bits)
+	{
+		const uint64_t next = m_offset < m_size ? m_data[m_offset] : 0;
+		m_bits |= next << (56 - m_bit_count);
+		m_bit_count += 8;
+		m_offset++;
+	}
 }
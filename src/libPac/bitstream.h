@@ -1,24 +1,32 @@
 #pragma once
 #include "defines.h"
 
+#include <stdint.h>
 #include <vector>
 
 namespace lib_pac
 {
+	// Bits are kept MSB first in a 64 bit buffer and move to and from memory a word at a time
+
 	class bit_writer
 	{
 	private:
-		uint8_t m_remainder_bits;
+		uint64_t m_bits;
+		uint32_t m_bit_count;
 		size_t m_offset;
 		uint8_t* m_data;
-		void write_byte(uint8_t data, uint8_t n_bits);
+		void flush_word();
 
 	public:
 		EXPORTS explicit bit_writer(void* data);
+		EXPORTS ~bit_writer();
 
 		EXPORTS void write_bit(bool one);
 		EXPORTS void write_bits(uint32_t data, uint8_t n_bits);
-		
+
+		// Stores the pending bits, the unused tail of the last byte is left as it was
+		EXPORTS void flush();
+
 		EXPORTS void seek(size_t offset, uint8_t bit);
 		EXPORTS size_t tell(uint8_t* bit = nullptr) const;
 
@@ -27,15 +35,98 @@ namespace lib_pac
 	class bit_reader
 	{
 	private:
-		uint8_t m_remainder_bits;
+		uint64_t m_bits;
+		uint32_t m_bit_count;
 		size_t m_offset;
+		size_t m_size;
+		size_t m_word_end;
 		const uint8_t* m_data;
+		void refill(uint32_t n_bits);
 	public:
+		static const uint32_t MAX_PEEK = 56;
+
+		// Unbounded readers never touch a byte they don't need,
+		// bounded ones load whole words and read zeros past the end
 		EXPORTS explicit bit_reader(const void* data);
+		EXPORTS bit_reader(const void* data, size_t size);
+
+		EXPORTS uint32_t peek(uint8_t n_bits);
+		EXPORTS void consume(uint8_t n_bits);
+
+		// The whole bit buffer MSB first, at least n_bits of it read from the data.
+		// Kernels take several codes out of one window and consume them together.
+		EXPORTS uint64_t window(uint8_t n_bits);
 
 		EXPORTS uint8_t read_byte();
 		EXPORTS bool read_bit();
 
 		EXPORTS void seek(size_t offset, uint8_t bit);
+		EXPORTS size_t tell(uint8_t* bit = nullptr) const;
 	};
+
+	inline void bit_writer::flush_word()
+	{
+		m_data[m_offset + 0] = static_cast<uint8_t>(m_bits >> 56);
+		m_data[m_offset + 1] = static_cast<uint8_t>(m_bits >> 48);
+		m_data[m_offset + 2] = static_cast<uint8_t>(m_bits >> 40);
+		m_data[m_offset + 3] = static_cast<uint8_t>(m_bits >> 32);
+		m_offset += 4;
+		m_bits <<= 32;
+		m_bit_count -= 32;
+	}
+
+	inline void bit_writer::write_bits(uint32_t data, uint8_t n_bits)
+	{
+		if (m_bit_count >= 32)
+			flush_word();
+		if (n_bits == 0)
+			return;
+		if (n_bits > 32)
+			n_bits = 32;
+
+		const uint64_t value = data & (UINT64_MAX >> (64 - n_bits));
+		m_bits |= value << (64 - m_bit_count - n_bits);
+		m_bit_count += n_bits;
+	}
+
+	inline void bit_writer::write_bit(bool one)
+	{
+		write_bits(one ? 1 : 0, 1);
+	}
+
+	// n_bits must be between 1 and MAX_PEEK
+	inline uint32_t bit_reader::peek(uint8_t n_bits)
+	{
+		if (m_bit_count < n_bits)
+			refill(n_bits);
+		return static_cast<uint32_t>(m_bits >> (64 - n_bits));
+	}
+
+	// n_bits must be between 1 and MAX_PEEK
+	inline uint64_t bit_reader::window(uint8_t n_bits)
+	{
+		if (m_bit_count < n_bits)
+			refill(n_bits);
+		return m_bits;
+	}
+
+	inline void bit_reader::consume(uint8_t n_bits)
+	{
+		m_bits <<= n_bits;
+		m_bit_count -= n_bits;
+	}
+
+	inline bool bit_reader::read_bit()
+	{
+		const bool value = peek(1) != 0;
+		consume(1);
+		return value;
+	}
+
+	inline uint8_t bit_reader::read_byte()
+	{
+		const uint8_t value = static_cast<uint8_t>(peek(8));
+		consume(8);
+		return value;
+	}
 }
@@ -1,54 +1,178 @@
 #include "compressor.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <future>
-#include "semaphore.h"
-
-static std::tuple<size_t, std::unique_ptr<lib_pac::huffman_tree>>
-block_analyze(const uint8_t* data, uint32_t size, lib_pac::semaphore& limiter)
+#include <cstring>
+#include "threadpool.h"
+#include "filesourcebase.h"
+#include "kernels.h"
+#include "decodecache.h"
+#include "speculative.h"
+#include "parallelencode.h"
+
+// Upper bound on the segments one block is split into, for both encoding and speculative decoding
+static const uint32_t MAX_SEGMENTS = 64;
+// Blocks are encoded in segments once they hold at least two of this size
+static const uint32_t ENCODE_SEGMENT_SIZE = 0x40000;
+
+// The fast level counts SAMPLE_WINDOW bytes out of every SAMPLE_STRIDE, blocks smaller than
+// FAST_MIN_SIZE are counted in full
+static const uint32_t SAMPLE_WINDOW = 0x40;
+static const uint32_t SAMPLE_STRIDE = 0x400;
+static const uint32_t FAST_MIN_SIZE = 0x4000;
+// Smallest block size choose_block_size considers
+static const uint32_t MIN_CHOSEN_BLOCK_SIZE = 0x4000;
+// Largest block a stream may declare, decoders refuse bigger ones instead of allocating for them
+static const uint32_t MAX_BLOCK_SIZE = 0x1000000;
+// Blocks smaller than this go to the pool several per task
+static const uint32_t MIN_TASK_SIZE = 0x40000;
+
+static uint32_t
+task_grain(uint32_t block_size)
 {
-	lib_pac::critical_section _(limiter);
+	return std::max(1u, MIN_TASK_SIZE / std::max(block_size, 1u));
+}
 
-	auto unique = std::make_unique<lib_pac::huffman_tree>();
-	unique->create(data, size);
+static uint32_t
+pool_threads(uint32_t n_threads)
+{
+	return n_threads ? n_threads : lib_pac::thread_pool::instance().size();
+}
 
-	size_t compSize = 1 + (unique->bit_count() - 1) / 8;
+static size_t
+block_analyze(const uint8_t* data, uint32_t size, uint32_t max_code_length, lib_pac::huffman_tree& tree)
+{
+	tree.create(data, size, max_code_length);
 
-	return std::make_tuple(compSize, std::move(unique));
+	return 1 + (tree.bit_count() - 1) / 8;
 }
 
-static void
-block_compress(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size, const lib_pac::huffman_tree& tree,
-               lib_pac::semaphore& limiter)
+static size_t
+block_analyze_fast(const uint8_t* data, uint32_t size, uint32_t max_code_length, lib_pac::huffman_tree& tree)
 {
-	lib_pac::critical_section _(limiter);
+	if (size < FAST_MIN_SIZE)
+		return block_analyze(data, size, max_code_length, tree);
 
-	lib_pac::bit_writer writer(dst);
+	uint8_t present[0x100];
+	lib_pac::byte_presence(data, size, present);
+
+	uint32_t weights[0x100] = {};
+	for (uint32_t start = 0; start < size; start += SAMPLE_STRIDE)
+	{
+		const uint32_t end = std::min(size, start + SAMPLE_WINDOW);
+		for (uint32_t i = start; i < end; ++i)
+			weights[data[i]]++;
+	}
+
+	// Sampled counts stand for SAMPLE_STRIDE / SAMPLE_WINDOW times as many bytes,
+	// values the sample missed are rarer than that
+	for (int value = 0; value < 0x100; ++value)
+		weights[value] = weights[value] ? weights[value] * (SAMPLE_STRIDE / SAMPLE_WINDOW) : present[value];
+
+	tree.create(weights, max_code_length);
 
-	tree.write(writer);
 	lib_pac::bit_lookup lookup;
 	tree.generate_lookup(lookup);
 
-	for (uint32_t i = 0; i < src_size; i++)
+	// Sizes are only known after encoding, the slot has room for every byte taking the longest code
+	uint32_t longest = 0;
+	for (int value = 0; value < 0x100; ++value)
+		if (present[value])
+			longest = std::max<uint32_t>(longest, lookup.entries[value].lenght);
+
+	size_t tree_bits = 0, data_bits = 0;
+	tree.bit_count(tree_bits, data_bits);
+
+	return 1 + (tree_bits + static_cast<size_t>(size) * longest - 1) / 8;
+}
+
+static size_t
+predicted_block_size(const uint32_t* counts, uint32_t max_code_length, lib_pac::huffman_tree& tree)
+{
+	tree.create(counts, max_code_length);
+	return 1 + (tree.bit_count() - 1) / 8;
+}
+
+// histograms receives the counts of every min_block_size piece, for prepare_compression to reuse
+static void
+predict_block_sizes(const uint8_t* data, uint32_t size, uint32_t min_block_size, uint32_t n_sizes,
+                    uint32_t max_code_length, uint64_t* predicted, std::array<uint32_t, 0x100>* histograms)
+{
+	// Histograms of the smallest blocks add up to those of every larger size, each
+	// size keeps a running sum for the block it is currently filling
+	std::vector<std::array<uint32_t, 0x100>> sums(n_sizes);
+	for (auto& sum : sums)
+		sum.fill(0);
+
+	lib_pac::huffman_tree tree;
+	for (uint32_t offset = 0; offset < size; offset += min_block_size)
 	{
-		const uint8_t value = src[i];
-		auto& entry = lookup.entries[value];
-		writer.write_bits(entry.pattern, entry.lenght);
+		const uint32_t end = std::min(size, offset + min_block_size);
+		uint32_t* counts = histograms[offset / min_block_size].data();
+		lib_pac::byte_histogram(data + offset, end - offset, counts);
+
+		for (uint32_t i = 0; i < n_sizes; ++i)
+		{
+			auto& sum = sums[i];
+			for (int value = 0; value < 0x100; ++value)
+				sum[value] += counts[value];
+
+			if (end % (min_block_size << i) && end != size)
+				continue;
+
+			// Every block costs its data and an entry in the block table
+			predicted[i] += predicted_block_size(sum.data(), max_code_length, tree) + 12;
+			sum.fill(0);
+		}
 	}
 }
 
-static void
-block_decompress(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size, lib_pac::semaphore& limiter)
+static size_t
+block_compress(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size, const lib_pac::huffman_tree& tree,
+               uint32_t n_segments)
 {
-	lib_pac::critical_section _(limiter);
+	lib_pac::bit_lookup lookup;
+	tree.generate_lookup(lookup);
 
-	lib_pac::bit_reader reader(src);
+	if (n_segments > 1)
+	{
+		// The tree writer has to flush before the segments start writing after it
+		size_t tree_bits;
+		{
+			lib_pac::bit_writer writer(dst);
+			tree.write(writer);
 
-	lib_pac::huffman_tree tree;
-	tree.read(reader);
+			uint8_t bit;
+			tree_bits = writer.tell(&bit) * 8 + bit;
+		}
+		return 1 + (lib_pac::encode_parallel(dst, tree_bits, src, src_size, lookup, n_segments) - 1) / 8;
+	}
+
+	lib_pac::bit_writer writer(dst);
+	tree.write(writer);
+
+	// Single leaf trees have zero length codes, nothing follows the tree
+	size_t branches = 0, leaves = 0;
+	tree.node_count(branches, leaves);
+	if (leaves > 1 && !lib_pac::encode_fixed(writer, src, src_size, lookup, tree.fixed_length()))
+		lib_pac::kernels().encode(writer, src, src_size, lookup);
 
-	for(uint32_t i = 0; i < dst_size; ++i)
+	writer.flush();
+	uint8_t bit;
+	const size_t offset = writer.tell(&bit);
+	return offset + (bit ? 1 : 0);
+}
+
+static void
+block_decode_walk(uint8_t* dst, uint32_t dst_size, lib_pac::bit_reader& reader, const lib_pac::huffman_tree& tree)
+{
+	for (uint32_t i = 0; i < dst_size; ++i)
 	{
 		auto cur = tree.get_cursor();
-		while(!cur.is_leaf())
+		while (!cur.is_leaf())
 		{
 			const bool move_right = reader.read_bit();
 			if (move_right)
@@ -60,14 +184,88 @@ block_decompress(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t s
 	}
 }
 
+static void
+block_decode(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size, uint32_t n_segments,
+             lib_pac::bit_reader& reader, const lib_pac::huffman_tree& tree, const lib_pac::bit_decoder& decoder,
+             bool has_decoder)
+{
+	if (!has_decoder)
+	{
+		block_decode_walk(dst, dst_size, reader, tree);
+		return;
+	}
+
+	// Single leaf trees have zero length codes
+	if (decoder.max_length == 0)
+	{
+		std::memset(dst, decoder.primary[0].value, dst_size);
+		return;
+	}
+
+	// Two symbol and near uniform blocks have codes of a single length
+	if (lib_pac::decode_fixed(dst, dst_size, reader, decoder))
+		return;
+
+	if (n_segments > 1)
+	{
+		uint8_t bit;
+		const size_t offset = reader.tell(&bit);
+		lib_pac::decode_speculative(dst, dst_size, src, src_size, offset * 8 + bit, decoder, n_segments);
+		return;
+	}
+
+	lib_pac::kernels().decode(dst, dst_size, reader, decoder);
+}
+
+// False when the block's tree is corrupt, nothing is written then
+static bool
+block_decompress(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size, uint32_t n_segments)
+{
+	lib_pac::bit_reader reader(src, src_size);
+
+	lib_pac::decoder_cache& cache = lib_pac::decoder_cache::instance();
+	if (cache.capacity())
+	{
+		const auto cached = cache.get(src, src_size);
+		if (!cached)
+			return false;
+
+		reader.seek(cached->tree_bits / 8, cached->tree_bits % 8);
+		block_decode(dst, dst_size, src, src_size, n_segments, reader, cached->tree, cached->decoder,
+		             cached->has_decoder);
+		return true;
+	}
+
+	struct block_state
+	{
+		lib_pac::huffman_tree tree;
+		lib_pac::bit_decoder decoder;
+	};
+
+	// Reused by every block this thread decodes without the cache. A segmented block's thread runs other
+	// blocks while it waits for its segments, so that block gets a tree and decoder of its own.
+	thread_local block_state reused;
+	std::unique_ptr<block_state> owned;
+	if (n_segments > 1)
+		owned = std::make_unique<block_state>();
+	block_state& state = owned ? *owned : reused;
+
+	// A tree running into the zeros past the block is as corrupt as one the cache refuses to measure
+	uint8_t bit;
+	if (!state.tree.read(reader) || reader.tell(&bit) * 8 + bit > size_t(src_size) * 8)
+		return false;
+	const bool has_decoder = state.tree.generate_decoder(state.decoder);
+	block_decode(dst, dst_size, src, src_size, n_segments, reader, state.tree, state.decoder, has_decoder);
+	return true;
+}
+
 // Compression
 
 std::unique_ptr<lib_pac::compressor_info>
-lib_pac::compressor::prepare_compression(const char* input, size_t input_size, uint32_t block_size, uint32_t n_threads)
+lib_pac::compressor::prepare_compression(const char* input, size_t input_size, uint32_t block_size, uint32_t n_threads,
+                                         uint32_t max_code_length, compression_level level)
 {
-	if (!n_threads)
-		n_threads = std::thread::hardware_concurrency();
-	semaphore limiter(n_threads);
+	n_threads = pool_threads(n_threads);
 
 	int num_blocks = ((input_size - 1) / block_size) + 1;
 	const uint8_t* data8 = reinterpret_cast<const uint8_t*>(input);
@@ -76,49 +274,137 @@ lib_pac::compressor::prepare_compression(const char* input, size_t input_size, u
 
 	info->set_input(data8, input_size);
 	info->set_blocks(num_blocks, block_size);
+	info->m_trees.resize(num_blocks);
+	info->m_level = level;
 
-	std::vector<std::future<std::tuple<size_t, std::unique_ptr<lib_pac::huffman_tree>>>> futures(num_blocks);
+	const auto analyze = level == compression_level::fast ? block_analyze_fast : block_analyze;
+	std::vector<size_t> cmp_sizes(num_blocks);
 
-	for (int i = 0; i < num_blocks; ++i)
+	thread_pool::instance().parallel_for(num_blocks, n_threads, task_grain(block_size), [&](uint32_t i)
 	{
 		const uint32_t src_off = i * block_size;
-		const uint32_t src_sz = std::min(block_size, input_size - src_off);
-		futures[i] = std::async(std::launch::async, block_analyze, data8 + src_off, src_sz, std::ref(limiter));
-	}
+		const uint32_t src_sz = std::min<uint32_t>(block_size, input_size - src_off);
+		cmp_sizes[i] = analyze(data8 + src_off, src_sz, max_code_length, info->m_trees[i]);
+	});
 
-	uint32_t output_size = 16 + 12 * num_blocks;
-	uint32_t chunk_offset = 0;
-	for (int i = 0; i < num_blocks; ++i)
+	info->set_chunks(cmp_sizes);
+	return std::move(info);
+}
+
+std::unique_ptr<lib_pac::compressor_info>
+lib_pac::compressor::prepare_compression(const char* input, size_t input_size, const block_size_choice& choice,
+                                         uint32_t n_threads)
+{
+	const uint32_t block_size = choice.block_size;
+	const uint32_t piece_size = MIN_CHOSEN_BLOCK_SIZE;
+	const size_t n_pieces = input_size ? ((input_size - 1) / piece_size) + 1 : 0;
+	if (!input_size || block_size % piece_size || choice.histograms.size() != n_pieces)
+		return prepare_compression(input, input_size, block_size, n_threads, choice.max_code_length);
+
+	n_threads = pool_threads(n_threads);
+
+	const int num_blocks = ((input_size - 1) / block_size) + 1;
+	const uint32_t pieces_per_block = block_size / piece_size;
+
+	auto info = std::make_unique<compressor_info>();
+	info->set_input(input, input_size);
+	info->set_blocks(num_blocks, block_size);
+	info->m_trees.resize(num_blocks);
+	info->m_level = compression_level::normal;
+
+	// The same trees block_analyze builds, from the counts the prediction already took
+	std::vector<size_t> cmp_sizes(num_blocks);
+	thread_pool::instance().parallel_for(num_blocks, n_threads, task_grain(block_size), [&](uint32_t i)
 	{
-		const uint32_t src_off = i * block_size;
-		const uint32_t src_sz = std::min(block_size, input_size - src_off);
+		uint32_t weights[0x100] = {};
+		const size_t last = std::min<size_t>(n_pieces, size_t(i + 1) * pieces_per_block);
+		for (size_t piece = size_t(i) * pieces_per_block; piece < last; ++piece)
+		{
+			for (int value = 0; value < 0x100; ++value)
+				weights[value] += choice.histograms[piece][value];
+		}
+		cmp_sizes[i] = predicted_block_size(weights, choice.max_code_length, info->m_trees[i]);
+	});
+
+	info->set_chunks(cmp_sizes);
+	return std::move(info);
+}
+
+lib_pac::block_size_choice
+lib_pac::compressor::choose_block_size(const char* input, size_t input_size, uint32_t max_block_size,
+                                       uint32_t reference_block_size, uint32_t n_threads, uint32_t max_code_length)
+{
+	n_threads = pool_threads(n_threads);
+
+	// Powers of two from the smallest size up to whichever of the ceiling and the reference is larger
+	const uint32_t top_size = std::min(std::max(max_block_size, reference_block_size), MAX_BLOCK_SIZE);
+	uint32_t n_sizes = 1;
+	while ((MIN_CHOSEN_BLOCK_SIZE << n_sizes) <= top_size)
+		++n_sizes;
+	const uint32_t chunk_size = MIN_CHOSEN_BLOCK_SIZE << (n_sizes - 1);
+
+	const uint8_t* data8 = reinterpret_cast<const uint8_t*>(input);
+	const uint32_t n_chunks = input_size ? ((input_size - 1) / chunk_size) + 1 : 0;
 
-		auto tuple = futures[i].get();
-		const size_t cmp_size = std::get<0>(tuple);
+	block_size_choice choice;
+	choice.max_code_length = max_code_length;
+	choice.histograms.resize(input_size ? ((input_size - 1) / MIN_CHOSEN_BLOCK_SIZE) + 1 : 0);
 
-		info->set_data_chunk(i, src_sz, cmp_size, chunk_offset, std::move(std::get<1>(tuple)));
-		output_size += cmp_size;
-		chunk_offset += cmp_size;
+	// Chunks hold a whole block of the largest size, and so whole blocks of every smaller one
+	const uint32_t pieces_per_chunk = chunk_size / MIN_CHOSEN_BLOCK_SIZE;
+	std::vector<std::vector<uint64_t>> predicted(n_chunks, std::vector<uint64_t>(n_sizes));
+	thread_pool::instance().parallel_for(n_chunks, n_threads, task_grain(chunk_size), [&](uint32_t i)
+	{
+		const uint32_t src_off = i * chunk_size;
+		const uint32_t src_sz = std::min<uint32_t>(chunk_size, input_size - src_off);
+		predict_block_sizes(data8 + src_off, src_sz, MIN_CHOSEN_BLOCK_SIZE, n_sizes, max_code_length,
+		                    predicted[i].data(), choice.histograms.data() + size_t(i) * pieces_per_chunk);
+	});
+
+	std::vector<uint64_t> totals(n_sizes, 16);
+	for (uint32_t i = 0; i < n_chunks; ++i)
+	{
+		for (uint32_t j = 0; j < n_sizes; ++j)
+			totals[j] += predicted[i][j];
 	}
-	info->set_output(output_size);
 
-	return std::move(info);
+	// The reference wins ties, a size only replaces it by predicting fewer bytes
+	choice.block_size = reference_block_size;
+	choice.reference_output_size = UINT32_MAX;
+	uint64_t best = UINT64_MAX;
+	for (uint32_t j = 0; j < n_sizes; ++j)
+	{
+		if (MIN_CHOSEN_BLOCK_SIZE << j != reference_block_size)
+			continue;
+		choice.reference_output_size = static_cast<uint32_t>(std::min<uint64_t>(totals[j], UINT32_MAX));
+		if (reference_block_size <= max_block_size)
+			best = totals[j];
+	}
+
+	for (uint32_t j = 0; j < n_sizes; ++j)
+	{
+		const uint32_t block_size = MIN_CHOSEN_BLOCK_SIZE << j;
+		if (block_size <= max_block_size && totals[j] < best)
+		{
+			best = totals[j];
+			choice.block_size = block_size;
+		}
+	}
+	choice.output_size = static_cast<uint32_t>(std::min<uint64_t>(best, UINT32_MAX));
+
+	return choice;
 }
 
-void
+uint32_t
 lib_pac::compressor::compress(const compressor_info& info, char* dst, uint32_t n_threads)
 {
-	if (!n_threads)
-		n_threads = std::thread::hardware_concurrency();
+	n_threads = pool_threads(n_threads);
 
 	const uint32_t blk_cnt = info.block_count();
 	const uint32_t blk_sz = info.block_size();
 	const uint32_t input_sz = info.input_size();
 	const uint8_t* input_buf = info.input();
 
-	std::vector<std::future<void>> futures(blk_cnt);
-
-	semaphore limiter(n_threads);
 	uint8_t* dst8 = reinterpret_cast<uint8_t*>(dst);
 	size_t headerSize = 16 + 12 * blk_cnt;
 
@@ -127,110 +413,571 @@ lib_pac::compressor::compress(const compressor_info& info, char* dst, uint32_t n
 	*dst32++ = blk_cnt;
 	*dst32++ = blk_sz;
 	*dst32++ = headerSize;
+	uint32_t* const entries32 = dst32;
 
+	std::vector<uint32_t> src_offsets(blk_cnt);
 	uint32_t src_offset = 0;
 	for (int i = 0; i < blk_cnt; ++i)
+	{
+		*dst32++ = info.chunk_decompressed_size(i);
+		*dst32++ = info.chunk_compressed_size(i);
+		*dst32++ = info.chunk_data_offset(i);
+
+		src_offsets[i] = src_offset;
+		src_offset += info.chunk_decompressed_size(i);
+	}
+
+	std::vector<uint32_t> written(blk_cnt);
+	thread_pool::instance().parallel_for(blk_cnt, n_threads, task_grain(blk_sz), [&](uint32_t i)
 	{
 		const uint32_t out_chunk_sz = info.chunk_compressed_size(i);
 		const uint32_t in_chunk_sz = info.chunk_decompressed_size(i);
-		const uint32_t dst_offset = info.chunk_data_offset(i);
-
-		*dst32++ = in_chunk_sz;
-		*dst32++ = out_chunk_sz;
-		*dst32++ = dst_offset;
-
-		huffman_tree& tree = info.trees(i);
-		futures[i] = std::async(std::launch::async,
-		                        block_compress,
-		                        dst8 + headerSize + dst_offset,
-								out_chunk_sz,
-		                        input_buf + src_offset,
-		                        in_chunk_sz,
-		                        std::ref(tree),
-		                        std::ref(limiter));
-
-		src_offset += in_chunk_sz;
-	}
+		const uint32_t n_segments = std::min({ in_chunk_sz / ENCODE_SEGMENT_SIZE, n_threads, MAX_SEGMENTS });
+
+		written[i] = static_cast<uint32_t>(block_compress(dst8 + headerSize + info.chunk_data_offset(i), out_chunk_sz,
+		                                                  input_buf + src_offsets[i], in_chunk_sz, info.trees(i),
+		                                                  n_segments));
+	});
 
+	// Blocks of the fast level only fill part of their slot, they move down to close the gaps.
+	// Normal blocks fill theirs exactly and stay where they are.
+	uint32_t dst_offset = 0;
 	for (int i = 0; i < blk_cnt; ++i)
-		futures[i].get();
+	{
+		const uint32_t slot_offset = info.chunk_data_offset(i);
+		if (slot_offset != dst_offset)
+			std::memmove(dst8 + headerSize + dst_offset, dst8 + headerSize + slot_offset, written[i]);
+
+		entries32[3 * i + 1] = written[i];
+		entries32[3 * i + 2] = dst_offset;
+		dst_offset += written[i];
+	}
+
+	return headerSize + dst_offset;
+}
+
+// Streaming Compression
+
+static std::vector<uint8_t>
+stream_block(const std::vector<uint8_t>& input, uint32_t max_code_length, lib_pac::compression_level level)
+{
+	const uint8_t* src = input.data();
+	const uint32_t src_size = static_cast<uint32_t>(input.size());
+
+	lib_pac::huffman_tree tree;
+	const size_t bound = level == lib_pac::compression_level::fast
+		                     ? block_analyze_fast(src, src_size, max_code_length, tree)
+		                     : block_analyze(src, src_size, max_code_length, tree);
+
+	std::vector<uint8_t> output(bound);
+	output.resize(block_compress(output.data(), bound, src, src_size, tree, 1));
+	return output;
+}
+
+lib_pac::stream_compressor::stream_compressor(compress_sink& sink, size_t total_size, uint32_t block_size,
+                                              uint32_t n_threads, uint32_t max_code_length, compression_level level)
+	: m_sink(sink),
+	  m_block_size(block_size),
+	  m_n_threads(pool_threads(n_threads)),
+	  m_max_code_length(max_code_length),
+	  m_level(level),
+	  m_next_block(0),
+	  m_data_size(0),
+	  m_remaining(total_size)
+{
+	m_block_count = total_size ? static_cast<uint32_t>((total_size - 1) / block_size + 1) : 0;
+	m_header_size = 16 + 12 * m_block_count;
+	m_table.resize(3 * m_block_count);
+	m_checksums.resize(m_block_count);
+
+	// The block table is written blank and filled in by finish
+	const uint32_t header[4] = { 0x1234, m_block_count, m_block_size, m_header_size };
+	m_sink.write(reinterpret_cast<const char*>(header), sizeof(header));
+	m_sink.write(reinterpret_cast<const char*>(m_table.data()), m_table.size() * sizeof(uint32_t));
+
+	m_input.reserve(m_block_size);
+}
+
+void
+lib_pac::stream_compressor::push(const char* data, size_t size)
+{
+	// Bytes past total_size have no room in the block table
+	size = std::min<size_t>(size, m_remaining);
+	m_remaining -= size;
+
+	const uint8_t* data8 = reinterpret_cast<const uint8_t*>(data);
+	while (size)
+	{
+		const size_t n = std::min<size_t>(size, m_block_size - m_input.size());
+		m_input.insert(m_input.end(), data8, data8 + n);
+		data8 += n;
+		size -= n;
+
+		if (m_input.size() == m_block_size)
+			dispatch();
+	}
+}
+
+uint32_t
+lib_pac::stream_compressor::finish()
+{
+	if (!m_input.empty())
+		dispatch();
+	while (!m_pending.empty())
+		retire();
+
+	m_sink.write_at(16, reinterpret_cast<const char*>(m_table.data()), m_table.size() * sizeof(uint32_t));
+	return m_header_size + m_data_size;
+}
+
+lib_pac::block_table
+lib_pac::stream_compressor::table() const
+{
+	block_table table;
+	table.header_size = m_header_size;
+	table.output_offsets.resize(m_block_count + 1);
+	table.compressed_sizes.resize(m_block_count);
+	table.data_offsets.resize(m_block_count);
+	table.checksums = m_checksums;
+
+	uint32_t output_offset = 0;
+	for (uint32_t i = 0; i < m_block_count; ++i)
+	{
+		table.output_offsets[i] = output_offset;
+		table.compressed_sizes[i] = m_table[3 * i + 1];
+		table.data_offsets[i] = m_table[3 * i + 2];
+		output_offset += m_table[3 * i];
+	}
+	table.output_offsets[m_block_count] = output_offset;
+	return table;
+}
+
+void
+lib_pac::stream_compressor::dispatch()
+{
+	if (m_pending.size() >= m_n_threads)
+		retire();
+
+	const uint32_t block = m_next_block + static_cast<uint32_t>(m_pending.size());
+	m_table[3 * block] = static_cast<uint32_t>(m_input.size());
+
+	// The task owns the block's input, it is freed as soon as the block is compressed
+	const uint32_t max_code_length = m_max_code_length;
+	const compression_level level = m_level;
+	m_pending.push_back(thread_pool::instance().submit([input = std::move(m_input), max_code_length, level]()
+	                                                   {
+		                                                   return stream_block(input, max_code_length, level);
+	                                                   }));
+
+	m_input = std::vector<uint8_t>();
+	m_input.reserve(m_block_size);
+}
+
+void
+lib_pac::stream_compressor::retire()
+{
+	const std::vector<uint8_t> output = thread_pool::instance().get(m_pending.front());
+	m_pending.pop_front();
+
+	const uint32_t block = m_next_block++;
+	m_table[3 * block + 1] = static_cast<uint32_t>(output.size());
+	m_table[3 * block + 2] = m_data_size;
+	m_checksums[block] = block_checksum(output.data(), output.size());
+	m_data_size += static_cast<uint32_t>(output.size());
+
+	m_sink.write(reinterpret_cast<const char*>(output.data()), output.size());
 }
 
 // Decompression
 
+// The header's sizes are computed in 64 bits, a block count whose table wraps around 32 bits is rejected
+static bool
+valid_header(uint32_t magic, uint32_t blk_cnt, uint32_t blk_sz, uint32_t header_sz)
+{
+	return magic == 0x1234 && header_sz == 16 + 12 * uint64_t(blk_cnt) && blk_sz <= MAX_BLOCK_SIZE;
+}
+
 std::unique_ptr<lib_pac::compressor_info>
 lib_pac::compressor::prepare_decompression(const char* data, size_t size)
 {
-	const uint32_t* data32 = reinterpret_cast<const uint32_t*>(data);
-
-	const uint32_t magic = *data32++;
-	if (magic != 0x1234)
+	if (size < 16)
 		return std::unique_ptr<compressor_info>(nullptr);
 
-	const uint32_t blk_cnt = *data32++;
-	const uint32_t blk_sz = *data32++;
-	const uint32_t header_sz = *data32++;
+	uint32_t header[4];
+	std::memcpy(header, data, sizeof(header));
+	const uint32_t blk_cnt = header[1];
+	const uint32_t blk_sz = header[2];
+	const uint32_t header_sz = header[3];
 
-	if (header_sz != 16 + 12 * blk_cnt)
+	if (!valid_header(header[0], blk_cnt, blk_sz, header_sz) || header_sz > size)
 		return std::unique_ptr<compressor_info>(nullptr);
 
+	std::vector<uint32_t> entries(3 * size_t(blk_cnt));
+	std::memcpy(entries.data(), data + 16, 12 * size_t(blk_cnt));
+
 	auto info = std::make_unique<compressor_info>();
 	info->set_input(data, size);
 	info->set_blocks(blk_cnt, blk_sz);
 
-	uint32_t output_size = 0;
+	// Every block has to fit the declared block size and lie inside the data
+	uint64_t output_size = 0;
 	for (uint32_t i = 0; i < blk_cnt; ++i)
 	{
-		const uint32_t dec_sz = *data32++;
-		const uint32_t cmp_sz = *data32++;
-		const uint32_t offset = *data32++;
+		const uint32_t dec_sz = entries[3 * i];
+		const uint32_t cmp_sz = entries[3 * i + 1];
+		const uint32_t offset = entries[3 * i + 2];
 
 		output_size += dec_sz;
+		if (dec_sz > blk_sz || output_size > UINT32_MAX || uint64_t(header_sz) + offset + cmp_sz > size)
+			return std::unique_ptr<compressor_info>(nullptr);
 		info->set_data_chunk(i, dec_sz, cmp_sz, offset);
 	}
-	info->set_output(output_size);
+	info->set_output(static_cast<uint32_t>(output_size));
 
 	return std::move(info);
 }
 
-void
-lib_pac::compressor::decompress(const compressor_info& info, char* dst, uint32_t n_threads)
+bool
+lib_pac::compressor::decompress(const compressor_info& info, char* dst, uint32_t n_threads, uint32_t segment_size)
 {
-	if (!n_threads)
-		n_threads = std::thread::hardware_concurrency();
+	n_threads = pool_threads(n_threads);
 
 	const uint32_t blk_cnt = info.block_count();
 	const uint32_t blk_sz = info.block_size();
 	const uint32_t input_sz = info.input_size();
 	const uint8_t* input_buf = info.input();
 
-	std::vector<std::future<void>> futures(blk_cnt);
-
-	semaphore limiter(n_threads);
 	uint8_t* dst8 = reinterpret_cast<uint8_t*>(dst);
 	size_t headerSize = 16 + 12 * blk_cnt;
 
+	std::vector<uint32_t> dst_offsets(blk_cnt);
 	uint32_t dst_offset = 0;
 	for (int i = 0; i < blk_cnt; ++i)
+	{
+		dst_offsets[i] = dst_offset;
+		dst_offset += info.chunk_decompressed_size(i);
+	}
+
+	std::atomic<bool> valid(true);
+	thread_pool::instance().parallel_for(blk_cnt, n_threads, task_grain(blk_sz), [&](uint32_t i)
 	{
 		const uint32_t in_chunk_sz = info.chunk_compressed_size(i);
 		const uint32_t out_chunk_sz = info.chunk_decompressed_size(i);
 		const uint32_t src_offset = info.chunk_data_offset(i);
+		const uint32_t n_segments = segment_size ? std::min({ in_chunk_sz / segment_size, n_threads, MAX_SEGMENTS }) : 0;
+
+		if (!block_decompress(dst8 + dst_offsets[i], out_chunk_sz, input_buf + src_offset + headerSize, in_chunk_sz,
+		                      n_segments))
+			valid = false;
+	});
+	return valid;
+}
+
+// Streaming Decompression
 
-		huffman_tree& tree = info.trees(i);
-		futures[i] = std::async(std::launch::async,
-			block_decompress,
-			dst8 + dst_offset,
-			out_chunk_sz,
-			input_buf + src_offset + headerSize,
-			in_chunk_sz,
-			std::ref(limiter));
+// Returns count compressed bytes from offset, pointing into memory or filled into buffer, null when out of range
+typedef std::function<const uint8_t*(uint32_t offset, uint32_t count, std::vector<uint8_t>& buffer)> block_reader;
+
+static bool
+read_table(const block_reader& read, lib_pac::block_table& table)
+{
+	std::vector<uint8_t> buffer;
+	const uint8_t* header8 = read(0, 16, buffer);
+	if (!header8)
+		return false;
+
+	uint32_t header[4];
+	std::memcpy(header, header8, sizeof(header));
+	const uint32_t blk_cnt = header[1];
+	const uint32_t blk_sz = header[2];
+	const uint32_t header_sz = header[3];
+	if (!valid_header(header[0], blk_cnt, blk_sz, header_sz))
+		return false;
 
-		dst_offset += out_chunk_sz;
+	// The table has to be in the data before anything is allocated for it
+	const uint8_t* table8 = read(16, header_sz - 16, buffer);
+	if (!table8)
+		return false;
+	std::vector<uint32_t> entries(3 * size_t(blk_cnt));
+	std::memcpy(entries.data(), table8, 12 * size_t(blk_cnt));
+
+	table.header_size = header_sz;
+	table.output_offsets.resize(blk_cnt + 1);
+	table.compressed_sizes.resize(blk_cnt);
+	table.data_offsets.resize(blk_cnt);
+
+	uint64_t output_offset = 0;
+	for (uint32_t i = 0; i < blk_cnt; ++i)
+	{
+		if (entries[3 * i] > blk_sz || uint64_t(header_sz) + entries[3 * i + 2] + entries[3 * i + 1] > UINT32_MAX)
+			return false;
+		table.output_offsets[i] = static_cast<uint32_t>(output_offset);
+		table.compressed_sizes[i] = entries[3 * i + 1];
+		table.data_offsets[i] = entries[3 * i + 2];
+		output_offset += entries[3 * i];
 	}
+	if (output_offset > UINT32_MAX)
+		return false;
+	table.output_offsets[blk_cnt] = static_cast<uint32_t>(output_offset);
 
-	for (int i = 0; i < blk_cnt; ++i)
-		futures[i].get();
+	return true;
+}
+
+static bool
+decompress_blocks(const block_reader& read, lib_pac::data_sink& sink, uint32_t n_threads)
+{
+	n_threads = pool_threads(n_threads);
+
+	lib_pac::block_table table;
+	if (!read_table(read, table))
+		return false;
+
+	// A block whose tree is corrupt comes back empty and invalid, it and everything after it is dropped
+	struct decoded_block
+	{
+		std::vector<uint8_t> data;
+		bool valid;
+	};
+
+	lib_pac::thread_pool& pool = lib_pac::thread_pool::instance();
+	std::deque<std::future<decoded_block>> pending;
+	bool valid = true;
+	const auto retire = [&]()
+	{
+		const decoded_block output = pool.get(pending.front());
+		pending.pop_front();
+		valid = valid && output.valid;
+		if (valid)
+			sink.write(reinterpret_cast<const char*>(output.data.data()), output.data.size());
+	};
+
+	const uint32_t blk_cnt = static_cast<uint32_t>(table.compressed_sizes.size());
+	for (uint32_t i = 0; i < blk_cnt; ++i)
+	{
+		const uint32_t dec_sz = table.output_offsets[i + 1] - table.output_offsets[i];
+		const uint32_t cmp_sz = table.compressed_sizes[i];
+
+		if (pending.size() >= n_threads)
+			retire();
+		if (!valid)
+			break;
+
+		std::vector<uint8_t> input;
+		const uint8_t* src = read(table.header_size + table.data_offsets[i], cmp_sz, input);
+		if (!src)
+		{
+			while (!pending.empty())
+				retire();
+			return false;
+		}
+
+		// Moving the input into the task keeps its storage, src stays valid
+		pending.push_back(pool.submit([input = std::move(input), src, dec_sz, cmp_sz]()
+		                              {
+			                              decoded_block output;
+			                              output.data.resize(dec_sz);
+			                              output.valid = block_decompress(output.data.data(), dec_sz, src, cmp_sz, 0);
+			                              return output;
+		                              }));
+	}
+
+	while (!pending.empty())
+		retire();
+	return valid;
+}
+
+static block_reader
+source_reader(lib_pac::file_source_base& source)
+{
+	const uint32_t size = source.data_size();
+
+	// Mapped entries are decoded where they lie
+	const uint8_t* view = reinterpret_cast<const uint8_t*>(source.data_view());
+	if (view)
+	{
+		return [view, size](uint32_t offset, uint32_t count, std::vector<uint8_t>&) -> const uint8_t*
+		{
+			if (offset > size || count > size - offset)
+				return nullptr;
+			return view + offset;
+		};
+	}
+
+	return [&source, size](uint32_t offset, uint32_t count, std::vector<uint8_t>& buffer) -> const uint8_t*
+	{
+		if (offset > size || count > size - offset)
+			return nullptr;
+		buffer.resize(count);
+		source.copy_data(reinterpret_cast<char*>(buffer.data()), offset, count);
+		return buffer.data();
+	};
+}
+
+bool
+lib_pac::compressor::decompress_stream(file_source_base& source, data_sink& sink, uint32_t n_threads)
+{
+	return decompress_blocks(source_reader(source), sink, n_threads);
+}
+
+static block_reader
+memory_reader(const char* data, size_t size)
+{
+	const uint8_t* data8 = reinterpret_cast<const uint8_t*>(data);
+	return [data8, size](uint32_t offset, uint32_t count, std::vector<uint8_t>&) -> const uint8_t*
+	{
+		if (offset > size || count > size - offset)
+			return nullptr;
+		return data8 + offset;
+	};
+}
+
+bool
+lib_pac::compressor::decompress_stream(const char* data, size_t size, data_sink& sink, uint32_t n_threads)
+{
+	return decompress_blocks(memory_reader(data, size), sink, n_threads);
+}
+
+// Random Access
+
+// Every block has to lie inside the data for ranges to be read without further checks
+static std::shared_ptr<const lib_pac::block_table>
+checked_table(const block_reader& read, uint64_t size)
+{
+	auto table = std::make_shared<lib_pac::block_table>();
+	if (!read_table(read, *table))
+		return nullptr;
+
+	for (size_t i = 0; i < table->compressed_sizes.size(); ++i)
+	{
+		if (uint64_t(table->header_size) + table->data_offsets[i] + table->compressed_sizes[i] > size)
+			return nullptr;
+	}
+	return table;
+}
+
+std::shared_ptr<const lib_pac::block_table>
+lib_pac::compressor::read_block_table(file_source_base& source)
+{
+	return checked_table(source_reader(source), source.data_size());
+}
+
+std::shared_ptr<const lib_pac::block_table>
+lib_pac::compressor::read_block_table(const char* data, size_t size)
+{
+	return checked_table(memory_reader(data, size), size);
+}
+
+uint32_t
+lib_pac::compressor::read_range(file_source_base& source, const block_table& table, char* dst, uint32_t offset,
+                                uint32_t count, uint32_t n_threads)
+{
+	n_threads = pool_threads(n_threads);
+
+	const std::vector<uint32_t>& outputs = table.output_offsets;
+	const uint32_t total = outputs.back();
+	if (offset >= total)
+		return 0;
+	count = std::min(count, total - offset);
+	if (!count)
+		return 0;
+	const uint32_t end = offset + count;
+
+	// Blocks first..last overlap the range
+	const uint32_t first = static_cast<uint32_t>(std::upper_bound(outputs.begin(), outputs.end(), offset) - outputs.begin()) - 1;
+	const uint32_t last = static_cast<uint32_t>(std::lower_bound(outputs.begin(), outputs.end(), end) - outputs.begin()) - 1;
+
+	const uint8_t* view = reinterpret_cast<const uint8_t*>(source.data_view());
+	std::atomic<bool> corrupt(false);
+
+	thread_pool::instance().parallel_for(last - first + 1, n_threads, 1, [&](uint32_t n)
+	{
+		const uint32_t i = first + n;
+		const uint32_t dec_sz = outputs[i + 1] - outputs[i];
+		const uint32_t cmp_sz = table.compressed_sizes[i];
+
+		// Bytes of this block inside the range
+		const uint32_t from = std::max(offset, outputs[i]);
+		const uint32_t to = std::min(end, outputs[i + 1]);
+		char* out = dst + (from - offset);
+
+		const uint32_t data_offset = table.header_size + table.data_offsets[i];
+		std::vector<uint8_t> input;
+		const uint8_t* src;
+		if (view)
+		{
+			src = view + data_offset;
+		}
+		else
+		{
+			input.resize(cmp_sz);
+			source.copy_data(reinterpret_cast<char*>(input.data()), data_offset, cmp_sz);
+			src = input.data();
+		}
+
+		if (!table.checksums.empty() && block_checksum(src, cmp_sz) != table.checksums[i])
+		{
+			corrupt = true;
+			return;
+		}
+
+		// Whole blocks decode in place, partial ones through a scratch buffer
+		if (to - from == dec_sz)
+		{
+			if (!block_decompress(reinterpret_cast<uint8_t*>(out), dec_sz, src, cmp_sz, 0))
+				corrupt = true;
+			return;
+		}
+
+		std::vector<uint8_t> output(dec_sz);
+		if (!block_decompress(output.data(), dec_sz, src, cmp_sz, 0))
+		{
+			corrupt = true;
+			return;
+		}
+		std::memcpy(out, output.data() + (from - outputs[i]), to - from);
+	});
+	return corrupt ? 0 : count;
+}
+
+// Decoder Cache
+
+lib_pac::decoder_cache_stats
+lib_pac::compressor::cache_stats()
+{
+	const decoder_cache& cache = decoder_cache::instance();
+	return lib_pac::decoder_cache_stats{ cache.hits(), cache.misses() };
+}
+
+void
+lib_pac::compressor::reset_cache_stats()
+{
+	decoder_cache::instance().reset_counters();
+}
+
+void
+lib_pac::compressor::set_cache_capacity(size_t entries)
+{
+	decoder_cache::instance().set_capacity(entries);
+}
+
+size_t
+lib_pac::compressor::cache_capacity()
+{
+	return decoder_cache::instance().capacity();
+}
+
+// Threads
+
+void
+lib_pac::compressor::set_thread_count(uint32_t n_threads)
+{
+	thread_pool::set_size(n_threads);
+}
+
+uint32_t
+lib_pac::compressor::thread_count()
+{
+	return thread_pool::instance().size();
 }
 
 // Compression Info Getters
@@ -254,33 +1001,41 @@ lib_pac::compressor_info::set_blocks(uint32_t count, uint32_t size)
 	m_block_count = count;
 	m_block_size = size;
 
-	m_trees.resize(count);
 	m_chunk_cmp_sizes.resize(count);
 	m_chunk_dec_sizes.resize(count);
 	m_chunk_data_offsets.resize(count);
 }
 
+void
+lib_pac::compressor_info::set_chunks(const std::vector<size_t>& compressed_sizes)
+{
+	uint32_t output_size = 16 + 12 * m_block_count;
+	uint32_t chunk_offset = 0;
+	for (uint32_t i = 0; i < m_block_count; ++i)
+	{
+		const uint32_t src_off = i * m_block_size;
+		const uint32_t src_sz = std::min<uint32_t>(m_block_size, m_input_size - src_off);
+
+		set_data_chunk(i, src_sz, compressed_sizes[i], chunk_offset);
+		output_size += compressed_sizes[i];
+		chunk_offset += compressed_sizes[i];
+	}
+	set_output(output_size);
+}
+
 bool
 lib_pac::compressor_info::set_data_chunk(int n, uint32_t decompressed_size, uint32_t compressed_size,
-                                         uint32_t data_offset, std::unique_ptr<huffman_tree> tree)
+                                         uint32_t data_offset)
 {
 	if (n > m_block_count)
 		return false;
 
-	m_trees[n] = std::move(tree);
 	m_chunk_cmp_sizes[n] = compressed_size;
 	m_chunk_dec_sizes[n] = decompressed_size;
 	m_chunk_data_offsets[n] = data_offset;
 	return true;
 }
 
-bool
-lib_pac::compressor_info::set_data_chunk(int n, uint32_t decompressed_size, uint32_t compressed_size,
-                                         uint32_t data_offset)
-{
-	return set_data_chunk(n, decompressed_size, compressed_size, data_offset, std::unique_ptr<huffman_tree>(nullptr));
-}
-
 
 uint32_t
 lib_pac::compressor_info::input_size() const
@@ -306,10 +1061,10 @@ lib_pac::compressor_info::block_count() const
 	return m_block_count;
 }
 
-lib_pac::huffman_tree&
+const lib_pac::huffman_tree&
 lib_pac::compressor_info::trees(int i) const
 {
-	return *m_trees[i];
+	return m_trees[i];
 }
 
 uint32_t
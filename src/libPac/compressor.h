@@ -3,10 +3,43 @@
 
 #include <stdint.h>
 #include "huffman.h"
+#include <array>
+#include <deque>
+#include <future>
 #include <memory>
+#include <vector>
 
 namespace lib_pac
 {
+	enum class compression_level : uint8_t
+	{
+		normal,
+		// Trees are built from a sample of each block, every byte value in it still gets a code.
+		// Block sizes are only bounded until compression, which packs them tightly.
+		fast,
+	};
+
+	class file_source_base;
+
+	// Receives streamed output in order
+	class data_sink
+	{
+	public:
+		data_sink() = default;
+		virtual ~data_sink() = default;
+
+		// Appends data after everything written so far
+		virtual void write(const char* data, size_t size) = 0;
+	};
+
+	// Receives the output of a stream_compressor
+	class compress_sink : public data_sink
+	{
+	public:
+		// Rewrites bytes written earlier, the block table is filled in last
+		virtual void write_at(size_t offset, const char* data, size_t size) = 0;
+	};
+
 	class compressor_info
 	{
 		friend class compressor;
@@ -15,8 +48,9 @@ namespace lib_pac
 		uint32_t m_output_size;
 		uint32_t m_block_size;
 		uint32_t m_block_count;
+		compression_level m_level;
 
-		std::vector<std::unique_ptr<huffman_tree>> m_trees;
+		std::vector<huffman_tree> m_trees;
 		std::vector<size_t> m_chunk_dec_sizes;
 		std::vector<size_t> m_chunk_cmp_sizes;
 		std::vector<size_t> m_chunk_data_offsets;
@@ -25,10 +59,11 @@ namespace lib_pac
 		void set_input(const void* buf, uint32_t size);
 		void set_output(uint32_t size);
 		void set_blocks(uint32_t count, uint32_t maximum_size);
-		bool set_data_chunk(int n, uint32_t decompressed_size, uint32_t compressed_size, uint32_t data_offset, std::unique_ptr<huffman_tree> tree);
+		// Lays the blocks out one after the other from their compressed sizes
+		void set_chunks(const std::vector<size_t>& compressed_sizes);
 		bool set_data_chunk(int n, uint32_t decompressed_size, uint32_t compressed_size, uint32_t data_offset);
 
-		inline huffman_tree& trees(int i) const;
+		inline const huffman_tree& trees(int i) const;
 		inline uint32_t chunk_compressed_size(int i) const;
 		inline uint32_t chunk_decompressed_size(int i) const;
 		inline uint32_t chunk_data_offset(int i) const;
@@ -44,13 +79,121 @@ namespace lib_pac
 	};
 
 
+	struct decoder_cache_stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+	};
+
+	struct block_size_choice
+	{
+		uint32_t block_size;
+		// Predicted output for block_size and for the reference size it was picked over
+		uint32_t output_size;
+		uint32_t reference_output_size;
+
+		// Byte counts of every 16 KiB of the data, prepare_compression builds its trees from them
+		uint32_t max_code_length;
+		std::vector<std::array<uint32_t, 0x100>> histograms;
+	};
+
+	// Where every block of a compressed stream lives, read once and kept to serve byte ranges
+	struct block_table
+	{
+		uint32_t header_size;
+		// Decompressed offset of every block, followed by the total decompressed size
+		std::vector<uint32_t> output_offsets;
+		std::vector<uint32_t> compressed_sizes;
+		// Relative to the end of the header
+		std::vector<uint32_t> data_offsets;
+		// CRC-32C of every block's compressed bytes when known, read_range rejects blocks that don't match
+		std::vector<uint32_t> checksums;
+	};
+
 	class compressor
 	{
 	public:
-		EXPORTS static std::unique_ptr<compressor_info> prepare_compression(const char* data, size_t size, uint32_t block_size, uint32_t n_threads = 0);
-		EXPORTS static void compress(const compressor_info& info, char* dst, uint32_t n_threads = 0);
+		// max_code_length caps Huffman code lengths (0 leaves them unbounded), shorter codes decode faster.
+		// Decoders refuse blocks over 16 MiB, block_size has to stay at or below that.
+		EXPORTS static std::unique_ptr<compressor_info> prepare_compression(const char* data, size_t size, uint32_t block_size, uint32_t n_threads = 0, uint32_t max_code_length = 0, compression_level level = compression_level::normal);
+		// Same output as the normal level with choice.block_size, without counting the data a second time
+		EXPORTS static std::unique_ptr<compressor_info> prepare_compression(const char* data, size_t size, const block_size_choice& choice, uint32_t n_threads = 0);
+		// Predicts the output of every power of two block size up to max_block_size from block histograms, and
+		// picks the smallest. reference_block_size is kept unless another size beats it.
+		EXPORTS static block_size_choice choose_block_size(const char* data, size_t size, uint32_t max_block_size, uint32_t reference_block_size, uint32_t n_threads = 0, uint32_t max_code_length = 0);
+		// Returns the bytes written, output_size() for the normal level and at most that for the fast one
+		EXPORTS static uint32_t compress(const compressor_info& info, char* dst, uint32_t n_threads = 0);
 
+		// Returns null when the header is invalid or a block doesn't lie inside the data
 		EXPORTS static std::unique_ptr<compressor_info> prepare_decompression(const char* data, size_t size);
-		EXPORTS static void decompress(const compressor_info& info, char* dst, uint32_t n_threads = 0);
+		// A non zero segment_size splits blocks at least twice that big into segments decoded speculatively
+		// in parallel, for files with huge blocks. 0 keeps every block on a single thread.
+		// Returns false when a block's tree is corrupt, that block's output is left unwritten.
+		EXPORTS static bool decompress(const compressor_info& info, char* dst, uint32_t n_threads = 0, uint32_t segment_size = 0);
+		// Decodes block by block into sink, in order, with at most n_threads blocks in flight. Compressed data is
+		// read from source a block at a time, memory stays at a few blocks per thread whatever the entry size.
+		// Returns false, possibly after writing some blocks, when the data isn't a valid compressed stream.
+		EXPORTS static bool decompress_stream(file_source_base& source, data_sink& sink, uint32_t n_threads = 0);
+		EXPORTS static bool decompress_stream(const char* data, size_t size, data_sink& sink, uint32_t n_threads = 0);
+		// Returns null when the source doesn't hold a valid block table
+		EXPORTS static std::shared_ptr<const block_table> read_block_table(file_source_base& source);
+		EXPORTS static std::shared_ptr<const block_table> read_block_table(const char* data, size_t size);
+		// Decodes only the blocks overlapping count bytes of decompressed data from offset, into dst.
+		// Returns the bytes read, short when the range runs past the end of the data and 0 when a block
+		// is corrupt or fails its checksum.
+		EXPORTS static uint32_t read_range(file_source_base& source, const block_table& table, char* dst, uint32_t offset,
+		                                   uint32_t count, uint32_t n_threads = 0);
+
+		// Blocks with identical trees share one decoder. The cache is off (capacity 0) until set_cache_capacity
+		// turns it on, it only pays off for data whose blocks repeat the same trees.
+		EXPORTS static decoder_cache_stats cache_stats();
+		EXPORTS static void reset_cache_stats();
+		EXPORTS static void set_cache_capacity(size_t entries);
+		EXPORTS static size_t cache_capacity();
+
+		// Every entry point runs its blocks on one shared pool, n_threads arguments only cap how much of it a
+		// call uses. The pool is sized on first use, from set_thread_count or else from the hardware (0).
+		EXPORTS static void set_thread_count(uint32_t n_threads);
+		EXPORTS static uint32_t thread_count();
+	};
+
+	// Compresses input pushed in pieces of any size, each block is compressed as soon as it fills and goes to
+	// the sink in order. At most n_threads blocks are in flight, so memory stays at a few blocks per thread
+	// whatever the input size. The output matches compress() with the same block size.
+	class stream_compressor
+	{
+	private:
+		compress_sink& m_sink;
+		uint32_t m_block_size;
+		uint32_t m_n_threads;
+		uint32_t m_max_code_length;
+		compression_level m_level;
+
+		// Decompressed size, compressed size and data offset of every block
+		std::vector<uint32_t> m_table;
+		std::vector<uint32_t> m_checksums;
+		uint32_t m_header_size;
+		uint32_t m_block_count;
+		uint32_t m_next_block;
+		uint32_t m_data_size;
+		size_t m_remaining;
+
+		std::vector<uint8_t> m_input;
+		std::deque<std::future<std::vector<uint8_t>>> m_pending;
+
+		void dispatch();
+		void retire();
+
+	public:
+		// total_size is the number of bytes that will be pushed, it sizes the block table and anything
+		// pushed past it is dropped
+		EXPORTS stream_compressor(compress_sink& sink, size_t total_size, uint32_t block_size, uint32_t n_threads = 0,
+		                          uint32_t max_code_length = 0, compression_level level = compression_level::normal);
+
+		EXPORTS void push(const char* data, size_t size);
+		// Compresses the last block and fills in the block table, returns the bytes written
+		EXPORTS uint32_t finish();
+		// Where every block went, with the CRC-32C of its compressed bytes, complete once finish returned
+		EXPORTS block_table table() const;
 	};
 }
@@ -0,0 +1,173 @@
+#include "console.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cwchar>
+#include <cwctype>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+namespace fs = std::experimental::filesystem;
+
+void
+lib_pac::console::print_save_usage()
+{
+	std::cout << "  --fast            Build trees from a sample of each block, slightly larger output" << std::endl;
+	std::cout << "  --store <ext>     Always store files with this extension uncompressed" << std::endl;
+	std::cout << "  --compress <ext>  Always compress files with this extension" << std::endl;
+	std::cout << "  --memory <MiB>    Cap on file data read ahead of writing, default 512" << std::endl;
+	std::cout << "  --index           Write a .pacidx index next to each archive, opening it gets faster" << std::endl;
+}
+
+// Reads the value following argv[i] as a whole number no larger than max, moving i past it. Larger numbers
+// are clamped, anything else is reported.
+static bool
+parse_number(int argc, const wchar_t** argv, int& i, uint64_t max, uint64_t& value)
+{
+	const std::string option = fs::path(argv[i]).string();
+	if (i + 1 >= argc)
+	{
+		std::cerr << option << " needs a value" << std::endl;
+		return false;
+	}
+
+	const wchar_t* text = argv[++i];
+	wchar_t* end = nullptr;
+	const unsigned long long number = std::wcstoull(text, &end, 10);
+	if (!std::iswdigit(text[0]) || *end != L'\0')
+	{
+		std::cerr << option << " takes a whole number, not " << fs::path(text).string() << std::endl;
+		return false;
+	}
+
+	// Out of range numbers come back as ULLONG_MAX and clamp too
+	value = std::min<uint64_t>(number, max);
+	return true;
+}
+
+lib_pac::console::option_result
+lib_pac::console::parse_save_option(int argc, const wchar_t** argv, int& i, pac_archive::save_options& options)
+{
+	const std::wstring arg = argv[i];
+	if (arg == L"--fast")
+	{
+		options.level = compression_level::fast;
+		return option_result::parsed;
+	}
+	if (arg == L"--index")
+	{
+		options.write_index = true;
+		return option_result::parsed;
+	}
+	if (arg == L"--memory")
+	{
+		// Clamped to what still fits in bytes
+		uint64_t mib;
+		if (!parse_number(argc, argv, i, UINT64_MAX >> 20, mib))
+			return option_result::invalid;
+
+		options.max_buffered_bytes = mib << 20;
+		return option_result::parsed;
+	}
+	if (arg == L"--store" || arg == L"--compress")
+	{
+		if (i + 1 >= argc)
+		{
+			std::cerr << fs::path(arg).string() << " needs an extension" << std::endl;
+			return option_result::invalid;
+		}
+
+		std::string extension = fs::path(argv[++i]).string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (extension.empty() || extension.front() != '.')
+			extension.insert(extension.begin(), '.');
+
+		options.extension_storage[extension] = arg == L"--store"
+			                                       ? pac_archive::entry_storage::store
+			                                       : pac_archive::entry_storage::compress;
+		return option_result::parsed;
+	}
+	return option_result::not_option;
+}
+
+lib_pac::console::option_result
+lib_pac::console::parse_jobs_option(int argc, const wchar_t** argv, int& i, uint32_t& n_jobs)
+{
+	if (std::wstring(argv[i]) != L"--jobs")
+		return option_result::not_option;
+
+	uint64_t jobs;
+	if (!parse_number(argc, argv, i, UINT32_MAX, jobs))
+		return option_result::invalid;
+
+	n_jobs = std::max(static_cast<uint32_t>(jobs), 1u);
+	return option_result::parsed;
+}
+
+static std::mutex output_mutex;
+
+void
+lib_pac::console::print_line(const std::string& archive, const std::string& line)
+{
+	std::lock_guard<std::mutex> lock(output_mutex);
+
+	std::istringstream lines(line);
+	std::string next;
+	while (std::getline(lines, next))
+		std::cout << archive << ": " << next << "\n";
+	std::cout.flush();
+}
+
+void
+lib_pac::console::report_save_progress(const std::string& archive, const pac_archive::progress_info& info)
+{
+	const int n_digits = ceil(log10(info.num_files));
+	const float ratio = info.compressed_size * 100.f / info.raw_size;
+
+	std::ostringstream line;
+	line << "[" << std::setw(n_digits) << info.cur_file << "/" << info.num_files << "] ";
+	line << std::fixed << std::setprecision(0) << ratio << "% - " << info.file_name;
+	if (info.stored)
+		line << " (stored)";
+	else if (info.block_size && info.block_size != pac_archive::DEFAULT_BLOCK_SIZE)
+		line << " (" << info.block_size / 1024 << " KiB blocks, " << info.saved_size << " bytes saved)";
+	print_line(archive, line.str());
+}
+
+void
+lib_pac::console::report_save(const std::string& archive, const pac_archive::archive_info& info)
+{
+	const float ratio = (info.compressed_size + info.header_size) * 100.f / (info.original_size);
+
+	std::ostringstream stats;
+	stats << "Total Size       : " << info.compressed_size + info.header_size << std::endl;
+	stats << "Compression Ratio: " << std::fixed << std::setprecision(2) << ratio << "%" << std::endl;
+	stats << "Stored Files     : " << info.stored_files << std::endl;
+
+	const auto& pipeline = info.pipeline;
+	stats << "Stalls (ms)      : read " << pipeline.read_stall_us / 1000 << ", compress "
+		<< pipeline.compress_stall_us / 1000 << ", write " << pipeline.write_stall_us / 1000 << std::endl;
+	stats << "Queue Depths     : " << pipeline.max_compress_queue << " to compress, " << pipeline.max_write_queue
+		<< " to write, " << (pipeline.peak_buffered_bytes >> 20) << " MiB buffered";
+	if (info.index_failed)
+		stats << std::endl << "Index            : could not be written";
+	print_line(archive, stats.str());
+}
+
+int
+lib_pac::console::report_batch(const archive_batch::batch_info& info)
+{
+	for (const auto& failure : info.failures)
+		std::cerr << "Failed: " << failure.name << " - " << failure.reason << std::endl;
+
+	const double mib = info.total_bytes / 1048576.0;
+	const double seconds = info.elapsed_us / 1e6;
+	std::cout << "Archives         : " << info.archives << ", " << info.failures.size() << " failed" << std::endl;
+	std::cout << "Throughput       : " << std::fixed << std::setprecision(1) << mib << " MiB in " << seconds << "s, "
+		<< (seconds > 0 ? mib / seconds : 0.) << " MiB/s" << std::endl;
+	return info.failures.empty() ? 0 : 1;
+}
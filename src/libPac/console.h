@@ -0,0 +1,42 @@
+#pragma once
+#include "defines.h"
+
+#include <stdint.h>
+#include <string>
+
+#include "batch.h"
+#include "pac.h"
+
+namespace lib_pac
+{
+	// Command line handling and output shared by the pack, patch and unpack tools, which all run their
+	// archives through an archive_batch
+	namespace console
+	{
+		enum class option_result
+		{
+			// argv[i] isn't an option the parser knows
+			not_option,
+			parsed,
+			// The option's value is missing or not a number, the error is printed and the tool should stop
+			invalid,
+		};
+
+		// Lists the options parse_save_option reads
+		EXPORTS void print_save_usage();
+		// Reads the save option at argv[i] into options, moving i past its value
+		EXPORTS option_result parse_save_option(int argc, const wchar_t** argv, int& i,
+		                                        pac_archive::save_options& options);
+		// Reads --jobs <n> at argv[i], at least 1
+		EXPORTS option_result parse_jobs_option(int argc, const wchar_t** argv, int& i, uint32_t& n_jobs);
+
+		// Several archives are processed at once, so each line is written whole and tagged with its archive
+		EXPORTS void print_line(const std::string& archive, const std::string& line);
+		// One line per saved file, with its ratio and the block size picked for it
+		EXPORTS void report_save_progress(const std::string& archive, const pac_archive::progress_info& info);
+		// Size, ratio and pipeline statistics of a saved archive
+		EXPORTS void report_save(const std::string& archive, const pac_archive::archive_info& info);
+		// Lists the archives that failed and the batch's throughput, returns the tool's exit code
+		EXPORTS int report_batch(const archive_batch::batch_info& info);
+	}
+}
@@ -0,0 +1,147 @@
+#include "decodecache.h"
+#include "kernels.h"
+#include <cstring>
+
+
+// Walks the serialized tree without building it, a tree is a branch bit followed by
+// two subtrees, or a leaf bit followed by its 8 bit value
+static bool
+measure_tree(const uint8_t* src, size_t src_size, size_t* tree_bits)
+{
+	lib_pac::bit_reader reader(src, src_size);
+
+	uint32_t pending = 1;
+	uint32_t nodes = 0;
+	while (pending)
+	{
+		if (++nodes > lib_pac::huffman_tree::MAX_NODES)
+			return false;
+
+		if (reader.read_bit())
+		{
+			pending++;
+		}
+		else
+		{
+			reader.read_byte();
+			pending--;
+		}
+	}
+
+	uint8_t bit;
+	const size_t offset = reader.tell(&bit);
+	*tree_bits = offset * 8 + bit;
+	return *tree_bits <= src_size * 8;
+}
+
+uint64_t
+lib_pac::decoder_cache::make_key(const std::vector<uint8_t>& tree_bytes, size_t tree_bits)
+{
+	const uint32_t crc = block_checksum(tree_bytes.data(), tree_bytes.size());
+	return static_cast<uint64_t>(tree_bits) << 32 | crc;
+}
+
+lib_pac::decoder_cache::decoder_cache(size_t capacity)
+	: m_capacity(capacity), m_hits(0), m_misses(0)
+{
+}
+
+std::shared_ptr<const lib_pac::cached_decoder>
+lib_pac::decoder_cache::get(const uint8_t* src, size_t src_size)
+{
+	size_t tree_bits;
+	if (!measure_tree(src, src_size, &tree_bits))
+		return nullptr;
+
+	// Bits after the tree belong to the data, they are masked off before hashing
+	std::vector<uint8_t> tree_bytes(src, src + (tree_bits + 7) / 8);
+	if (tree_bits % 8)
+		tree_bytes.back() &= 0xFF << (8 - tree_bits % 8);
+	const uint64_t key = make_key(tree_bytes, tree_bits);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto found = m_entries.find(key);
+		if (found != m_entries.end() && (*found->second)->tree_bytes == tree_bytes)
+		{
+			m_lru.splice(m_lru.begin(), m_lru, found->second);
+			m_hits++;
+			return *found->second;
+		}
+	}
+	m_misses++;
+
+	// Built outside the lock, two threads missing on the same tree just build it twice
+	auto entry = std::make_shared<cached_decoder>();
+	lib_pac::bit_reader reader(src, src_size);
+	if (!entry->tree.read(reader))
+		return nullptr;
+	entry->has_decoder = entry->tree.generate_decoder(entry->decoder);
+	entry->key = key;
+	entry->tree_bits = tree_bits;
+	entry->tree_bytes.swap(tree_bytes);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_capacity)
+		return entry;
+
+	const auto found = m_entries.find(key);
+	if (found != m_entries.end())
+	{
+		m_lru.erase(found->second);
+		m_entries.erase(found);
+	}
+	while (m_lru.size() >= m_capacity)
+	{
+		m_entries.erase(m_lru.back()->key);
+		m_lru.pop_back();
+	}
+
+	m_lru.push_front(entry);
+	m_entries[key] = m_lru.begin();
+	return entry;
+}
+
+void
+lib_pac::decoder_cache::set_capacity(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_capacity = capacity;
+	while (m_lru.size() > m_capacity)
+	{
+		m_entries.erase(m_lru.back()->key);
+		m_lru.pop_back();
+	}
+}
+
+size_t
+lib_pac::decoder_cache::capacity() const
+{
+	return m_capacity;
+}
+
+uint64_t
+lib_pac::decoder_cache::hits() const
+{
+	return m_hits;
+}
+
+uint64_t
+lib_pac::decoder_cache::misses() const
+{
+	return m_misses;
+}
+
+void
+lib_pac::decoder_cache::reset_counters()
+{
+	m_hits = 0;
+	m_misses = 0;
+}
+
+lib_pac::decoder_cache&
+lib_pac::decoder_cache::instance()
+{
+	static decoder_cache cache(DEFAULT_CAPACITY);
+	return cache;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "defines.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "huffman.h"
+
+namespace lib_pac
+{
+	// Decoding structures for one serialized tree, shared by every block that starts with the same bits
+	struct cached_decoder
+	{
+		uint64_t key;
+		std::vector<uint8_t> tree_bytes;
+		size_t tree_bits;
+
+		huffman_tree tree;
+		bit_decoder decoder;
+		bool has_decoder;
+	};
+
+	class decoder_cache
+	{
+	private:
+		typedef std::list<std::shared_ptr<const cached_decoder>> lru_list;
+
+		std::mutex m_mutex;
+		std::atomic<size_t> m_capacity;
+		lru_list m_lru;
+		std::unordered_map<uint64_t, lru_list::iterator> m_entries;
+
+		std::atomic<uint64_t> m_hits;
+		std::atomic<uint64_t> m_misses;
+
+		static uint64_t make_key(const std::vector<uint8_t>& tree_bytes, size_t tree_bits);
+
+	public:
+		// Off unless asked for, looking a tree up costs more than decoding it unless blocks share trees
+		static const size_t DEFAULT_CAPACITY = 0;
+
+		explicit decoder_cache(size_t capacity);
+
+		// Finds or builds the decoder for the tree at the start of the block, null if the tree is corrupt
+		std::shared_ptr<const cached_decoder> get(const uint8_t* src, size_t src_size);
+
+		void set_capacity(size_t capacity);
+		size_t capacity() const;
+		uint64_t hits() const;
+		uint64_t misses() const;
+		void reset_counters();
+
+		static decoder_cache& instance();
+	};
+}
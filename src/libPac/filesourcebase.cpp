@@ -0,0 +1,40 @@
+#include <algorithm>
+
+#include "filesourcebase.h"
+#include "compressor.h"
+
+void lib_pac::file_source_base::set_block_table(std::shared_ptr<const block_table> table)
+{
+	std::atomic_store(&m_block_table, std::move(table));
+}
+
+const char* lib_pac::file_source_base::data_view()
+{
+	return nullptr;
+}
+
+uint32_t lib_pac::file_source_base::read_range(char* dst, uint32_t offset, uint32_t count)
+{
+	if (!compressed())
+	{
+		const uint32_t size = unpacked_size();
+		if (offset >= size)
+			return 0;
+
+		count = std::min(count, size - offset);
+		copy_data(dst, offset, count);
+		return count;
+	}
+
+	// Entries may be shared between threads, the table is published atomically
+	auto table = std::atomic_load(&m_block_table);
+	if (!table)
+	{
+		table = compressor::read_block_table(*this);
+		if (!table)
+			return 0;
+		std::atomic_store(&m_block_table, table);
+	}
+
+	return compressor::read_range(*this, *table, dst, offset, count);
+}
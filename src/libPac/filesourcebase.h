@@ -7,8 +7,18 @@
 
 namespace lib_pac
 {
+	struct block_table;
+
 	class EXPORTS file_source_base
 	{
+	private:
+		// Parsed on the first compressed range read, copies share it
+		std::shared_ptr<const block_table> m_block_table;
+
+	protected:
+		// For sources that know their block table up front, range reads then skip parsing it
+		void set_block_table(std::shared_ptr<const block_table> table);
+
 	public:
 		file_source_base() = default;
 		virtual ~file_source_base() = default;
@@ -19,5 +29,13 @@ namespace lib_pac
 		virtual std::unique_ptr<file_source_base> get_copy() const = 0;
 
 		virtual void copy_data(char* dst, uint32_t offset, uint32_t count) = 0;
+
+		// The data_size() stored bytes when they already sit in memory, null otherwise. Valid as long as the
+		// source lives, readers take it instead of copying.
+		virtual const char* data_view();
+
+		// Reads count bytes of the unpacked data from offset, compressed entries only decode the blocks that
+		// overlap the range. Returns the bytes read, short past the end and 0 for invalid compressed data.
+		virtual uint32_t read_range(char* dst, uint32_t offset, uint32_t count);
 	};
 }
@@ -1,98 +1,211 @@
 #include "huffman.h"
+#include "kernels.h"
 #include <algorithm>
 #include <array>
 #include <vector>
-#include <queue>
-#include <list>
 #include <bitset>
 
 
 void
-lib_pac::huffman_tree::create(const uint8_t* data, size_t size)
+lib_pac::huffman_tree::create(const uint8_t* data, size_t size, uint32_t max_length)
 {
-	if (m_root != nullptr)
-		delete m_root;
+	uint32_t weights[0x100];
+	byte_histogram(data, size, weights);
+	create(weights, max_length);
+}
+
+void
+lib_pac::huffman_tree::create(const uint32_t* weights, uint32_t max_length)
+{
+	clear();
 
-	std::array<node_ptr, 256> node_array{};
+	std::array<node_id, 256> leaves;
 	int node_count = 0;
-	for (size_t i = 0; i < size; ++i)
+	for (int value = 0; value < 256; ++value)
 	{
-		const uint8_t value = data[i];
-		if (!node_array[value])
-		{
-			node_array[value] = new node(value);
-			++node_count;
-		}
-		node_array[value]->weight++;
+		if (weights[value])
+			leaves[node_count++] = make_leaf(static_cast<uint8_t>(value), weights[value]);
 	}
 
-	std::list<node_ptr> node_list(node_count);
-	const auto node_not_null = [](const node_ptr& a) -> bool
+	// Leaves sorted by weight, ties broken by symbol so the tree shape stays stable
+	const auto node_comparer = [this](node_id a, node_id b) -> bool
 	{
-		return a != nullptr;
+		const node& node_a = m_nodes[a];
+		const node& node_b = m_nodes[b];
+		return node_a.weight < node_b.weight || (node_a.weight == node_b.weight && node_a.value < node_b.value);
 	};
-	std::copy_if(node_array.begin(), node_array.end(), node_list.begin(), node_not_null);
+	std::sort(leaves.begin(), leaves.begin() + node_count, node_comparer);
+
+	// Merged nodes come out with non-decreasing weights, so they queue up already sorted
+	std::array<node_id, 255> merged;
+	int leaf_head = 0;
+	int merged_head = 0;
+	int merged_tail = 0;
 
-	const auto node_comparer = [](const node_ptr& a, const node_ptr& b) -> bool
+	const auto pop_lightest = [&]() -> node_id
 	{
-		return a->weight < b->weight;
+		// On ties the leaf goes first, merged nodes sort after everything of equal weight
+		if (merged_head == merged_tail ||
+			(leaf_head < node_count && m_nodes[leaves[leaf_head]].weight <= m_nodes[merged[merged_head]].weight))
+			return leaves[leaf_head++];
+		return merged[merged_head++];
 	};
-	node_list.sort(node_comparer);
 
-	while (node_list.size() > 1)
+	for (int i = 1; i < node_count; ++i)
 	{
 		// Pop Two Nodes
-		node_ptr a = node_list.front();
-		node_list.erase(node_list.begin());
-		node_ptr b = node_list.front();
-		node_list.erase(node_list.begin());
+		const node_id a = pop_lightest();
+		const node_id b = pop_lightest();
 
 		// Create a Third
-		node_ptr c = new node();
-		c->left = a;
-		c->right = b;
-		c->weight = a->weight + b->weight;
-
-		// Insert it sorted
-		auto it = node_list.begin();
-		while (it != node_list.end() && (*it)->weight <= c->weight)
-			std::advance(it, 1);
-		node_list.insert(it, c);
+		merged[merged_tail++] = make_branch(a, b);
 	}
 
-	m_root = node_list.front();
+	m_root = node_count > 1 ? merged[merged_tail - 1] : leaves[0];
+
+	// Most blocks already fit, only rebuild the ones that don't
+	if (max_length && node_count > 1 && depth(m_root) > max_length)
+		create_limited(weights, max_length);
 }
 
 void
+lib_pac::huffman_tree::create_limited(const uint32_t* weights, uint32_t max_length)
+{
+	clear();
+
+	std::array<uint8_t, 256> symbols;
+	int symbol_count = 0;
+	for (int value = 0; value < 256; ++value)
+	{
+		if (weights[value])
+			symbols[symbol_count++] = static_cast<uint8_t>(value);
+	}
+	std::stable_sort(symbols.begin(), symbols.begin() + symbol_count, [weights](uint8_t a, uint8_t b)
+	{
+		return weights[a] < weights[b];
+	});
+
+	// Every symbol needs a code, so the limit can't go below log2 of their count
+	uint32_t min_length = 0;
+	while ((1 << min_length) < symbol_count)
+		min_length++;
+	max_length = std::max(max_length, min_length);
+
+	// Package-merge, from the deepest level up. Each level is the sorted merge of the leaves with
+	// pairs packaged from the level below, only whether an item is a package needs to be kept.
+	const int level_size = 2 * symbol_count;
+	std::vector<uint8_t> is_package(max_length * level_size);
+	std::vector<uint64_t> below(symbol_count);
+	std::vector<uint64_t> current;
+	for (int i = 0; i < symbol_count; ++i)
+		below[i] = weights[symbols[i]];
+
+	for (uint32_t level = max_length - 1; level > 0; --level)
+	{
+		uint8_t* level_flags = &is_package[(level - 1) * level_size];
+		const size_t package_count = below.size() / 2;
+		int leaf = 0;
+		size_t package = 0;
+
+		current.clear();
+		while (leaf < symbol_count || package < package_count)
+		{
+			const uint64_t package_weight = package < package_count ? below[2 * package] + below[2 * package + 1] : 0;
+
+			// On ties the leaf goes first, like create() does
+			if (package == package_count || (leaf < symbol_count && weights[symbols[leaf]] <= package_weight))
+			{
+				level_flags[current.size()] = 0;
+				current.push_back(weights[symbols[leaf++]]);
+			}
+			else
+			{
+				level_flags[current.size()] = 1;
+				current.push_back(package_weight);
+				package++;
+			}
+		}
+		below.swap(current);
+	}
+
+	// The 2n - 2 lightest items of the top level pick the codes. Taken packages take a prefix
+	// twice their count from the level below, and every time a leaf is taken its code grows a bit.
+	std::array<uint32_t, 256> lengths{};
+	size_t taken = 2 * symbol_count - 2;
+	for (uint32_t level = 1; level <= max_length && taken; ++level)
+	{
+		const uint8_t* level_flags = &is_package[(level - 1) * level_size];
+		const bool deepest = level == max_length;
+		int leaf = 0;
+		size_t packages = 0;
+		for (size_t i = 0; i < taken; ++i)
+		{
+			if (!deepest && level_flags[i])
+				packages++;
+			else
+				lengths[leaf++]++;
+		}
+		taken = 2 * packages;
+	}
+
+	// Pair nodes up from the deepest level, the lengths satisfy Kraft's equality so every level pairs off
+	std::array<node_id, 256> level_nodes;
+	int level_count = 0;
+	for (uint32_t level = max_length; level > 0; --level)
+	{
+		for (int i = 0; i < symbol_count; ++i)
+		{
+			if (lengths[i] == level)
+				level_nodes[level_count++] = make_leaf(symbols[i], weights[symbols[i]]);
+		}
+
+		// Parents only ever overwrite pairs that were already joined
+		int parent_count = 0;
+		for (int i = 0; i + 1 < level_count; i += 2)
+			level_nodes[parent_count++] = make_branch(level_nodes[i], level_nodes[i + 1]);
+		level_count = parent_count;
+	}
+
+	m_root = level_nodes[0];
+}
+
+bool
 lib_pac::huffman_tree::read(bit_reader& reader)
 {
-	if (m_root != nullptr)
-		delete m_root;
+	clear();
+
+	if (bit_read(reader, &m_root))
+		return true;
 
-	bit_read(reader, &m_root);
+	// More nodes than any valid tree can have, the stream is corrupt
+	clear();
+	m_root = make_leaf(0, 0);
+	return false;
 }
 
-void
-lib_pac::huffman_tree::bit_read(bit_reader& buffer, node_ptr* n)
+bool
+lib_pac::huffman_tree::bit_read(bit_reader& buffer, node_id* n)
 {
+	if (m_node_count == MAX_NODES)
+		return false;
+
 	const bool branch = buffer.read_bit();
 	if (branch)
 	{
-		node* nn = new node;
+		const node_id nn = make_branch(-1, -1);
 		*n = nn;
-		bit_read(buffer, &nn->left);
-		bit_read(buffer, &nn->right);
-	}
-	else
-	{
-		const uint8_t value = buffer.read_byte();
-		*n = new node(value);
+		return bit_read(buffer, &m_nodes[nn].left) && bit_read(buffer, &m_nodes[nn].right);
 	}
+
+	const uint8_t value = buffer.read_byte();
+	*n = make_leaf(value, 0);
+	return true;
 }
 
 void
-lib_pac::huffman_tree::bit_dump(bit_writer& buffer, const node& node)
+lib_pac::huffman_tree::bit_dump(bit_writer& buffer, node_id n) const
 {
+	const node& node = m_nodes[n];
 	if (node.is_leaf) // Leaf
 	{
 		buffer.write_bit(false);
@@ -101,14 +214,15 @@ lib_pac::huffman_tree::bit_dump(bit_writer& buffer, const node& node)
 	else // Branch
 	{
 		buffer.write_bit(true);
-		bit_dump(buffer, *node.left);
-		bit_dump(buffer, *node.right);
+		bit_dump(buffer, node.left);
+		bit_dump(buffer, node.right);
 	}
 }
 
-void lib_pac::huffman_tree::generate_lookup(bit_lookup& lookup, const node& node, uint32_t bit_path,
-                                            uint32_t bit_lenght)
+void lib_pac::huffman_tree::generate_lookup(bit_lookup& lookup, node_id n, uint32_t bit_path,
+                                            uint32_t bit_lenght) const
 {
+	const node& node = m_nodes[n];
 	if (node.is_leaf) // Leaf
 	{
 		lookup.entries[node.value].pattern = bit_path;
@@ -117,103 +231,203 @@ void lib_pac::huffman_tree::generate_lookup(bit_lookup& lookup, const node& node
 	}
 	else // Branch
 	{
-		generate_lookup(lookup, *node.left, bit_path << 1 | 0, bit_lenght + 1);
-		generate_lookup(lookup, *node.right, bit_path << 1 | 1, bit_lenght + 1);
+		generate_lookup(lookup, node.left, bit_path << 1 | 0, bit_lenght + 1);
+		generate_lookup(lookup, node.right, bit_path << 1 | 1, bit_lenght + 1);
 	}
 }
 
 void
-lib_pac::huffman_tree::count(const node& node, size_t& n_branches, size_t& n_leaves)
+lib_pac::huffman_tree::generate_decoder(bit_decoder& decoder, node_id n, uint32_t bit_path,
+                                        uint32_t bit_length) const
 {
-	if (node.is_leaf)
-		n_leaves++;
-	else
-		n_branches++;
-
-	if (node.left)
-		count(*node.left, n_branches, n_leaves);
-	if (node.right)
-		count(*node.right, n_branches, n_leaves);
+	const node& node = m_nodes[n];
+	const uint32_t primary_bits = decoder.primary_bits;
+	if (node.is_leaf) // Leaf, fill every slot sharing its prefix
+	{
+		const uint32_t shift = primary_bits - bit_length;
+		const bit_decoder::entry entry{ node.value, static_cast<uint8_t>(bit_length), 0 };
+		std::fill_n(decoder.primary + (bit_path << shift), 1 << shift, entry);
+	}
+	else if (bit_length == primary_bits) // Long codes, link a secondary table
+	{
+		const uint32_t sub_bits = depth(n);
+		const uint32_t offset = decoder.secondary.size();
+		decoder.secondary.resize(offset + (1 << sub_bits));
+		decoder.primary[bit_path] = bit_decoder::entry{ offset, 0, static_cast<uint8_t>(sub_bits) };
+		generate_subtable(decoder, n, offset, sub_bits, 0, 0);
+	}
+	else // Branch
+	{
+		generate_decoder(decoder, node.left, bit_path << 1 | 0, bit_length + 1);
+		generate_decoder(decoder, node.right, bit_path << 1 | 1, bit_length + 1);
+	}
 }
 
 void
-lib_pac::huffman_tree::measure(const node& node, size_t& tree_bits, size_t& data_bits, size_t bit_lenght)
+lib_pac::huffman_tree::generate_subtable(bit_decoder& decoder, node_id n, uint32_t offset, uint32_t sub_bits,
+                                         uint32_t bit_path, uint32_t bit_length) const
 {
+	const node& node = m_nodes[n];
 	if (node.is_leaf)
 	{
-		tree_bits += 9;
-		data_bits += bit_lenght * node.weight;
+		const uint32_t shift = sub_bits - bit_length;
+		const uint8_t length = static_cast<uint8_t>(decoder.primary_bits + bit_length);
+		const bit_decoder::entry entry{ node.value, length, 0 };
+		std::fill_n(decoder.secondary.begin() + offset + (bit_path << shift), 1 << shift, entry);
 	}
 	else
 	{
-		tree_bits += 1;
+		generate_subtable(decoder, node.left, offset, sub_bits, bit_path << 1 | 0, bit_length + 1);
+		generate_subtable(decoder, node.right, offset, sub_bits, bit_path << 1 | 1, bit_length + 1);
 	}
+}
 
-	if (node.left)
-		measure(*node.left, tree_bits, data_bits, bit_lenght + 1);
-	if (node.right)
-		measure(*node.right, tree_bits, data_bits, bit_lenght + 1);
+uint32_t
+lib_pac::huffman_tree::depth(node_id n) const
+{
+	const node& node = m_nodes[n];
+	if (node.is_leaf)
+		return 0;
+	return 1 + std::max(depth(node.left), depth(node.right));
 }
 
 void
-lib_pac::huffman_tree::recalculate_weight(node& node)
+lib_pac::huffman_tree::count(node_id n, size_t& n_branches, size_t& n_leaves) const
 {
+	const node& node = m_nodes[n];
 	if (node.is_leaf)
-		return;
-	node.weight = 0;
-	if (node.left)
 	{
-		recalculate_weight(*node.left);
-		node.weight += node.left->weight;
+		n_leaves++;
+		return;
 	}
-	if (node.right)
+
+	n_branches++;
+	count(node.left, n_branches, n_leaves);
+	count(node.right, n_branches, n_leaves);
+}
+
+void
+lib_pac::huffman_tree::measure(node_id n, size_t& tree_bits, size_t& data_bits, size_t bit_lenght) const
+{
+	const node& node = m_nodes[n];
+	if (node.is_leaf)
 	{
-		recalculate_weight(*node.right);
-		node.weight += node.right->weight;
+		tree_bits += 9;
+		data_bits += bit_lenght * node.weight;
+		return;
 	}
+
+	tree_bits += 1;
+	measure(node.left, tree_bits, data_bits, bit_lenght + 1);
+	measure(node.right, tree_bits, data_bits, bit_lenght + 1);
 }
 
 void
-lib_pac::huffman_tree::reset_weight(node& node)
+lib_pac::huffman_tree::recalculate_weight(node_id n) const
 {
+	node& node = m_nodes[n];
+	if (node.is_leaf)
+		return;
+
+	recalculate_weight(node.left);
+	recalculate_weight(node.right);
+	node.weight = m_nodes[node.left].weight + m_nodes[node.right].weight;
+}
+
+void
+lib_pac::huffman_tree::reset_weight(node_id n) const
+{
+	node& node = m_nodes[n];
 	node.weight = 0;
-	if (node.left)
-		reset_weight(*node.left);
-	if (node.right)
-		reset_weight(*node.right);
+	if (node.is_leaf)
+		return;
+
+	reset_weight(node.left);
+	reset_weight(node.right);
+}
+
+void
+lib_pac::huffman_tree::clear()
+{
+	m_node_count = 0;
+	m_root = -1;
+}
+
+lib_pac::huffman_tree::node_id
+lib_pac::huffman_tree::make_leaf(uint8_t value, uint32_t weight)
+{
+	const node_id n = m_node_count++;
+	m_nodes[n] = node{ weight, -1, -1, value, true };
+	return n;
+}
+
+lib_pac::huffman_tree::node_id
+lib_pac::huffman_tree::make_branch(node_id left, node_id right)
+{
+	const uint32_t weight = left >= 0 && right >= 0 ? m_nodes[left].weight + m_nodes[right].weight : 0;
+	const node_id n = m_node_count++;
+	m_nodes[n] = node{ weight, left, right, 0, false };
+	return n;
 }
 
 
 void
 lib_pac::huffman_tree::write(lib_pac::bit_writer& buffer) const
 {
-	bit_dump(buffer, *m_root);
+	bit_dump(buffer, m_root);
 }
 
 void
 lib_pac::huffman_tree::recalculate_weights() const
 {
-	if (m_root)
-		recalculate_weight(*m_root);
+	if (m_root >= 0)
+		recalculate_weight(m_root);
 }
 
 void
 lib_pac::huffman_tree::reset_weights() const
 {
-	if (m_root)
-		reset_weight(*m_root);
+	if (m_root >= 0)
+		reset_weight(m_root);
 }
 
 void
 lib_pac::huffman_tree::generate_lookup(bit_lookup& lookup) const
 {
-	generate_lookup(lookup, *m_root, 0, 0);
+	generate_lookup(lookup, m_root, 0, 0);
+}
+
+bool
+lib_pac::huffman_tree::generate_decoder(bit_decoder& decoder) const
+{
+	decoder.max_length = depth(m_root);
+	decoder.fixed_length = fixed_length();
+	decoder.secondary.clear();
+
+	// Pathological trees are left to the bitwise cursor walk
+	if (decoder.max_length > bit_decoder::MAX_LENGTH)
+		return false;
+
+	decoder.primary_bits = decoder.max_length < bit_decoder::PRIMARY_BITS
+		                       ? decoder.max_length
+		                       : bit_decoder::PRIMARY_BITS;
+	generate_decoder(decoder, m_root, 0, 0);
+	return true;
+}
+
+uint32_t
+lib_pac::huffman_tree::fixed_length() const
+{
+	const uint32_t length = depth(m_root);
+	size_t branches = 0, leaves = 0;
+	count(m_root, branches, leaves);
+	return length && leaves == static_cast<size_t>(1) << length ? length : 0;
 }
 
 size_t
 lib_pac::huffman_tree::node_count(size_t& branches, size_t& leaves) const
 {
-	count(*m_root, branches, leaves);
+	count(m_root, branches, leaves);
 	return branches + leaves;
 }
 
@@ -221,7 +435,7 @@ size_t
 lib_pac::huffman_tree::bit_count(size_t& tree_bits, size_t& data_bits) const
 {
 	tree_bits = data_bits = 0;
-	measure(*m_root, tree_bits, data_bits, 0);
+	measure(m_root, tree_bits, data_bits, 0);
 	return tree_bits + data_bits;
 }
 
@@ -229,77 +443,59 @@ size_t
 lib_pac::huffman_tree::bit_count() const
 {
 	size_t tree_bits = 0, data_bits = 0;
-	measure(*m_root, tree_bits, data_bits, 0);
+	measure(m_root, tree_bits, data_bits, 0);
 	return tree_bits + data_bits;
 }
 
 lib_pac::huffman_tree::node_cursor
 lib_pac::huffman_tree::get_cursor() const
 {
-	node_cursor cur(m_root);
+	node_cursor cur(m_nodes, m_root);
 	return cur;
 }
 
-lib_pac::huffman_tree::huffman_tree() : m_root(nullptr)
-{
-}
-
-lib_pac::huffman_tree::~huffman_tree()
+lib_pac::huffman_tree::huffman_tree() : m_node_count(0), m_root(-1)
 {
-	if (m_root)
-		delete m_root;
 }
 
 lib_pac::bit_lookup::bit_lookup() : entries{}
 {
 }
 
-lib_pac::huffman_tree::node::node() : left(nullptr), right(nullptr), weight(0), value(0), is_leaf(false)
-{
-}
-
-lib_pac::huffman_tree::node::node(uint8_t value) : left(nullptr), right(nullptr), weight(0), value(value), is_leaf(true)
-{
-}
-
-lib_pac::huffman_tree::node::~node()
+lib_pac::bit_decoder::bit_decoder() : primary_bits(0), max_length(0), fixed_length(0), primary{}
 {
-	if (left)
-		delete left;
-	if (right)
-		delete right;
 }
 
-lib_pac::huffman_tree::node_cursor::node_cursor(node_ptr node) : m_node(node)
+lib_pac::huffman_tree::node_cursor::node_cursor(node* nodes, node_id node) : m_nodes(nodes), m_node(node)
 {
 }
 
 bool
 lib_pac::huffman_tree::node_cursor::is_leaf() const
 {
-	return m_node->is_leaf;
+	return m_nodes[m_node].is_leaf;
 }
 
 uint8_t
 lib_pac::huffman_tree::node_cursor::get_value() const
 {
-	return m_node->value;
+	return m_nodes[m_node].value;
 }
 
 void
 lib_pac::huffman_tree::node_cursor::move_left()
 {
-	m_node = m_node->left;
+	m_node = m_nodes[m_node].left;
 }
 
 void
 lib_pac::huffman_tree::node_cursor::move_right()
 {
-	m_node = m_node->right;
+	m_node = m_nodes[m_node].right;
 }
 
 void
 lib_pac::huffman_tree::node_cursor::increase_weight() const
 {
-	m_node->weight++;
+	m_nodes[m_node].weight++;
 }
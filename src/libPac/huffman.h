@@ -23,33 +23,64 @@ namespace lib_pac
 		bit_lookup();
 	};
 
+	struct bit_decoder
+	{
+		// Codes up to PRIMARY_BITS long resolve with a single lookup, longer ones
+		// go through a secondary table sized for the subtree below their prefix
+		static const uint32_t PRIMARY_BITS = 11;
+		static const uint32_t MAX_LENGTH = 24;
+
+		struct entry
+		{
+			uint32_t value;
+			uint8_t length;
+			uint8_t sub_bits;
+		};
+
+		uint32_t primary_bits;
+		uint32_t max_length;
+		// Set when every code is max_length bits long
+		uint32_t fixed_length;
+		entry primary[1 << PRIMARY_BITS];
+		std::vector<entry> secondary;
+
+	public:
+		bit_decoder();
+	};
+
 	class huffman_tree
 	{
+	public:
+		// 256 leaves and their 255 branches
+		static const uint32_t MAX_NODES = 511;
+
 	private:
+		typedef int16_t node_id;
+
 		struct node
 		{
-			node* left;
-			node* right;
 			uint32_t weight;
+			node_id left;
+			node_id right;
 			uint8_t value;
 			bool is_leaf;
-
-			node();
-			explicit node(uint8_t value);
-			~node();
 		};
-		typedef node* node_ptr;
 
-		node_ptr m_root;
-		
+		// Nodes live inline and are addressed by index, rebuilding a tree only resets the count.
+		// Weights are bookkeeping and may be updated through const trees.
+		mutable node m_nodes[MAX_NODES];
+		node_id m_node_count;
+		node_id m_root;
+
 	public:
 		class node_cursor
 		{
 		private:
 			friend class huffman_tree;
-			node_ptr m_node;
+			node* m_nodes;
+			node_id m_node;
 			node_cursor() = delete;
-			explicit node_cursor(node_ptr node);
+			explicit node_cursor(node* nodes, node_id node);
 
 		public:
 			EXPORTS bool is_leaf() const;
@@ -60,19 +91,34 @@ namespace lib_pac
 		};
 
 	private:
-		static void bit_dump(bit_writer& buffer, const node& node);
-		static void bit_read(bit_reader& buffer, node_ptr* node);
-		static void generate_lookup(bit_lookup& lookup, const node& node, uint32_t bit_path, uint32_t bit_lenght);
-		static void count(const node& node, size_t& n_branches, size_t& n_leaves);
-		static void measure(const node& node, size_t& tree_bits, size_t& data_bits, size_t bit_lenght);
-		static void recalculate_weight(node& node);
-		static void reset_weight(node& node);
+		void clear();
+		void create_limited(const uint32_t* weights, uint32_t max_length);
+		node_id make_leaf(uint8_t value, uint32_t weight);
+		node_id make_branch(node_id left, node_id right);
+
+		void bit_dump(bit_writer& buffer, node_id n) const;
+		bool bit_read(bit_reader& buffer, node_id* n);
+		void generate_lookup(bit_lookup& lookup, node_id n, uint32_t bit_path, uint32_t bit_lenght) const;
+		void generate_decoder(bit_decoder& decoder, node_id n, uint32_t bit_path, uint32_t bit_length) const;
+		void generate_subtable(bit_decoder& decoder, node_id n, uint32_t offset, uint32_t sub_bits,
+		                       uint32_t bit_path, uint32_t bit_length) const;
+		uint32_t depth(node_id n) const;
+		void count(node_id n, size_t& n_branches, size_t& n_leaves) const;
+		void measure(node_id n, size_t& tree_bits, size_t& data_bits, size_t bit_lenght) const;
+		void recalculate_weight(node_id n) const;
+		void reset_weight(node_id n) const;
 
 	public:
-		EXPORTS void create(const uint8_t* data, size_t size);
-		EXPORTS void read(bit_reader& reader);
+		// A non zero max_length limits how long codes can get, at the cost of some ratio
+		EXPORTS void create(const uint8_t* data, size_t size, uint32_t max_length = 0);
+		// Builds from 0x100 byte counts, as filled by byte_histogram
+		EXPORTS void create(const uint32_t* weights, uint32_t max_length = 0);
+		EXPORTS bool read(bit_reader& reader);
 		EXPORTS void write(bit_writer& buffer) const;
 		EXPORTS void generate_lookup(bit_lookup& lookup) const;
+		EXPORTS bool generate_decoder(bit_decoder& decoder) const;
+		// Length shared by every code when all leaves sit at the same depth, 0 otherwise
+		EXPORTS uint32_t fixed_length() const;
 
 		EXPORTS void recalculate_weights() const;
 		EXPORTS void reset_weights() const;
@@ -83,6 +129,5 @@ namespace lib_pac
 		EXPORTS node_cursor get_cursor() const;
 
 		EXPORTS huffman_tree();
-		EXPORTS ~huffman_tree();
 	};
 }
@@ -0,0 +1,522 @@
+#include "kernels.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define KERNELS_X64
+#endif
+
+// MSVC accepts any intrinsic anywhere, GCC and Clang need the target spelled out per function
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KERNEL_TARGET(isa)
+#else
+#ifdef KERNELS_X86
+#include <cpuid.h>
+#endif
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+
+// Histogram
+
+static const int HISTOGRAM_TABLES = 4;
+
+static inline void
+histogram_count(const uint8_t* data, size_t size, uint32_t (*tables)[0x100])
+{
+	// Neighbouring bytes land in different tables, so runs of one value
+	// don't wait on the increment of the byte before them
+	std::memset(tables, 0, sizeof(uint32_t) * HISTOGRAM_TABLES * 0x100);
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, data + i, sizeof(word));
+
+		tables[0][static_cast<uint8_t>(word >> 0)]++;
+		tables[1][static_cast<uint8_t>(word >> 8)]++;
+		tables[2][static_cast<uint8_t>(word >> 16)]++;
+		tables[3][static_cast<uint8_t>(word >> 24)]++;
+		tables[0][static_cast<uint8_t>(word >> 32)]++;
+		tables[1][static_cast<uint8_t>(word >> 40)]++;
+		tables[2][static_cast<uint8_t>(word >> 48)]++;
+		tables[3][static_cast<uint8_t>(word >> 56)]++;
+	}
+	for (; i < size; ++i)
+		tables[i % HISTOGRAM_TABLES][data[i]]++;
+}
+
+static void
+histogram_scalar(const uint8_t* data, size_t size, uint32_t* counts)
+{
+	uint32_t tables[HISTOGRAM_TABLES][0x100];
+	histogram_count(data, size, tables);
+
+	for (int value = 0; value < 0x100; ++value)
+		counts[value] = tables[0][value] + tables[1][value] + tables[2][value] + tables[3][value];
+}
+
+
+// Presence
+
+// Bytes scanned between checks for whether every value has shown up
+static const size_t PRESENCE_CHUNK = 0x1000;
+
+static uint32_t
+presence_scan(const uint8_t* data, size_t size, uint8_t* present)
+{
+	// Plain stores carry no dependency from one byte to the next, unlike the increments of a histogram
+	std::memset(present, 0, 0x100);
+
+	uint32_t distinct = 0;
+	for (size_t start = 0; start < size && distinct < 0x100; start += PRESENCE_CHUNK)
+	{
+		const size_t end = std::min(size, start + PRESENCE_CHUNK);
+
+		size_t i = start;
+		for (; i + 8 <= end; i += 8)
+		{
+			uint64_t word;
+			std::memcpy(&word, data + i, sizeof(word));
+
+			present[static_cast<uint8_t>(word >> 0)] = 1;
+			present[static_cast<uint8_t>(word >> 8)] = 1;
+			present[static_cast<uint8_t>(word >> 16)] = 1;
+			present[static_cast<uint8_t>(word >> 24)] = 1;
+			present[static_cast<uint8_t>(word >> 32)] = 1;
+			present[static_cast<uint8_t>(word >> 40)] = 1;
+			present[static_cast<uint8_t>(word >> 48)] = 1;
+			present[static_cast<uint8_t>(word >> 56)] = 1;
+		}
+		for (; i < end; ++i)
+			present[data[i]] = 1;
+
+		distinct = 0;
+		for (int value = 0; value < 0x100; ++value)
+			distinct += present[value];
+	}
+	return distinct;
+}
+
+
+// Huffman
+
+static void
+encode_scalar(lib_pac::bit_writer& writer, const uint8_t* src, size_t size, const lib_pac::bit_lookup& lookup)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		const auto& entry = lookup.entries[src[i]];
+		writer.write_bits(entry.pattern, entry.lenght);
+	}
+}
+
+static void
+decode_scalar(uint8_t* dst, size_t size, lib_pac::bit_reader& reader, const lib_pac::bit_decoder& decoder)
+{
+	const uint32_t max_length = decoder.max_length;
+	const uint32_t primary_shift = max_length - decoder.primary_bits;
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		const uint32_t code = reader.peek(max_length);
+
+		const lib_pac::bit_decoder::entry* entry = &decoder.primary[code >> primary_shift];
+		if (entry->sub_bits)
+		{
+			const uint32_t sub_shift = primary_shift - entry->sub_bits;
+			const uint32_t sub_mask = (1 << entry->sub_bits) - 1;
+			entry = &decoder.secondary[entry->value + ((code >> sub_shift) & sub_mask)];
+		}
+
+		dst[i] = static_cast<uint8_t>(entry->value);
+		reader.consume(entry->length);
+	}
+}
+
+#ifdef KERNELS_X64
+// Output below this size doesn't pay for building the pair table
+static const size_t PAIR_TABLE_MIN_SIZE = 0x4000;
+
+// Two codes that fit the primary bits together, count is 0 when the first one needs the secondary table
+struct code_pair
+{
+	uint8_t symbols[2];
+	uint8_t length;
+	uint8_t count;
+};
+
+static void
+build_pairs(code_pair* pairs, const lib_pac::bit_decoder& decoder)
+{
+	// Codes are replicated over every suffix in the primary table, so a second code found with the
+	// trailing bits zeroed is the real one whenever it is no longer than the bits that were left
+	const uint32_t primary_bits = decoder.primary_bits;
+	const uint32_t mask = (1 << primary_bits) - 1;
+	for (uint32_t index = 0; index <= mask; ++index)
+	{
+		const auto& first = decoder.primary[index];
+		code_pair& pair = pairs[index];
+		pair.symbols[0] = static_cast<uint8_t>(first.value);
+		pair.length = first.length;
+		pair.count = first.sub_bits ? 0 : 1;
+		if (first.sub_bits || first.length >= primary_bits)
+			continue;
+
+		const auto& second = decoder.primary[(index << first.length) & mask];
+		if (second.sub_bits || second.length > primary_bits - first.length)
+			continue;
+
+		pair.symbols[1] = static_cast<uint8_t>(second.value);
+		pair.length += second.length;
+		pair.count = 2;
+	}
+}
+
+KERNEL_TARGET("bmi,bmi2") static void
+decode_bmi2(uint8_t* dst, size_t size, lib_pac::bit_reader& reader, const lib_pac::bit_decoder& decoder)
+{
+	if (size < PAIR_TABLE_MIN_SIZE)
+	{
+		decode_scalar(dst, size, reader, decoder);
+		return;
+	}
+
+	const uint32_t max_length = decoder.max_length;
+	const uint32_t primary_shift = max_length - decoder.primary_bits;
+	const uint32_t window_bits = lib_pac::bit_reader::MAX_PEEK;
+
+	code_pair pairs[1 << lib_pac::bit_decoder::PRIMARY_BITS];
+	build_pairs(pairs, decoder);
+
+	// Short codes come out two per lookup. They are taken from a local copy of the reader's buffer, as
+	// many as are sure to fit, so the stores to dst don't force the reader's state back to memory after
+	// every symbol. BZHI masks to a length held in a register, without building the mask first.
+	size_t i = 0;
+	while (i < size)
+	{
+		const uint64_t window = reader.window(window_bits);
+		uint32_t used = 0;
+		do
+		{
+			const uint32_t code = static_cast<uint32_t>(_bzhi_u64(window >> (64 - used - max_length), max_length));
+
+			// Both symbols are stored, a single one is overwritten by the next lookup
+			const code_pair& pair = pairs[code >> primary_shift];
+			if (pair.count && i + 1 < size)
+			{
+				std::memcpy(dst + i, pair.symbols, 2);
+				i += pair.count;
+				used += pair.length;
+				continue;
+			}
+
+			const lib_pac::bit_decoder::entry* entry = &decoder.primary[code >> primary_shift];
+			if (entry->sub_bits)
+			{
+				const uint32_t sub_shift = primary_shift - entry->sub_bits;
+				entry = &decoder.secondary[entry->value + _bzhi_u32(code >> sub_shift, entry->sub_bits)];
+			}
+
+			dst[i++] = static_cast<uint8_t>(entry->value);
+			used += entry->length;
+		}
+		while (i < size && used + max_length <= window_bits);
+		reader.consume(static_cast<uint8_t>(used));
+	}
+}
+#endif
+
+
+// Fixed length codes
+
+template <uint32_t Length>
+static void
+encode_fixed_length(lib_pac::bit_writer& writer, const uint8_t* src, size_t size, const lib_pac::bit_lookup& lookup)
+{
+	// Whole 32 bit words per write
+	const uint32_t per_word = 32 / Length;
+
+	size_t i = 0;
+	for (; i + per_word <= size; i += per_word)
+	{
+		uint32_t word = 0;
+		for (uint32_t j = 0; j < per_word; ++j)
+			word = word << Length | lookup.entries[src[i + j]].pattern;
+		writer.write_bits(word, 32);
+	}
+	for (; i < size; ++i)
+		writer.write_bits(lookup.entries[src[i]].pattern, Length);
+}
+
+template <uint32_t Length>
+static void
+decode_fixed_length(uint8_t* dst, size_t size, lib_pac::bit_reader& reader, const lib_pac::bit_decoder& decoder)
+{
+	// Every input byte expands to a fixed group of symbols
+	const uint32_t per_byte = 8 / Length;
+	const uint32_t mask = (1 << Length) - 1;
+
+	uint8_t expand[0x100][per_byte];
+	for (uint32_t byte = 0; byte < 0x100; ++byte)
+	{
+		for (uint32_t j = 0; j < per_byte; ++j)
+			expand[byte][j] = static_cast<uint8_t>(decoder.primary[byte >> (8 - Length * (j + 1)) & mask].value);
+	}
+
+	size_t i = 0;
+	for (; i + 4 * per_byte <= size; i += 4 * per_byte)
+	{
+		const uint32_t word = reader.peek(32);
+		reader.consume(32);
+
+		std::memcpy(dst + i + 0 * per_byte, expand[word >> 24], per_byte);
+		std::memcpy(dst + i + 1 * per_byte, expand[word >> 16 & 0xFF], per_byte);
+		std::memcpy(dst + i + 2 * per_byte, expand[word >> 8 & 0xFF], per_byte);
+		std::memcpy(dst + i + 3 * per_byte, expand[word & 0xFF], per_byte);
+	}
+	for (; i < size; ++i)
+	{
+		dst[i] = static_cast<uint8_t>(decoder.primary[reader.peek(Length)].value);
+		reader.consume(Length);
+	}
+}
+
+
+// Checksum, CRC-32C so the SSE 4.2 instructions can compute it
+
+static const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78;
+
+struct crc32c_table
+{
+	uint32_t entries[0x100];
+
+	crc32c_table()
+	{
+		for (uint32_t i = 0; i < 0x100; ++i)
+		{
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit)
+				crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+			entries[i] = crc;
+		}
+	}
+};
+
+static uint32_t
+checksum_scalar(const uint8_t* data, size_t size, uint32_t crc)
+{
+	static const crc32c_table table;
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef KERNELS_X86
+KERNEL_TARGET("sse4.2") static uint32_t
+checksum_sse42(const uint8_t* data, size_t size, uint32_t crc)
+{
+	crc = ~crc;
+#ifdef KERNELS_X64
+	uint64_t crc64 = crc;
+	for (; size >= 8; size -= 8, data += 8)
+	{
+		uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = static_cast<uint32_t>(crc64);
+#endif
+	for (; size >= 4; size -= 4, data += 4)
+	{
+		uint32_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+	for (; size; --size)
+		crc = _mm_crc32_u8(crc, *data++);
+	return ~crc;
+}
+#endif
+
+
+// Dispatch
+
+static const lib_pac::codec_kernels scalar_kernels{
+	lib_pac::cpu_level::scalar, histogram_scalar, encode_scalar, decode_scalar, checksum_scalar
+};
+
+#ifdef KERNELS_X86
+static const lib_pac::codec_kernels sse42_kernels{
+	lib_pac::cpu_level::sse42, histogram_scalar, encode_scalar, decode_scalar, checksum_sse42
+};
+#endif
+
+#ifdef KERNELS_X64
+static const lib_pac::codec_kernels bmi2_kernels{
+	lib_pac::cpu_level::bmi2, histogram_scalar, encode_scalar, decode_bmi2, checksum_sse42
+};
+#endif
+
+static const lib_pac::codec_kernels&
+kernels_for(lib_pac::cpu_level level)
+{
+	switch (level)
+	{
+#ifdef KERNELS_X64
+	case lib_pac::cpu_level::bmi2:
+		return bmi2_kernels;
+#endif
+#ifdef KERNELS_X86
+	case lib_pac::cpu_level::sse42:
+		return sse42_kernels;
+#endif
+	default:
+		return scalar_kernels;
+	}
+}
+
+#ifdef KERNELS_X86
+static void
+cpuid(uint32_t leaf, uint32_t regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex(reinterpret_cast<int*>(regs), leaf, 0);
+#else
+	__cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static lib_pac::cpu_level
+query_cpu_level()
+{
+	uint32_t regs[4];
+	cpuid(0, regs);
+	const uint32_t max_leaf = regs[0];
+	if (max_leaf < 1)
+		return lib_pac::cpu_level::scalar;
+
+	cpuid(1, regs);
+	const bool sse42 = (regs[2] & (1 << 20)) != 0;
+	if (!sse42)
+		return lib_pac::cpu_level::scalar;
+#ifdef KERNELS_X64
+	if (max_leaf < 7)
+		return lib_pac::cpu_level::sse42;
+
+	// BMI and BMI2 use general purpose registers only, there is no OS state to check for
+	cpuid(7, regs);
+	const bool bmi = (regs[1] & (1 << 3)) != 0;
+	const bool bmi2 = (regs[1] & (1 << 8)) != 0;
+	if (bmi && bmi2)
+		return lib_pac::cpu_level::bmi2;
+#endif
+	return lib_pac::cpu_level::sse42;
+}
+#endif
+
+static std::atomic<const lib_pac::codec_kernels*>&
+current_kernels()
+{
+	static std::atomic<const lib_pac::codec_kernels*> current(&kernels_for(lib_pac::detect_cpu_level()));
+	return current;
+}
+
+lib_pac::cpu_level
+lib_pac::detect_cpu_level()
+{
+#ifdef KERNELS_X86
+	static const cpu_level level = query_cpu_level();
+	return level;
+#else
+	return cpu_level::scalar;
+#endif
+}
+
+const lib_pac::codec_kernels&
+lib_pac::kernels()
+{
+	return *current_kernels().load(std::memory_order_relaxed);
+}
+
+bool
+lib_pac::force_cpu_level(cpu_level level)
+{
+	if (level > detect_cpu_level())
+		return false;
+
+	current_kernels().store(&kernels_for(level), std::memory_order_relaxed);
+	return true;
+}
+
+void
+lib_pac::byte_histogram(const uint8_t* data, size_t size, uint32_t* counts)
+{
+	kernels().histogram(data, size, counts);
+}
+
+uint32_t
+lib_pac::byte_presence(const uint8_t* data, size_t size, uint8_t* present)
+{
+	return presence_scan(data, size, present);
+}
+
+bool
+lib_pac::encode_fixed(bit_writer& writer, const uint8_t* src, size_t size, const bit_lookup& lookup, uint32_t length)
+{
+	switch (length)
+	{
+	case 1:
+		encode_fixed_length<1>(writer, src, size, lookup);
+		return true;
+	case 2:
+		encode_fixed_length<2>(writer, src, size, lookup);
+		return true;
+	case 4:
+		encode_fixed_length<4>(writer, src, size, lookup);
+		return true;
+	case 8:
+		encode_fixed_length<8>(writer, src, size, lookup);
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool
+lib_pac::decode_fixed(uint8_t* dst, size_t size, bit_reader& reader, const bit_decoder& decoder)
+{
+	switch (decoder.fixed_length)
+	{
+	case 1:
+		decode_fixed_length<1>(dst, size, reader, decoder);
+		return true;
+	case 2:
+		decode_fixed_length<2>(dst, size, reader, decoder);
+		return true;
+	case 4:
+		decode_fixed_length<4>(dst, size, reader, decoder);
+		return true;
+	case 8:
+		decode_fixed_length<8>(dst, size, reader, decoder);
+		return true;
+	default:
+		return false;
+	}
+}
+
+uint32_t
+lib_pac::block_checksum(const uint8_t* data, size_t size)
+{
+	return kernels().checksum(data, size, 0);
+}
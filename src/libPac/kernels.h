@@ -0,0 +1,56 @@
+#pragma once
+#include "defines.h"
+
+#include <stdint.h>
+#include <cstddef>
+
+#include "bitstream.h"
+#include "huffman.h"
+
+namespace lib_pac
+{
+	// Instruction sets the codec kernels are built for, each level includes the ones before it. Only levels
+	// that run different code are listed: SSE 4.2 computes checksums with its CRC-32C instructions, BMI2
+	// (64 bit builds only) decodes several codes per buffer refill.
+	enum class cpu_level : uint8_t
+	{
+		scalar,
+		sse42,
+		bmi2,
+	};
+
+	struct codec_kernels
+	{
+		cpu_level level;
+
+		void (*histogram)(const uint8_t* data, size_t size, uint32_t* counts);
+		void (*encode)(bit_writer& writer, const uint8_t* src, size_t size, const bit_lookup& lookup);
+		void (*decode)(uint8_t* dst, size_t size, bit_reader& reader, const bit_decoder& decoder);
+		uint32_t (*checksum)(const uint8_t* data, size_t size, uint32_t crc);
+	};
+
+	// Best level the running CPU supports, detected once
+	EXPORTS cpu_level detect_cpu_level();
+
+	// Kernels every codec path goes through
+	EXPORTS const codec_kernels& kernels();
+
+	// Switches every later call to the given level, fails if the CPU doesn't support it
+	EXPORTS bool force_cpu_level(cpu_level level);
+
+	// Counts every byte value in data, counts must hold 0x100 entries
+	EXPORTS void byte_histogram(const uint8_t* data, size_t size, uint32_t* counts);
+
+	// Marks every byte value in data with a 1, present must hold 0x100 entries. Returns how many values
+	// showed up, the scan stops early once all of them have.
+	EXPORTS uint32_t byte_presence(const uint8_t* data, size_t size, uint8_t* present);
+
+	// Kernels for trees whose codes all share a length of 1, 2, 4 or 8 bits, whole bytes map to whole
+	// groups of symbols. Both return false and do nothing for any other length.
+	EXPORTS bool encode_fixed(bit_writer& writer, const uint8_t* src, size_t size, const bit_lookup& lookup,
+	                          uint32_t length);
+	EXPORTS bool decode_fixed(uint8_t* dst, size_t size, bit_reader& reader, const bit_decoder& decoder);
+
+	// CRC-32C of a block of data
+	EXPORTS uint32_t block_checksum(const uint8_t* data, size_t size);
+}
@@ -1,54 +1,606 @@
 #include "pac.h"
 #include <fstream>
 #include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <memory>
 
 #include "structs.h"
+#include "archivefile.h"
 #include "pacfilesource.h"
+#include "pacindex.h"
 #include "compressor.h"
 #include "membuf.h"
+#include "threadpool.h"
 
 #include <vector>
 #include <iostream>
 #include <filesystem>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
 
 namespace fs = std::experimental::filesystem;
 
 lib_pac::pac_archive::pac_archive(std::wstring path)
-	: m_entries()
+	: m_directory(std::make_shared<pac_index>()),
+	  m_hidden_count(0),
+	  m_entries()
 {
-	structs::PAC_HEADER header;
-	structs::PAC_DIRECTORY_ENTRY entry;
-
-	std::ifstream file(path, std::ios::binary);
+	// Opened and mapped once, every entry reads through the same handle. A sidecar index that matches the
+	// archive spares parsing its directory.
+	const auto file = archive_file::open(path);
+	std::shared_ptr<const pac_index> directory;
+	if (file)
+	{
+		directory = pac_index::load(path, *file);
+		if (!directory)
+			directory = pac_index::parse(*file);
+	}
 
-	file.read(reinterpret_cast<char*>(&header), sizeof(header));
-	if (strncmp(header.Magic, "DW_PACK", 8) != 0) {
+	if (!directory) {
 		std::cerr << "Invalid PAC Header" << std::endl;
 		return;
 	}
 
-	const uint32_t baseOffset = sizeof(header) + header.NumFiles * sizeof(entry);
+	m_file = file;
+	m_directory = directory;
+	m_hidden.assign(m_directory->size(), false);
+	m_sources.resize(m_directory->size());
+}
+
+lib_pac::pac_archive::pac_archive()
+	: m_directory(std::make_shared<pac_index>()),
+	  m_hidden_count(0),
+	  m_entries()
+{
+}
+
+// Files at least STREAM_THRESHOLD big are read, compressed and written STREAM_CHUNK bytes at a time
+static const uint32_t STREAM_THRESHOLD = 0x4000000;
+static const uint32_t STREAM_CHUNK = 0x800000;
+// Files below BATCH_SIZE share tasks, files from BLOCK_PARALLEL_SIZE up also split their blocks over the pool
+static const uint32_t BATCH_SIZE = 0x100000;
+static const uint32_t BLOCK_PARALLEL_SIZE = 0x1000000;
 
-	for (uint32_t i = 0; i < header.NumFiles; ++i)
+// Writes a compressed stream to the archive, starting at an entry's data
+class archive_sink : public lib_pac::compress_sink
+{
+private:
+	std::ofstream& m_output;
+	size_t m_start;
+	size_t m_size;
+
+public:
+	archive_sink(std::ofstream& output, size_t start) : m_output(output), m_start(start), m_size(0)
+	{
+	}
+
+	void write(const char* data, size_t size) override
 	{
-		file.read(reinterpret_cast<char*>(&entry), sizeof(entry));
-		//std::cout << entry.FileName << std::endl;
+		m_output.seekp(m_start + m_size);
+		m_output.write(data, size);
+		m_size += size;
+	}
 
-		//const auto src = new PacFileSource(path, baseOffset, entry);
-		auto ptr = std::make_shared<pac_file_source>(path, baseOffset, entry);
-		const std::string f_name = entry.FileName;
-		m_entries[f_name] = (std::move(ptr));
+	void write_at(size_t offset, const char* data, size_t size) override
+	{
+		m_output.seekp(m_start + offset);
+		m_output.write(data, size);
+	}
+};
+
+static void
+copy_chunked(std::ofstream& output, size_t start, lib_pac::file_source_base& source, uint32_t size,
+             memory_buffer& buffer)
+{
+	output.seekp(start);
+	if (const char* data = source.data_view())
+	{
+		output.write(data, size);
+		return;
+	}
+
+	buffer.reserve(STREAM_CHUNK);
+	for (uint32_t offset = 0; offset < size; offset += STREAM_CHUNK)
+	{
+		const uint32_t count = std::min(STREAM_CHUNK, size - offset);
+		source.copy_data(buffer.data(), offset, count);
+		output.write(buffer.data(), count);
 	}
 }
 
-lib_pac::pac_archive::pac_archive()
-	: m_entries()
+static bool
+worth_compressing(uint64_t compressed_size, uint64_t raw_size, float margin)
+{
+	return compressed_size <= raw_size * (1.0 - margin);
+}
+
+static lib_pac::pac_archive::entry_storage
+storage_for(const lib_pac::pac_archive::save_options& options, const std::string& file_name)
+{
+	if (options.extension_storage.empty())
+		return lib_pac::pac_archive::entry_storage::automatic;
+
+	std::string extension = fs::path(file_name).extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+	const auto found = options.extension_storage.find(extension);
+	if (found == options.extension_storage.end())
+		return lib_pac::pac_archive::entry_storage::automatic;
+	return found->second;
+}
+
+// Output of one entry, its data is empty when it went to the archive while being encoded
+struct encoded_entry
+{
+	std::vector<char> data;
+	uint32_t comp_size = 0;
+	uint32_t raw_size = 0;
+	bool compressed = false;
+	uint32_t block_size = 0;
+	int32_t saved_size = 0;
+	// Filled for the sidecar index when it is written
+	std::vector<lib_pac::pac_index::block> blocks;
+};
+
+static bool
+streams(lib_pac::file_source_base& source)
+{
+	return source.data_size() >= STREAM_THRESHOLD;
+}
+
+static std::vector<char>
+read_entry(lib_pac::file_source_base& source)
+{
+	std::vector<char> data(source.data_size());
+	if (!data.empty())
+		source.copy_data(data.data(), 0, static_cast<uint32_t>(data.size()));
+	return data;
+}
+
+// Runs on the pool next to other files, only big files also spread their blocks over it. input holds what
+// read_entry returned for the source and is consumed.
+static void
+encode_entry(lib_pac::file_source_base& source, const std::string& file_name,
+             const lib_pac::pac_archive::save_options& options, std::vector<char>& input, encoded_entry& out)
+{
+	typedef lib_pac::pac_archive::entry_storage entry_storage;
+
+	const uint32_t n_threads = source.data_size() >= BLOCK_PARALLEL_SIZE ? 0 : 1;
+
+	if (source.compressed())
+	{
+		out.comp_size = source.data_size();
+		out.raw_size = source.unpacked_size();
+		out.compressed = true;
+		out.data = std::move(input);
+		return;
+	}
+
+	const uint32_t dec_size = source.unpacked_size();
+	out.raw_size = dec_size;
+
+	const entry_storage storage = storage_for(options, file_name);
+	bool store = storage == entry_storage::store || dec_size == 0;
+	if (!store && options.level == lib_pac::compression_level::fast)
+	{
+		// Choosing a size takes full histograms, which the fast level exists to avoid. It keeps the
+		// default size and learns whether compression paid off from its output.
+		const uint32_t block_size = std::min(options.max_block_size, lib_pac::pac_archive::DEFAULT_BLOCK_SIZE);
+		const auto comp_info = lib_pac::compressor::prepare_compression(input.data(), dec_size, block_size, n_threads,
+		                                                                0, options.level);
+		out.data.resize(comp_info->output_size());
+		out.comp_size = lib_pac::compressor::compress(*comp_info, out.data.data(), n_threads);
+		out.data.resize(out.comp_size);
+		out.block_size = block_size;
+
+		store = storage == entry_storage::automatic &&
+			!worth_compressing(out.comp_size, dec_size, options.store_margin);
+	}
+	else if (!store)
+	{
+		// The prediction already tells whether compression pays off, incompressible
+		// files never reach the encoder. Its histograms also make the trees for the chosen size.
+		const auto choice = lib_pac::compressor::choose_block_size(input.data(), dec_size, options.max_block_size,
+		                                                           lib_pac::pac_archive::DEFAULT_BLOCK_SIZE, n_threads);
+		store = storage == entry_storage::automatic &&
+			!worth_compressing(choice.output_size, dec_size, options.store_margin);
+
+		if (!store)
+		{
+			const auto comp_info = lib_pac::compressor::prepare_compression(input.data(), dec_size, choice, n_threads);
+			out.data.resize(comp_info->output_size());
+			out.comp_size = lib_pac::compressor::compress(*comp_info, out.data.data(), n_threads);
+			out.data.resize(out.comp_size);
+			out.block_size = choice.block_size;
+			out.saved_size = static_cast<int32_t>(static_cast<int64_t>(choice.reference_output_size) - out.comp_size);
+		}
+	}
+
+	out.compressed = !store;
+	if (store)
+	{
+		out.data = std::move(input);
+		out.comp_size = dec_size;
+		out.block_size = 0;
+		out.saved_size = 0;
+	}
+	input = std::vector<char>();
+}
+
+// Encodes files too big to hold whole straight into the archive at start, a chunk at a time
+static void
+stream_entry(std::ofstream& output, size_t start, lib_pac::file_source_base& source, const std::string& file_name,
+             const lib_pac::pac_archive::save_options& options, memory_buffer& buffer, encoded_entry& out,
+             size_t& written_end)
+{
+	typedef lib_pac::pac_archive::entry_storage entry_storage;
+
+	if (source.compressed())
+	{
+		out.comp_size = source.data_size();
+		out.raw_size = source.unpacked_size();
+		out.compressed = true;
+		copy_chunked(output, start, source, out.comp_size, buffer);
+		if (options.write_index && source.data_view())
+			out.blocks = lib_pac::pac_index::entry_blocks(source.data_view(), out.comp_size);
+		return;
+	}
+
+	// Judged on the first chunk, the rest is only read while compressing
+	const uint32_t dec_size = source.unpacked_size();
+	buffer.reserve(STREAM_CHUNK);
+	source.copy_data(buffer.data(), 0, STREAM_CHUNK);
+	out.raw_size = dec_size;
+
+	const entry_storage storage = storage_for(options, file_name);
+	bool store = storage == entry_storage::store;
+	// The fast level keeps the default size like encode_entry does, only its output decides on storing
+	uint32_t block_size = std::min(options.max_block_size, lib_pac::pac_archive::DEFAULT_BLOCK_SIZE);
+	int64_t saved = 0;
+	if (!store && options.level != lib_pac::compression_level::fast)
+	{
+		const auto choice = lib_pac::compressor::choose_block_size(buffer.data(), STREAM_CHUNK, options.max_block_size,
+		                                                           lib_pac::pac_archive::DEFAULT_BLOCK_SIZE);
+		store = storage == entry_storage::automatic &&
+			!worth_compressing(choice.output_size, STREAM_CHUNK, options.store_margin);
+		block_size = choice.block_size;
+		// The reference size was only predicted for the first chunk, its saving is scaled to the whole file
+		saved = (int64_t(choice.reference_output_size) - choice.output_size) * dec_size / STREAM_CHUNK;
+	}
+
+	if (!store)
+	{
+		archive_sink sink(output, start);
+		lib_pac::stream_compressor stream(sink, dec_size, block_size, 0, 0, options.level);
+		stream.push(buffer.data(), STREAM_CHUNK);
+		for (uint32_t offset = STREAM_CHUNK; offset < dec_size; offset += STREAM_CHUNK)
+		{
+			const uint32_t count = std::min(STREAM_CHUNK, dec_size - offset);
+			source.copy_data(buffer.data(), offset, count);
+			stream.push(buffer.data(), count);
+		}
+		out.comp_size = stream.finish();
+		out.block_size = block_size;
+		out.saved_size = static_cast<int32_t>(std::min<int64_t>(saved, INT32_MAX));
+		if (options.write_index)
+			out.blocks = lib_pac::pac_index::entry_blocks(stream.table());
+		written_end = std::max<size_t>(written_end, start + out.comp_size);
+
+		// A prediction only saw the start of the file
+		store = storage == entry_storage::automatic &&
+			!worth_compressing(out.comp_size, dec_size, options.store_margin);
+	}
+
+	out.compressed = !store;
+	if (store)
+	{
+		out.comp_size = dec_size;
+		out.block_size = 0;
+		out.saved_size = 0;
+		out.blocks.clear();
+		copy_chunked(output, start, source, dec_size, buffer);
+	}
+}
+
+typedef std::vector<std::pair<std::string, std::shared_ptr<lib_pac::file_source_base>>> entry_list;
+
+static uint64_t
+elapsed_us(std::chrono::steady_clock::time_point since)
+{
+	const auto elapsed = std::chrono::steady_clock::now() - since;
+	return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+// Reads entries in directory order on its own thread, compresses them on the pool, largest waiting batch
+// first, and hands them to the writer in directory order. Reading waits while max_buffered_bytes of read
+// or compressed data are waiting to be written.
+class save_pipeline
+{
+public:
+	// One file, or a run of consecutive files below BATCH_SIZE compressed by a single task
+	struct batch
+	{
+		size_t first;
+		size_t last;
+		// Written straight from the source by the writer, never read ahead
+		bool streamed;
+		// Bytes held for the batch, read data until it is compressed and the output after that
+		uint64_t size;
+		bool done;
+
+		std::vector<std::vector<char>> inputs;
+		std::vector<encoded_entry> encoded;
+	};
+
+private:
+	const entry_list& m_entries;
+	const lib_pac::pac_archive::save_options& m_options;
+	lib_pac::pac_archive::pipeline_stats& m_stats;
+
+	std::vector<batch> m_batches;
+
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	uint64_t m_buffered;
+	// Batches read and waiting for a compression task, and files in them
+	std::vector<size_t> m_ready;
+	uint32_t m_ready_files;
+	// Files compressed and waiting to be written
+	uint32_t m_done_files;
+	// Compression tasks submitted and not finished
+	uint32_t m_running;
+	bool m_reading;
+	bool m_abort;
+	std::exception_ptr m_error;
+	// Set while compression has nothing to do and reading isn't finished
+	bool m_idle;
+	std::chrono::steady_clock::time_point m_idle_since;
+
+	std::thread m_reader;
+
+	void read();
+	void compress();
+	void fail(std::exception_ptr error);
+
+public:
+	save_pipeline(const entry_list& entries, const lib_pac::pac_archive::save_options& options,
+	              lib_pac::pac_archive::pipeline_stats& stats);
+	~save_pipeline();
+
+	size_t size() const;
+	// Waits until the batch is compressed, rethrowing the first failure of any stage
+	batch& wait(size_t index);
+	// Frees the batch's data once it is written, letting reading go on
+	void release(size_t index);
+};
+
+save_pipeline::save_pipeline(const entry_list& entries, const lib_pac::pac_archive::save_options& options,
+                             lib_pac::pac_archive::pipeline_stats& stats)
+	: m_entries(entries),
+	  m_options(options),
+	  m_stats(stats),
+	  m_buffered(0),
+	  m_ready_files(0),
+	  m_done_files(0),
+	  m_running(0),
+	  m_reading(true),
+	  m_abort(false),
+	  m_idle(true),
+	  m_idle_since(std::chrono::steady_clock::now())
+{
+	for (size_t i = 0; i < entries.size();)
+	{
+		batch next;
+		next.first = i;
+		next.last = i + 1;
+		next.streamed = streams(*entries[i].second);
+		next.size = next.streamed ? 0 : entries[i].second->data_size();
+		next.done = next.streamed;
+
+		while (!next.streamed && next.size < BATCH_SIZE && next.last < entries.size() &&
+			!streams(*entries[next.last].second) && entries[next.last].second->data_size() < BATCH_SIZE)
+		{
+			next.size += entries[next.last].second->data_size();
+			++next.last;
+		}
+
+		next.encoded.resize(next.last - next.first);
+		i = next.last;
+		m_batches.push_back(std::move(next));
+	}
+
+	m_reader = std::thread(&save_pipeline::read, this);
+}
+
+save_pipeline::~save_pipeline()
+{
+	// Left early when a stage fails, tasks still running reference the batches
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_abort = true;
+	m_changed.notify_all();
+	lock.unlock();
+
+	m_reader.join();
+
+	lock.lock();
+	m_changed.wait(lock, [this]() { return m_running == 0; });
+}
+
+size_t
+save_pipeline::size() const
+{
+	return m_batches.size();
+}
+
+void
+save_pipeline::fail(std::exception_ptr error)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_error)
+		m_error = error;
+	m_abort = true;
+}
+
+void
+save_pipeline::read()
+{
+	lib_pac::thread_pool& pool = lib_pac::thread_pool::instance();
+
+	try
+	{
+		for (size_t index = 0; index < m_batches.size(); ++index)
+		{
+			batch& current = m_batches[index];
+			if (current.streamed)
+				continue;
+
+			{
+				// A batch bigger than the whole budget goes through once nothing else is held
+				std::unique_lock<std::mutex> lock(m_mutex);
+				const auto start = std::chrono::steady_clock::now();
+				m_changed.wait(lock, [&]()
+				{
+					return m_abort || m_buffered == 0 || m_buffered + current.size <= m_options.max_buffered_bytes;
+				});
+				m_stats.read_stall_us += elapsed_us(start);
+				if (m_abort)
+					break;
+
+				m_buffered += current.size;
+				m_stats.peak_buffered_bytes = std::max(m_stats.peak_buffered_bytes, m_buffered);
+			}
+
+			current.inputs.resize(current.last - current.first);
+			for (size_t i = current.first; i < current.last; ++i)
+				current.inputs[i - current.first] = read_entry(*m_entries[i].second);
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_ready.push_back(index);
+				m_ready_files += static_cast<uint32_t>(current.last - current.first);
+				m_stats.max_compress_queue = std::max(m_stats.max_compress_queue, m_ready_files);
+				m_running++;
+
+				if (m_idle)
+				{
+					m_stats.compress_stall_us += elapsed_us(m_idle_since);
+					m_idle = false;
+				}
+			}
+			pool.submit([this]() { compress(); });
+		}
+	}
+	catch (...)
+	{
+		fail(std::current_exception());
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_idle)
+	{
+		m_stats.compress_stall_us += elapsed_us(m_idle_since);
+		m_idle = false;
+	}
+	m_reading = false;
+	m_changed.notify_all();
+}
+
+void
+save_pipeline::compress()
+{
+	size_t index;
+	{
+		// Largest first, so the last batches to finish are small ones
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto largest = std::max_element(m_ready.begin(), m_ready.end(), [this](size_t a, size_t b)
+		{
+			return m_batches[a].size < m_batches[b].size;
+		});
+		index = *largest;
+		m_ready.erase(largest);
+		m_ready_files -= static_cast<uint32_t>(m_batches[index].last - m_batches[index].first);
+	}
+
+	batch& current = m_batches[index];
+	uint64_t output_size = 0;
+	try
+	{
+		for (size_t i = current.first; i < current.last; ++i)
+		{
+			encoded_entry& encoded = current.encoded[i - current.first];
+			encode_entry(*m_entries[i].second, m_entries[i].first, m_options, current.inputs[i - current.first],
+			             encoded);
+			if (m_options.write_index && encoded.compressed)
+				encoded.blocks = lib_pac::pac_index::entry_blocks(encoded.data.data(), encoded.data.size());
+			output_size += encoded.data.size();
+		}
+	}
+	catch (...)
+	{
+		fail(std::current_exception());
+	}
+	current.inputs = std::vector<std::vector<char>>();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_buffered = m_buffered - current.size + output_size;
+	current.size = output_size;
+	current.done = true;
+
+	m_done_files += static_cast<uint32_t>(current.last - current.first);
+	m_stats.max_write_queue = std::max(m_stats.max_write_queue, m_done_files);
+
+	m_running--;
+	if (m_running == 0 && m_reading && !m_idle)
+	{
+		m_idle = true;
+		m_idle_since = std::chrono::steady_clock::now();
+	}
+	m_changed.notify_all();
+}
+
+save_pipeline::batch&
+save_pipeline::wait(size_t index)
+{
+	batch& current = m_batches[index];
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	const auto start = std::chrono::steady_clock::now();
+	m_changed.wait(lock, [&]() { return current.done || m_error; });
+	m_stats.write_stall_us += elapsed_us(start);
+
+	if (m_error)
+		std::rethrow_exception(m_error);
+
+	if (!current.streamed)
+		m_done_files -= static_cast<uint32_t>(current.last - current.first);
+	return current;
+}
+
+void
+save_pipeline::release(size_t index)
 {
+	batch& current = m_batches[index];
+	current.encoded = std::vector<encoded_entry>();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_buffered -= current.size;
+	current.size = 0;
+	m_changed.notify_all();
 }
 
 lib_pac::pac_archive::archive_info
 lib_pac::pac_archive::save(std::wstring file, progress_callback callback) const
+{
+	return save(file, callback, save_options());
+}
+
+lib_pac::pac_archive::archive_info
+lib_pac::pac_archive::save(std::wstring file, progress_callback callback, const save_options& options) const
 {
 	std::ofstream output(file, std::ios::binary | std::ios::trunc);
 
@@ -56,9 +608,10 @@ lib_pac::pac_archive::save(std::wstring file, progress_callback callback) const
 	// DW_PACK\0
 	//static char magic[8] = "DW_PACK";
 	//strcpy_s(header.Magic, magic);
-	header.NumFiles = m_entries.size();
+	const auto all_sources = sources();
+	header.NumFiles = all_sources.size();
 
-	std::list<std::pair<std::string, std::shared_ptr<file_source_base>>> sorted(m_entries.begin(), m_entries.end());
+	std::list<std::pair<std::string, std::shared_ptr<file_source_base>>> sorted(all_sources.begin(), all_sources.end());
 
 	sorted.sort([](std::pair<std::string, std::shared_ptr<file_source_base>> a,
 	               std::pair<std::string, std::shared_ptr<file_source_base>> b)
@@ -107,9 +660,9 @@ lib_pac::pac_archive::save(std::wstring file, progress_callback callback) const
 
 	int file_id = 0;
 	int file_offset = 0;
+	size_t written_end = 0;
 
 	memory_buffer file_buf;
-	memory_buffer comp_buf;
 
 	archive_info arch_info;
 	arch_info.total_files = header.NumFiles;
@@ -117,79 +670,165 @@ lib_pac::pac_archive::save(std::wstring file, progress_callback callback) const
 
 	output.write((char*)&header, HEADER_SIZE);
 
-	for (auto pair : sorted)
+	const entry_list entries(sorted.begin(), sorted.end());
+
+	// The sidecar is built from the entries as they are written, the archive isn't read back for it
+	std::vector<pac_index::saved_entry> index_entries;
+
+	// Entries are written in directory order while later ones are still being read and compressed
+	save_pipeline pipeline(entries, options, arch_info.pipeline);
+	for (size_t index = 0; index < pipeline.size(); ++index)
 	{
-		auto& file_source = pair.second;
+		save_pipeline::batch& current = pipeline.wait(index);
+		if (current.streamed)
+		{
+			stream_entry(output, data_start + file_offset, *entries[current.first].second, entries[current.first].first,
+			             options, file_buf, current.encoded[0], written_end);
+		}
 
-		structs::PAC_DIRECTORY_ENTRY entry;
-		entry.FileId = file_id;
-		strcpy_s(entry.FileName, pair.first.c_str());
-		if (file_source->compressed())
+		for (size_t i = current.first; i < current.last; ++i)
 		{
-			const uint32_t comp_size = file_source->data_size();
-			const uint32_t dec_size = file_source->unpacked_size();
+			encoded_entry& result = current.encoded[i - current.first];
 
-			entry.CompSize = comp_size;
-			entry.RawSize = dec_size;
-			entry.Compressed = 1;
+			structs::PAC_DIRECTORY_ENTRY entry;
+			entry.FileId = file_id;
+			strcpy_s(entry.FileName, entries[i].first.c_str());
+			entry.CompSize = result.comp_size;
+			entry.RawSize = result.raw_size;
+			entry.Compressed = result.compressed;
 			entry.Offset = file_offset;
 
-			comp_buf.reserve(comp_size);
-			file_source->copy_data(comp_buf.data(), 0, comp_size);
-		}
-		else
-		{
-			const uint32_t dec_size = file_source->unpacked_size();
-			file_buf.reserve(dec_size);
-			file_source->copy_data(file_buf.data(), 0, file_source->unpacked_size());
-			const auto comp_info = compressor::prepare_compression(file_buf.data(), dec_size, 0x20000);
-			const uint32_t comp_size = comp_info->output_size();
-
-			comp_buf.reserve(comp_size);
-			compressor::compress(*comp_info, comp_buf.data());
-
-			entry.CompSize = comp_size;
-			entry.RawSize = dec_size;
-			entry.Compressed = 1;
-			entry.Offset = file_offset;
-		}
+			output.seekp(header_start + ENTRY_SIZE * file_id);
+			output.write((char*)&entry, ENTRY_SIZE);
 
-		output.seekp(header_start + ENTRY_SIZE * file_id);
-		output.write((char*)&entry, ENTRY_SIZE);
+			if (!result.data.empty())
+			{
+				output.seekp(data_start + file_offset);
+				output.write(result.data.data(), result.data.size());
+			}
 
-		output.seekp(data_start + file_offset);
-		output.write((char*)comp_buf.data(), entry.CompSize);
+			if (options.write_index)
+			{
+				const pac_index::entry info = { 0, static_cast<uint32_t>(data_start + file_offset), entry.CompSize,
+				                                entry.RawSize, entry.Compressed, 0, 0 };
+				index_entries.push_back({ entries[i].first, info, std::move(result.blocks) });
+			}
 
-		file_id++;
-		file_offset += entry.CompSize;
+			file_id++;
+			file_offset += entry.CompSize;
 
+			if (!entry.Compressed)
+				arch_info.stored_files++;
 
-		if (callback)
-		{
-			const progress_info info(file_id, header.NumFiles, pair.first, entry.RawSize, entry.CompSize);
-			callback(info);
+			if (callback)
+			{
+				const progress_info info(file_id, header.NumFiles, entries[i].first, entry.RawSize, entry.CompSize,
+				                         result.block_size, result.saved_size, !entry.Compressed);
+				callback(info);
+			}
+			arch_info.compressed_size += entry.CompSize;
+			arch_info.original_size += entry.RawSize;
 		}
-		arch_info.compressed_size += entry.CompSize;
-		arch_info.original_size += entry.RawSize;
+
+		pipeline.release(index);
+	}
+
+	output.close();
+
+	// A streamed file that ended up stored can leave compressed bytes past the last entry
+	if (written_end > data_start + file_offset)
+		fs::resize_file(file, data_start + file_offset);
+
+	// A sidecar left from an earlier save would no longer match, it is rewritten or removed
+	if (options.write_index)
+	{
+		arch_info.index_failed = !pac_index::write(file, std::move(index_entries));
+	}
+	else
+	{
+		std::error_code error;
+		fs::remove(pac_index::sidecar_path(file), error);
 	}
 
 	return arch_info;
 }
 
+bool
+lib_pac::pac_archive::write_index(std::wstring file)
+{
+	return pac_index::write(file);
+}
+
 size_t
 lib_pac::pac_archive::num_files() const
 {
-	return m_entries.size();
+	return m_directory->size() - m_hidden_count + m_entries.size();
 }
 
+size_t
+lib_pac::pac_archive::directory_size() const
+{
+	return m_directory->size();
+}
+
+size_t
+lib_pac::pac_archive::find_directory(const std::string& file) const
+{
+	const size_t index = m_directory->find(file);
+	if (index == m_directory->size() || m_hidden[index])
+		return m_directory->size();
+	return index;
+}
+
+std::shared_ptr<lib_pac::file_source_base>
+lib_pac::pac_archive::directory_source(size_t index) const
+{
+	std::shared_ptr<file_source_base> source = std::atomic_load(&m_sources[index]);
+	if (source)
+		return source;
+
+	// Threads asking for the same entry at once all get the source stored first
+	const pac_index::entry& entry = m_directory->at(index);
+	std::shared_ptr<file_source_base> created = std::make_shared<pac_file_source>(
+		m_file, entry.data_offset, entry.compressed_size, entry.raw_size, entry.compressed != 0,
+		m_directory->blocks(index));
+	if (std::atomic_compare_exchange_strong(&m_sources[index], &source, created))
+		return created;
+	return source;
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<lib_pac::file_source_base>>>
+lib_pac::pac_archive::sources() const
+{
+	std::vector<std::pair<std::string, std::shared_ptr<file_source_base>>> result;
+	result.reserve(num_files());
+
+	auto inserted = m_entries.begin();
+	for (size_t i = 0; i < m_directory->size(); ++i)
+	{
+		if (m_hidden[i])
+			continue;
+
+		const char* name = m_directory->name(i);
+		for (; inserted != m_entries.end() && strcmp(inserted->first.c_str(), name) < 0; ++inserted)
+			result.push_back(*inserted);
+		result.emplace_back(name, directory_source(i));
+	}
+	result.insert(result.end(), inserted, m_entries.end());
+	return result;
+}
 
 bool
 lib_pac::pac_archive::remove(const std::string& file)
 {
-	auto found = m_entries.find(file);
-	if (found == m_entries.end())
+	if (m_entries.erase(file))
+		return true;
+
+	const size_t index = find_directory(file);
+	if (index == m_directory->size())
 		return false;
-	m_entries.erase(file);
+	m_hidden[index] = true;
+	m_hidden_count++;
 	return true;
 }
 
@@ -197,67 +836,294 @@ std::shared_ptr<lib_pac::file_source_base>
 lib_pac::pac_archive::get(const std::string& file)
 {
 	auto found = m_entries.find(file);
-	if (found == m_entries.end())
+	if (found != m_entries.end())
+		return found->second;
+
+	const size_t index = find_directory(file);
+	if (index == m_directory->size())
 		return std::shared_ptr<file_source_base>(nullptr);
-	return found->second;
+	return directory_source(index);
 }
 
 void
 lib_pac::pac_archive::insert(const std::string& virt_path, std::shared_ptr<file_source_base> src)
 {
-	auto found = m_entries.find(virt_path);
-	if (found != m_entries.end())
-		m_entries.erase(virt_path);
+	// The inserted source takes the place of a directory entry with the same name
+	const size_t index = find_directory(virt_path);
+	if (index != m_directory->size())
+	{
+		m_hidden[index] = true;
+		m_hidden_count++;
+	}
 	m_entries[virt_path] = std::move(src);
 }
 
 // Iterator
 
 lib_pac::pac_archive::iterator
-lib_pac::pac_archive::begin()
+lib_pac::pac_archive::begin() const
 {
-	auto begin = m_entries.begin();
-	return iterator(begin);
+	return iterator(this, 0, m_entries.begin());
 }
 
 lib_pac::pac_archive::iterator
-lib_pac::pac_archive::end()
+lib_pac::pac_archive::end() const
 {
-	auto end = m_entries.end();
-	return iterator(end);
+	return iterator(this, directory_size(), m_entries.end());
 }
 
+lib_pac::pac_archive::iterator::iterator(const pac_archive* archive, size_t index,
+                                         std::map<std::string, std::shared_ptr<file_source_base>>::const_iterator
+                                         inserted)
+	: m_archive(archive),
+	  m_index(index),
+	  m_inserted(inserted)
+{
+	skip_hidden();
+}
 
-lib_pac::pac_archive::iterator::iterator(std::map<std::string, std::shared_ptr<file_source_base>>::iterator& base)
+bool
+lib_pac::pac_archive::iterator::at_directory() const
+{
+	if (m_index == m_archive->directory_size())
+		return false;
+	if (m_inserted == m_archive->m_entries.end())
+		return true;
+	return strcmp(m_archive->m_directory->name(m_index), m_inserted->first.c_str()) < 0;
+}
+
+void
+lib_pac::pac_archive::iterator::skip_hidden()
 {
-	m_iter = base;
+	while (m_index < m_archive->directory_size() && m_archive->m_hidden[m_index])
+		++m_index;
 }
 
-std::string
+lib_pac::pac_archive::entry_info
 lib_pac::pac_archive::iterator::operator*() const
 {
-	return (*m_iter).first;
+	if (at_directory())
+	{
+		const pac_index::entry& entry = m_archive->m_directory->at(m_index);
+		return entry_info{ m_archive->m_directory->name(m_index), entry.raw_size, entry.compressed_size,
+		                   entry.compressed != 0 };
+	}
+
+	file_source_base& source = *m_inserted->second;
+	return entry_info{ m_inserted->first.c_str(), source.unpacked_size(), source.data_size(), source.compressed() };
 }
 
 lib_pac::pac_archive::iterator&
 lib_pac::pac_archive::iterator::operator++()
 {
-	++m_iter;
+	if (at_directory())
+	{
+		++m_index;
+		skip_hidden();
+	}
+	else
+	{
+		++m_inserted;
+	}
 	return *this;
 }
 
 bool
 lib_pac::pac_archive::iterator::operator!=(const iterator& rhs) const
 {
-	return m_iter != rhs.m_iter;
+	return m_index != rhs.m_index || m_inserted != rhs.m_inserted;
 }
 
 lib_pac::pac_archive::progress_info::progress_info(int cur_file, int num_files, const std::string& file_name,
-                                                   uint32_t raw_size, uint32_t compressed_size): cur_file(cur_file),
-                                                                                                 num_files(num_files),
-                                                                                                 file_name(file_name),
-                                                                                                 raw_size(raw_size),
-                                                                                                 compressed_size(
-	                                                                                                 compressed_size)
+                                                   uint32_t raw_size, uint32_t compressed_size, uint32_t block_size,
+                                                   int32_t saved_size, bool stored): cur_file(cur_file),
+                                                                                     num_files(num_files),
+                                                                                     file_name(file_name),
+                                                                                     raw_size(raw_size),
+                                                                                     compressed_size(compressed_size),
+                                                                                     block_size(block_size),
+                                                                                     saved_size(saved_size),
+                                                                                     stored(stored)
+{
+}
+
+// Extraction
+
+// Writes decoded data to an extracted file
+class extract_sink : public lib_pac::data_sink
 {
+private:
+	std::ofstream& m_output;
+	uint64_t m_size;
+
+public:
+	explicit extract_sink(std::ofstream& output) : m_output(output), m_size(0)
+	{
+	}
+
+	void write(const char* data, size_t size) override
+	{
+		m_output.write(data, size);
+		m_size += size;
+	}
+
+	uint64_t size() const
+	{
+		return m_size;
+	}
+};
+
+// Returns why the entry couldn't be extracted, empty when it was
+static std::string
+extract_entry(lib_pac::file_source_base& source, const fs::path& target)
+{
+	const std::wstring file = target.wstring();
+	std::ofstream output(file, std::ios::binary | std::ios::trunc);
+	if (!output)
+		return "Cannot Write";
+
+	extract_sink sink(output);
+	const uint32_t data_size = source.data_size();
+	if (source.compressed())
+	{
+		// Small entries decode on this thread next to other entries, big ones spread their blocks over
+		// the pool and are read a block at a time
+		bool valid;
+		if (data_size >= BLOCK_PARALLEL_SIZE)
+		{
+			valid = lib_pac::compressor::decompress_stream(source, sink);
+		}
+		else
+		{
+			std::vector<char> input;
+			const char* data = source.data_view();
+			if (!data)
+			{
+				input.resize(data_size);
+				source.copy_data(input.data(), 0, data_size);
+				data = input.data();
+			}
+			const auto info = lib_pac::compressor::prepare_decompression(data, data_size);
+			valid = info != nullptr;
+			if (valid)
+			{
+				std::vector<char> output(info->output_size());
+				valid = lib_pac::compressor::decompress(*info, output.data(), 1);
+				if (valid)
+					sink.write(output.data(), output.size());
+			}
+		}
+
+		if (!valid)
+			return "Invalid Data";
+	}
+	else if (const char* data = source.data_view())
+	{
+		sink.write(data, data_size);
+	}
+	else
+	{
+		std::vector<char> buffer(std::min(data_size, STREAM_CHUNK));
+		for (uint32_t offset = 0; offset < data_size; offset += STREAM_CHUNK)
+		{
+			const uint32_t count = std::min(STREAM_CHUNK, data_size - offset);
+			source.copy_data(buffer.data(), offset, count);
+			sink.write(buffer.data(), count);
+		}
+	}
+
+	output.flush();
+	if (!output)
+		return "Cannot Write";
+
+	if (sink.size() != source.unpacked_size())
+	{
+		return "Size Mismatch - Expected " + std::to_string(source.unpacked_size()) + " got " +
+			std::to_string(sink.size());
+	}
+	return std::string();
+}
+
+lib_pac::pac_archive::extract_info
+lib_pac::pac_archive::extract_all(std::wstring destination) const
+{
+	return extract_all(destination, extract_options());
+}
+
+lib_pac::pac_archive::extract_info
+lib_pac::pac_archive::extract_all(std::wstring destination, const extract_options& options) const
+{
+	const fs::path root = destination;
+	const std::vector<std::pair<std::string, std::shared_ptr<file_source_base>>> entries = sources();
+
+	extract_info info;
+	info.total_files = static_cast<uint32_t>(entries.size());
+
+	// Directories are all created up front, each one once, entries are then written concurrently
+	std::set<fs::path> directories;
+	for (const auto& entry : entries)
+		directories.insert((root / entry.first).parent_path());
+	for (const auto& directory : directories)
+	{
+		std::error_code error;
+		fs::create_directories(directory, error);
+	}
+
+	// Largest entries first so the last to finish are small, entries below BATCH_SIZE share tasks
+	std::vector<size_t> order(entries.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&entries](size_t a, size_t b)
+	{
+		return entries[a].second->data_size() > entries[b].second->data_size();
+	});
+
+	std::vector<std::vector<size_t>> tasks;
+	uint64_t batch_size = BATCH_SIZE;
+	for (const size_t i : order)
+	{
+		if (batch_size >= BATCH_SIZE)
+		{
+			tasks.emplace_back();
+			batch_size = 0;
+		}
+		tasks.back().push_back(i);
+		batch_size += entries[i].second->data_size();
+	}
+
+	std::mutex mutex;
+	int finished = 0;
+
+	thread_pool& pool = thread_pool::instance();
+	pool.parallel_for(static_cast<uint32_t>(tasks.size()), options.n_threads ? options.n_threads : pool.size() + 1, 1,
+	                  [&](uint32_t task)
+	                  {
+		                  for (const size_t i : tasks[task])
+		                  {
+			                  const std::string& file_name = entries[i].first;
+			                  file_source_base& source = *entries[i].second;
+			                  const std::string reason = extract_entry(source, root / file_name);
+
+			                  std::lock_guard<std::mutex> lock(mutex);
+			                  finished++;
+			                  if (reason.empty())
+				                  info.extracted_size += source.unpacked_size();
+			                  else
+				                  info.failures.push_back({ file_name, reason });
+
+			                  if (options.callback)
+			                  {
+				                  const progress_info progress(finished, info.total_files, file_name,
+				                                               source.unpacked_size(), source.data_size(), 0, 0,
+				                                               !source.compressed());
+				                  options.callback(progress);
+			                  }
+		                  }
+	                  });
+
+	std::sort(info.failures.begin(), info.failures.end(), [](const extract_failure& a, const extract_failure& b)
+	{
+		return a.file_name < b.file_name;
+	});
+	return info;
 }
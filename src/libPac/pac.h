@@ -1,27 +1,67 @@
 #pragma once
 #include "defines.h"
 
+#include <functional>
 #include <list>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "filesourcebase.h"
+#include "compressor.h"
 #include <map>
 
 namespace lib_pac
 {
+	class archive_file;
+	class pac_index;
+
 	class pac_archive
 	{
 	private:
+		// Entries of the archive file the object was opened from, never changed after opening
+		std::shared_ptr<archive_file> m_file;
+		std::shared_ptr<const pac_index> m_directory;
+		// Directory entries removed or replaced by an inserted source
+		std::vector<bool> m_hidden;
+		size_t m_hidden_count;
+		// Sources of directory entries, created on first use and kept so each reads its block table once
+		mutable std::vector<std::shared_ptr<file_source_base>> m_sources;
+
+		// Sources inserted since
 		std::map<std::string, std::shared_ptr<file_source_base>> m_entries;
 
+		// Index of the visible directory entry named file, the directory's size when there is none
+		size_t find_directory(const std::string& file) const;
+		size_t directory_size() const;
+		std::shared_ptr<file_source_base> directory_source(size_t index) const;
+		// Every entry by name
+		std::vector<std::pair<std::string, std::shared_ptr<file_source_base>>> sources() const;
+
 	public:
-		class iterator : public std::iterator<std::output_iterator_tag, std::string>
+		struct entry_info
+		{
+			// Valid until the archive is changed
+			const char* name;
+			uint32_t raw_size;
+			uint32_t compressed_size;
+			bool compressed;
+		};
+
+		// Walks directory entries and inserted sources together, in name order
+		class iterator : public std::iterator<std::forward_iterator_tag, entry_info>
 		{
 		private:
-			std::map<std::string, std::shared_ptr<file_source_base>>::iterator m_iter;
+			const pac_archive* m_archive;
+			size_t m_index;
+			std::map<std::string, std::shared_ptr<file_source_base>>::const_iterator m_inserted;
+
+			bool at_directory() const;
+			void skip_hidden();
 		public:
-			explicit iterator(std::map<std::string, std::shared_ptr<file_source_base>>::iterator& base);
-			EXPORTS std::string operator*() const;
+			iterator(const pac_archive* archive, size_t index,
+			         std::map<std::string, std::shared_ptr<file_source_base>>::const_iterator inserted);
+			EXPORTS entry_info operator*() const;
 			EXPORTS iterator& operator++();
 			EXPORTS bool operator!=(const iterator& rhs) const;
 		};
@@ -29,13 +69,65 @@ namespace lib_pac
 		struct progress_info
 		{
 			progress_info(int cur_file, int num_files, const std::string& file_name, uint32_t raw_size,
-			              uint32_t compressed_size);
+			              uint32_t compressed_size, uint32_t block_size = 0, int32_t saved_size = 0,
+			              bool stored = false);
 
 			int cur_file;
 			int num_files;
 			const std::string& file_name;
 			uint32_t raw_size;
 			uint32_t compressed_size;
+			// Block size picked for the file, 0 when its data was copied as is, and the bytes
+			// saved over the normal level's output with DEFAULT_BLOCK_SIZE
+			uint32_t block_size;
+			int32_t saved_size;
+			// Set when the file went in uncompressed
+			bool stored;
+		};
+
+		// Block size every file used before sizes were picked per file
+		static const uint32_t DEFAULT_BLOCK_SIZE = 0x20000;
+		static const uint64_t DEFAULT_BUFFERED_BYTES = 0x20000000;
+
+		enum class entry_storage : uint8_t
+		{
+			// Compressed when it saves at least the store margin, stored otherwise
+			automatic,
+			compress,
+			store,
+		};
+
+		struct save_options
+		{
+			compression_level level = compression_level::normal;
+			// Ceiling on the block size picked per file, the game is known to accept DEFAULT_BLOCK_SIZE.
+			// The fast level doesn't pick, it uses DEFAULT_BLOCK_SIZE or the ceiling if that is lower.
+			uint32_t max_block_size = DEFAULT_BLOCK_SIZE;
+			// Fraction of a file's size compression has to save for the file to go in compressed. Files from 64 MiB
+			// up are streamed and, except at the fast level, judged on their first 8 MiB. One that guess gets wrong
+			// is compressed whole and then copied in stored after all.
+			float store_margin = 0.02f;
+			// Storage by lower case extension, dot included, for files that skip the automatic choice
+			std::map<std::string, entry_storage> extension_storage;
+			// Cap on file data held between reading and writing, reading waits while it is reached.
+			// A single file bigger than the cap still goes through on its own.
+			uint64_t max_buffered_bytes = DEFAULT_BUFFERED_BYTES;
+			// Writes the .pacidx sidecar next to the archive, later opens map it instead of parsing the archive
+			bool write_index = false;
+		};
+
+		// How the read, compress and write stages of save kept up with each other
+		struct pipeline_stats
+		{
+			// Time reading waited for buffered data to be written, compression had nothing read to
+			// work on, and writing waited for the next entry to be compressed
+			uint64_t read_stall_us = 0;
+			uint64_t compress_stall_us = 0;
+			uint64_t write_stall_us = 0;
+			// Most files read but not yet compressed, and compressed but not yet written, at once
+			uint32_t max_compress_queue = 0;
+			uint32_t max_write_queue = 0;
+			uint64_t peak_buffered_bytes = 0;
 		};
 
 		struct archive_info
@@ -44,20 +136,56 @@ namespace lib_pac
 			uint32_t total_files = 0;
 			uint32_t original_size = 0;
 			uint32_t compressed_size = 0;
+			uint32_t stored_files = 0;
+			pipeline_stats pipeline;
+			// Set when save_options.write_index asked for the sidecar and it couldn't be written
+			bool index_failed = false;
 		};
 
-		typedef void (*progress_callback)(const progress_info& info);
+		// A function object so callers can tell archives apart when several are processed at once
+		typedef std::function<void(const progress_info& info)> progress_callback;
+
+		struct extract_options
+		{
+			// Called as each entry finishes, one call at a time, with cur_file counting finished entries
+			progress_callback callback = nullptr;
+			// Cap on entries decoded at once, 0 uses the whole thread pool
+			uint32_t n_threads = 0;
+		};
+
+		struct extract_failure
+		{
+			std::string file_name;
+			std::string reason;
+		};
+
+		struct extract_info
+		{
+			uint32_t total_files = 0;
+			uint64_t extracted_size = 0;
+			std::vector<extract_failure> failures;
+		};
 
 		EXPORTS size_t num_files() const;
-		EXPORTS iterator begin();
-		EXPORTS iterator end();
+		EXPORTS iterator begin() const;
+		EXPORTS iterator end() const;
 
 		EXPORTS bool remove(const std::string& file);
 		EXPORTS void insert(const std::string& virt_path, std::shared_ptr<file_source_base> ptr);
+		// Entries of the opened archive keep their source, every call returns the same one
 		EXPORTS std::shared_ptr<file_source_base> get(const std::string& file);
 
 		EXPORTS explicit pac_archive(std::wstring file);
 		EXPORTS pac_archive();
 		EXPORTS archive_info save(std::wstring file, progress_callback callback = nullptr) const;
+		EXPORTS archive_info save(std::wstring file, progress_callback callback, const save_options& options) const;
+
+		// Writes the .pacidx sidecar of an archive saved earlier, false when it can't be read or written
+		EXPORTS static bool write_index(std::wstring file);
+
+		// Writes every entry under destination, many entries at once on the thread pool. Entries that
+		// can't be decoded or written are listed in the result, the others are still extracted.
+		EXPORTS extract_info extract_all(std::wstring destination) const;
+		EXPORTS extract_info extract_all(std::wstring destination, const extract_options& options) const;
 	};
 }
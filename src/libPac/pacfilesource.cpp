@@ -1,5 +1,4 @@
 #include <algorithm>
-#include <fstream>
 
 #include "structs.h"
 #include "pacfilesource.h"
@@ -8,14 +7,17 @@ lib_pac::pac_file_source::~pac_file_source()
 {
 }
 
-lib_pac::pac_file_source::pac_file_source(std::wstring file, uint32_t base_offset,
-                                     lib_pac::structs::PAC_DIRECTORY_ENTRY& entry) :
-	m_pac_file(file),
-	m_offset(base_offset + entry.Offset),
-	m_dec_size(entry.RawSize),
-	m_comp_size(entry.CompSize),
-	m_compressed(entry.Compressed)
+lib_pac::pac_file_source::pac_file_source(std::shared_ptr<archive_file> file, uint32_t offset, uint32_t comp_size,
+                                          uint32_t dec_size, bool compressed,
+                                          std::shared_ptr<const block_table> blocks) :
+	m_pac_file(std::move(file)),
+	m_offset(offset),
+	m_dec_size(dec_size),
+	m_comp_size(comp_size),
+	m_compressed(compressed)
 {
+	if (blocks)
+		set_block_table(std::move(blocks));
 }
 
 bool lib_pac::pac_file_source::compressed()
@@ -40,9 +42,12 @@ std::unique_ptr<lib_pac::file_source_base> lib_pac::pac_file_source::get_copy()
 
 void lib_pac::pac_file_source::copy_data(char* dst, uint32_t offset, uint32_t count)
 {
-	std::ifstream file(m_pac_file, std::ios::binary);
-	file.seekg(m_offset + offset, std::ios_base::beg);
 	uint32_t to_read = std::min(count, m_comp_size - offset);
 
-	file.read(dst, to_read);
+	m_pac_file->read(dst, uint64_t(m_offset) + offset, to_read);
+}
+
+const char* lib_pac::pac_file_source::data_view()
+{
+	return m_pac_file->view(m_offset, m_comp_size);
 }
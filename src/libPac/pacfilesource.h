@@ -6,6 +6,7 @@
 #include <string>
 
 #include "structs.h"
+#include "archivefile.h"
 #include "filesourcebase.h"
 
 namespace lib_pac
@@ -13,7 +14,8 @@ namespace lib_pac
 	class pac_file_source : public file_source_base
 	{
 	private:
-		std::wstring m_pac_file;
+		// Shared by every entry of the archive
+		std::shared_ptr<archive_file> m_pac_file;
 		uint32_t m_offset;
 		uint32_t m_dec_size;
 		uint32_t m_comp_size;
@@ -21,7 +23,9 @@ namespace lib_pac
 
 	public:
 		~pac_file_source();
-		pac_file_source(std::wstring pac_file, uint32_t base_offset, structs::PAC_DIRECTORY_ENTRY &entry);
+		// blocks is the entry's block table when the archive index holds it, null otherwise
+		pac_file_source(std::shared_ptr<archive_file> pac_file, uint32_t offset, uint32_t comp_size, uint32_t dec_size,
+		                bool compressed, std::shared_ptr<const block_table> blocks = nullptr);
 
 		bool compressed() override;
 		uint32_t data_size() override;
@@ -30,6 +34,7 @@ namespace lib_pac
 		std::unique_ptr<file_source_base> get_copy() const override;
 
 		void copy_data(char* dst, uint32_t offset, uint32_t count) override;
+		const char* data_view() override;
 	};
 
 }
@@ -0,0 +1,486 @@
+#include "pacindex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "archivefile.h"
+#include "compressor.h"
+#include "kernels.h"
+#include "pacfilesource.h"
+#include "structs.h"
+#include "threadpool.h"
+
+namespace fs = std::experimental::filesystem;
+
+// Start of a .pacidx file, followed by the seeds, slots, entries, blocks and names in that order
+struct sidecar_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_count;
+	// The archive the sidecar describes, any change to either makes readers parse the archive instead
+	uint64_t archive_size;
+	int64_t archive_time;
+	uint32_t bucket_count;
+	uint32_t block_count;
+	uint32_t names_size;
+	uint32_t reserved;
+};
+
+static const char SIDECAR_MAGIC[8] = { 'P', 'A', 'C', 'I', 'D', 'X', 0, 0 };
+static const uint32_t SIDECAR_VERSION = 1;
+
+// Names per hash bucket on average, fuller buckets make a smaller table that takes longer to build
+static const uint32_t BUCKET_LOAD = 4;
+// Seeds tried for a bucket before building gives up
+static const uint32_t MAX_SEED = 0x1000000;
+
+static uint64_t
+name_hash(const char* name, size_t length, uint32_t seed)
+{
+	// FNV-1a, finished with a mix so neighbouring seeds send names to unrelated slots
+	uint64_t hash = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= static_cast<uint8_t>(name[i]);
+		hash *= 0x100000001b3ull;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static bool
+archive_time(const std::wstring& archive, int64_t& time)
+{
+	std::error_code error;
+	const auto write_time = fs::last_write_time(archive, error);
+	if (error)
+		return false;
+	time = write_time.time_since_epoch().count();
+	return true;
+}
+
+lib_pac::pac_index::pac_index()
+	: m_entries(nullptr),
+	  m_size(0),
+	  m_names(nullptr),
+	  m_names_size(0),
+	  m_blocks(nullptr),
+	  m_block_count(0),
+	  m_seeds(nullptr),
+	  m_bucket_count(0),
+	  m_slots(nullptr)
+{
+}
+
+std::wstring
+lib_pac::pac_index::sidecar_path(const std::wstring& archive)
+{
+	return fs::path(archive).replace_extension(".pacidx").wstring();
+}
+
+std::shared_ptr<const lib_pac::pac_index>
+lib_pac::pac_index::parse(const archive_file& file)
+{
+	structs::PAC_HEADER header;
+	if (file.read(reinterpret_cast<char*>(&header), 0, sizeof(header)) != sizeof(header) ||
+		strncmp(header.Magic, "DW_PACK", 8) != 0)
+		return nullptr;
+
+	const uint64_t directory_size = uint64_t(header.NumFiles) * sizeof(structs::PAC_DIRECTORY_ENTRY);
+	if (sizeof(header) + directory_size > file.size())
+		return nullptr;
+
+	// The whole directory comes in with one read, straight from the mapping when there is one
+	std::vector<char> buffer;
+	const char* directory = file.view(sizeof(header), directory_size);
+	if (!directory)
+	{
+		buffer.resize(directory_size);
+		file.read(buffer.data(), sizeof(header), static_cast<uint32_t>(directory_size));
+		directory = buffer.data();
+	}
+
+	const uint32_t base_offset = static_cast<uint32_t>(sizeof(header) + directory_size);
+
+	auto index = std::make_shared<pac_index>();
+	std::vector<entry>& entries = index->m_entry_data;
+	std::vector<char>& names = index->m_name_data;
+
+	entries.reserve(header.NumFiles);
+	for (uint32_t i = 0; i < header.NumFiles; ++i)
+	{
+		structs::PAC_DIRECTORY_ENTRY directory_entry;
+		std::memcpy(&directory_entry, directory + uint64_t(i) * sizeof(directory_entry), sizeof(directory_entry));
+
+		entry compact;
+		compact.name_offset = static_cast<uint32_t>(names.size());
+		compact.data_offset = base_offset + directory_entry.Offset;
+		compact.compressed_size = directory_entry.CompSize;
+		compact.raw_size = directory_entry.RawSize;
+		compact.compressed = directory_entry.Compressed != 0;
+		compact.first_block = 0;
+		compact.block_count = 0;
+		entries.push_back(compact);
+
+		const size_t name_length = strnlen(directory_entry.FileName, sizeof(directory_entry.FileName));
+		names.insert(names.end(), directory_entry.FileName, directory_entry.FileName + name_length);
+		names.push_back('\0');
+	}
+
+	// Archives list directories first, lookups need plain name order. A name listed twice keeps its last entry.
+	std::stable_sort(entries.begin(), entries.end(), [&names](const entry& a, const entry& b)
+	{
+		return strcmp(&names[a.name_offset], &names[b.name_offset]) < 0;
+	});
+	const auto last = std::unique(entries.rbegin(), entries.rend(), [&names](const entry& a, const entry& b)
+	{
+		return strcmp(&names[a.name_offset], &names[b.name_offset]) == 0;
+	});
+	entries.erase(entries.begin(), last.base());
+	entries.shrink_to_fit();
+
+	index->m_entries = entries.data();
+	index->m_size = entries.size();
+	index->m_names = names.data();
+	index->m_names_size = names.size();
+	return index;
+}
+
+std::shared_ptr<const lib_pac::pac_index>
+lib_pac::pac_index::load(const std::wstring& archive, const archive_file& file)
+{
+	// Only a mapped sidecar saves work over parsing the archive
+	const auto sidecar = archive_file::open(sidecar_path(archive));
+	if (!sidecar || !sidecar->mapped())
+		return nullptr;
+
+	const char* data = sidecar->view(0, sidecar->size());
+	sidecar_header header;
+	if (sidecar->size() < sizeof(header))
+		return nullptr;
+	std::memcpy(&header, data, sizeof(header));
+
+	int64_t time;
+	if (memcmp(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)) != 0 || header.version != SIDECAR_VERSION ||
+		header.archive_size != file.size() || !archive_time(archive, time) || header.archive_time != time)
+		return nullptr;
+
+	const uint64_t seeds_offset = sizeof(header);
+	const uint64_t slots_offset = seeds_offset + sizeof(uint32_t) * uint64_t(header.bucket_count);
+	const uint64_t entries_offset = slots_offset + sizeof(uint32_t) * uint64_t(header.entry_count);
+	const uint64_t blocks_offset = entries_offset + sizeof(entry) * uint64_t(header.entry_count);
+	const uint64_t names_offset = blocks_offset + sizeof(block) * uint64_t(header.block_count);
+	if (names_offset + header.names_size != sidecar->size())
+		return nullptr;
+
+	// Every name hashes into some bucket, and the names end in a NUL so no comparison runs past them
+	if (header.entry_count && (!header.bucket_count || !header.names_size ||
+		data[names_offset + header.names_size - 1] != '\0'))
+		return nullptr;
+
+	// Entries are checked as they are used, opening only touches the header
+	auto index = std::make_shared<pac_index>();
+	index->m_sidecar = sidecar;
+	index->m_entries = reinterpret_cast<const entry*>(data + entries_offset);
+	index->m_size = header.entry_count;
+	index->m_names = data + names_offset;
+	index->m_names_size = header.names_size;
+	index->m_blocks = reinterpret_cast<const block*>(data + blocks_offset);
+	index->m_block_count = header.block_count;
+	index->m_seeds = reinterpret_cast<const uint32_t*>(data + seeds_offset);
+	index->m_bucket_count = header.bucket_count;
+	index->m_slots = reinterpret_cast<const uint32_t*>(data + slots_offset);
+	return index;
+}
+
+bool
+lib_pac::pac_index::write(const std::wstring& archive)
+{
+	const auto file = archive_file::open(archive);
+	if (!file)
+		return false;
+	const auto parsed = parse(*file);
+	if (!parsed)
+		return false;
+
+	const pac_index& index = *parsed;
+	const uint32_t n_entries = static_cast<uint32_t>(index.size());
+
+	// Entries are independent, their tables are read and checksummed on the pool
+	std::vector<std::vector<block>> entry_blocks(n_entries);
+	thread_pool& pool = thread_pool::instance();
+	pool.parallel_for(n_entries, pool.size() + 1, 16, [&](uint32_t i)
+	{
+		const entry& current = index.at(i);
+		if (!current.compressed)
+			return;
+
+		pac_file_source source(file, current.data_offset, current.compressed_size, current.raw_size, true);
+		const auto table = compressor::read_block_table(source);
+		if (!table)
+			return;
+
+		const char* view = source.data_view();
+		std::vector<char> buffer;
+		for (size_t b = 0; b < table->compressed_sizes.size(); ++b)
+		{
+			const uint32_t offset = table->header_size + table->data_offsets[b];
+			const uint32_t size = table->compressed_sizes[b];
+
+			const char* data = view ? view + offset : nullptr;
+			if (!data)
+			{
+				buffer.resize(size);
+				source.copy_data(buffer.data(), offset, size);
+				data = buffer.data();
+			}
+
+			const uint32_t raw_size = table->output_offsets[b + 1] - table->output_offsets[b];
+			const uint32_t checksum = block_checksum(reinterpret_cast<const uint8_t*>(data), size);
+			entry_blocks[i].push_back({ raw_size, size, table->data_offsets[b], checksum });
+		}
+	});
+
+	return write_sidecar(archive, std::vector<entry>(index.m_entries, index.m_entries + n_entries), index.m_name_data,
+	                     entry_blocks);
+}
+
+bool
+lib_pac::pac_index::write(const std::wstring& archive, std::vector<saved_entry> saved)
+{
+	std::sort(saved.begin(), saved.end(), [](const saved_entry& a, const saved_entry& b)
+	{
+		return strcmp(a.name.c_str(), b.name.c_str()) < 0;
+	});
+
+	std::vector<entry> entries;
+	std::vector<char> names;
+	std::vector<std::vector<block>> entry_blocks;
+	entries.reserve(saved.size());
+	entry_blocks.reserve(saved.size());
+	for (saved_entry& current : saved)
+	{
+		current.info.name_offset = static_cast<uint32_t>(names.size());
+		entries.push_back(current.info);
+		names.insert(names.end(), current.name.begin(), current.name.end());
+		names.push_back('\0');
+		entry_blocks.push_back(std::move(current.blocks));
+	}
+	return write_sidecar(archive, std::move(entries), names, entry_blocks);
+}
+
+std::vector<lib_pac::pac_index::block>
+lib_pac::pac_index::entry_blocks(const char* data, size_t size)
+{
+	const auto table = compressor::read_block_table(data, size);
+	if (!table)
+		return std::vector<block>();
+
+	std::vector<block> blocks;
+	blocks.reserve(table->compressed_sizes.size());
+	for (size_t b = 0; b < table->compressed_sizes.size(); ++b)
+	{
+		const uint8_t* block_data = reinterpret_cast<const uint8_t*>(data) + table->header_size + table->data_offsets[b];
+		const uint32_t raw_size = table->output_offsets[b + 1] - table->output_offsets[b];
+		blocks.push_back({ raw_size, table->compressed_sizes[b], table->data_offsets[b],
+		                   block_checksum(block_data, table->compressed_sizes[b]) });
+	}
+	return blocks;
+}
+
+std::vector<lib_pac::pac_index::block>
+lib_pac::pac_index::entry_blocks(const block_table& table)
+{
+	std::vector<block> blocks;
+	blocks.reserve(table.compressed_sizes.size());
+	for (size_t b = 0; b < table.compressed_sizes.size(); ++b)
+	{
+		const uint32_t raw_size = table.output_offsets[b + 1] - table.output_offsets[b];
+		blocks.push_back({ raw_size, table.compressed_sizes[b], table.data_offsets[b], table.checksums[b] });
+	}
+	return blocks;
+}
+
+bool
+lib_pac::pac_index::write_sidecar(const std::wstring& archive, std::vector<entry> entries,
+                                  const std::vector<char>& names, const std::vector<std::vector<block>>& entry_blocks)
+{
+	const uint32_t n_entries = static_cast<uint32_t>(entries.size());
+
+	std::vector<block> blocks;
+	for (uint32_t i = 0; i < n_entries; ++i)
+	{
+		entries[i].first_block = static_cast<uint32_t>(blocks.size());
+		entries[i].block_count = static_cast<uint32_t>(entry_blocks[i].size());
+		blocks.insert(blocks.end(), entry_blocks[i].begin(), entry_blocks[i].end());
+	}
+
+	// Hash and displace: names are split into buckets, then the fullest buckets first each get the first seed
+	// that sends all of their names to slots nobody holds yet
+	const uint32_t bucket_count = std::max((n_entries + BUCKET_LOAD - 1) / BUCKET_LOAD, 1u);
+	std::vector<std::vector<uint32_t>> buckets(bucket_count);
+	for (uint32_t i = 0; i < n_entries; ++i)
+	{
+		const char* name = &names[entries[i].name_offset];
+		buckets[name_hash(name, strlen(name), 0) % bucket_count].push_back(i);
+	}
+
+	std::vector<uint32_t> order(bucket_count);
+	for (uint32_t b = 0; b < bucket_count; ++b)
+		order[b] = b;
+	std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b)
+	{
+		return buckets[a].size() > buckets[b].size();
+	});
+
+	std::vector<uint32_t> seeds(bucket_count, 0);
+	std::vector<uint32_t> slots(n_entries, 0);
+	std::vector<bool> taken(n_entries, false);
+	std::vector<uint32_t> candidates;
+	for (const uint32_t b : order)
+	{
+		const std::vector<uint32_t>& bucket = buckets[b];
+		if (bucket.empty())
+			break;
+
+		uint32_t seed = 1;
+		for (;; ++seed)
+		{
+			if (seed == MAX_SEED)
+				return false;
+
+			candidates.clear();
+			for (const uint32_t i : bucket)
+			{
+				const char* name = &names[entries[i].name_offset];
+				const uint32_t slot = static_cast<uint32_t>(name_hash(name, strlen(name), seed) % n_entries);
+				if (taken[slot] || std::find(candidates.begin(), candidates.end(), slot) != candidates.end())
+					break;
+				candidates.push_back(slot);
+			}
+			if (candidates.size() == bucket.size())
+				break;
+		}
+
+		seeds[b] = seed;
+		for (size_t j = 0; j < bucket.size(); ++j)
+		{
+			taken[candidates[j]] = true;
+			slots[candidates[j]] = bucket[j];
+		}
+	}
+
+	// The archive's size and mtime tie the sidecar to it, both come from the file system
+	std::error_code error;
+	sidecar_header header;
+	std::memcpy(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+	header.version = SIDECAR_VERSION;
+	header.entry_count = n_entries;
+	header.archive_size = fs::file_size(archive, error);
+	if (error || !archive_time(archive, header.archive_time))
+		return false;
+	header.bucket_count = bucket_count;
+	header.block_count = static_cast<uint32_t>(blocks.size());
+	header.names_size = static_cast<uint32_t>(names.size());
+	header.reserved = 0;
+
+	const std::wstring path = sidecar_path(archive);
+	std::ofstream output(path, std::ios::binary | std::ios::trunc);
+	output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	output.write(reinterpret_cast<const char*>(seeds.data()), sizeof(uint32_t) * seeds.size());
+	output.write(reinterpret_cast<const char*>(slots.data()), sizeof(uint32_t) * slots.size());
+	output.write(reinterpret_cast<const char*>(entries.data()), sizeof(entry) * entries.size());
+	output.write(reinterpret_cast<const char*>(blocks.data()), sizeof(block) * blocks.size());
+	output.write(names.data(), names.size());
+	return static_cast<bool>(output.flush());
+}
+
+size_t
+lib_pac::pac_index::size() const
+{
+	return m_size;
+}
+
+const lib_pac::pac_index::entry&
+lib_pac::pac_index::at(size_t index) const
+{
+	return m_entries[index];
+}
+
+const char*
+lib_pac::pac_index::name(size_t index) const
+{
+	// A bad offset from a sidecar reads as the empty name the names end with
+	return m_names + std::min<size_t>(m_entries[index].name_offset, m_names_size - 1);
+}
+
+size_t
+lib_pac::pac_index::find(const std::string& file) const
+{
+	if (!m_size)
+		return 0;
+
+	if (m_seeds)
+	{
+		const uint32_t bucket = static_cast<uint32_t>(name_hash(file.data(), file.size(), 0) % m_bucket_count);
+		const uint32_t slot = static_cast<uint32_t>(name_hash(file.data(), file.size(), m_seeds[bucket]) % m_size);
+		const uint32_t index = m_slots[slot];
+		return index < m_size && file == name(index) ? index : m_size;
+	}
+
+	const entry* found = std::lower_bound(m_entries, m_entries + m_size, file,
+	                                      [this](const entry& current, const std::string& file_name)
+	                                      {
+		                                      return strcmp(m_names + current.name_offset, file_name.c_str()) < 0;
+	                                      });
+	const size_t index = found - m_entries;
+	return index < m_size && file == name(index) ? index : m_size;
+}
+
+std::shared_ptr<const lib_pac::block_table>
+lib_pac::pac_index::blocks(size_t index) const
+{
+	const entry& current = m_entries[index];
+	if (!current.compressed || !current.block_count ||
+		uint64_t(current.first_block) + current.block_count > m_block_count)
+		return nullptr;
+
+	// Sidecar contents aren't trusted, every block has to lie inside the entry like read_block_table checks
+	const uint64_t header_size = 16 + 12 * uint64_t(current.block_count);
+	if (header_size > current.compressed_size)
+		return nullptr;
+
+	auto table = std::make_shared<block_table>();
+	table->header_size = static_cast<uint32_t>(header_size);
+	table->output_offsets.reserve(current.block_count + 1);
+	table->compressed_sizes.reserve(current.block_count);
+	table->data_offsets.reserve(current.block_count);
+	table->checksums.reserve(current.block_count);
+
+	uint64_t output_offset = 0;
+	for (uint32_t b = 0; b < current.block_count; ++b)
+	{
+		const block& info = m_blocks[current.first_block + b];
+		if (header_size + info.data_offset + info.compressed_size > current.compressed_size)
+			return nullptr;
+
+		table->output_offsets.push_back(static_cast<uint32_t>(output_offset));
+		table->compressed_sizes.push_back(info.compressed_size);
+		table->data_offsets.push_back(info.data_offset);
+		table->checksums.push_back(info.checksum);
+		output_offset += info.raw_size;
+	}
+
+	if (output_offset != current.raw_size)
+		return nullptr;
+	table->output_offsets.push_back(static_cast<uint32_t>(output_offset));
+	return table;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "defines.h"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lib_pac
+{
+	class archive_file;
+	struct block_table;
+
+	// Directory of an archive file, sorted by name and never changed once built. Parsed from the archive's
+	// header, or mapped from the .pacidx sidecar saved next to it. The sidecar also holds a minimal perfect hash
+	// of the names, and the block table and block checksums of every compressed entry.
+	class pac_index
+	{
+	public:
+		// Layout shared with the sidecar
+		struct entry
+		{
+			uint32_t name_offset;
+			uint32_t data_offset;
+			uint32_t compressed_size;
+			uint32_t raw_size;
+			uint32_t compressed;
+			// Range of the entry's blocks, empty when it has none or the index was parsed
+			uint32_t first_block;
+			uint32_t block_count;
+		};
+
+		struct block
+		{
+			uint32_t raw_size;
+			uint32_t compressed_size;
+			// Relative to the end of the entry's 0x1234 header
+			uint32_t data_offset;
+			// CRC-32C of the compressed bytes
+			uint32_t checksum;
+		};
+
+	private:
+		// Keeps a mapped sidecar alive, the tables below point into it then
+		std::shared_ptr<archive_file> m_sidecar;
+
+		std::vector<entry> m_entry_data;
+		std::vector<char> m_name_data;
+
+		const entry* m_entries;
+		size_t m_size;
+		const char* m_names;
+		size_t m_names_size;
+		const block* m_blocks;
+		size_t m_block_count;
+
+		// Hash and displace tables, a bucket's seed sends each of its names to its own slot
+		const uint32_t* m_seeds;
+		uint32_t m_bucket_count;
+		const uint32_t* m_slots;
+
+		// Writes the sidecar of archive for entries sorted by name, with the blocks of each entry
+		static bool write_sidecar(const std::wstring& archive, std::vector<entry> entries, const std::vector<char>& names,
+		                          const std::vector<std::vector<block>>& entry_blocks);
+
+	public:
+		pac_index();
+		pac_index(const pac_index&) = delete;
+		pac_index& operator=(const pac_index&) = delete;
+
+		// Null when the archive's header or directory is invalid
+		static std::shared_ptr<const pac_index> parse(const archive_file& file);
+
+		// Null when the sidecar is missing, malformed or was written for another size or mtime of the archive
+		static std::shared_ptr<const pac_index> load(const std::wstring& archive, const archive_file& file);
+
+		// Writes the sidecar of a saved archive, false when the archive can't be read or the sidecar written
+		static bool write(const std::wstring& archive);
+
+		// An entry of an archive being saved. data_offset is from the start of the archive, the name offset and
+		// block range are filled in when the sidecar is written.
+		struct saved_entry
+		{
+			std::string name;
+			entry info;
+			std::vector<block> blocks;
+		};
+
+		// Writes the sidecar from what saving the archive produced, without reading the archive back
+		static bool write(const std::wstring& archive, std::vector<saved_entry> entries);
+		// The blocks of a compressed entry's data, empty when it doesn't hold a valid block table
+		static std::vector<block> entry_blocks(const char* data, size_t size);
+		// The blocks of a table whose checksums are filled in
+		static std::vector<block> entry_blocks(const block_table& table);
+
+		static std::wstring sidecar_path(const std::wstring& archive);
+
+		size_t size() const;
+		const entry& at(size_t index) const;
+		const char* name(size_t index) const;
+
+		// Index of the entry named file, size() when there is none
+		size_t find(const std::string& file) const;
+
+		// Block table of a compressed entry when the sidecar holds a valid one, null otherwise
+		std::shared_ptr<const block_table> blocks(size_t index) const;
+	};
+}
@@ -0,0 +1,87 @@
+#include "parallelencode.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include <cstring>
+#include <vector>
+
+
+static size_t
+segment_bits(const uint8_t* src, size_t size, const lib_pac::bit_lookup& lookup)
+{
+	uint32_t counts[0x100];
+	lib_pac::byte_histogram(src, size, counts);
+
+	size_t bits = 0;
+	for (int value = 0; value < 0x100; ++value)
+		bits += static_cast<size_t>(counts[value]) * lookup.entries[value].lenght;
+	return bits;
+}
+
+static void
+segment_encode(uint8_t* dst, size_t start_bit, const uint8_t* src, size_t size, const lib_pac::bit_lookup& lookup)
+{
+	lib_pac::bit_writer writer(dst);
+	writer.seek(start_bit / 8, start_bit % 8);
+	lib_pac::kernels().encode(writer, src, size, lookup);
+}
+
+size_t
+lib_pac::encode_parallel(uint8_t* dst, size_t data_bit, const uint8_t* src, size_t src_size, const bit_lookup& lookup,
+                         uint32_t n_segments)
+{
+	const size_t segment_size = src_size / n_segments;
+	const auto segment_offset = [&](uint32_t i) { return i * segment_size; };
+	const auto segment_length = [&](uint32_t i) { return i + 1 < n_segments ? segment_size : src_size - i * segment_size; };
+
+	thread_pool& pool = thread_pool::instance();
+
+	std::vector<size_t> counts(n_segments);
+	pool.parallel_for(n_segments, n_segments, 1, [&](uint32_t i)
+	{
+		counts[i] = segment_bits(src + segment_offset(i), segment_length(i), lookup);
+	});
+
+	std::vector<size_t> start(n_segments + 1);
+	start[0] = data_bit;
+	for (uint32_t i = 0; i < n_segments; ++i)
+		start[i + 1] = start[i] + counts[i];
+
+	// The first segment goes straight to dst, the others to buffers at the same bit phase,
+	// so no two threads ever touch the byte where their segments meet
+	std::vector<std::vector<uint8_t>> buffers(n_segments);
+	for (uint32_t i = 1; i < n_segments; ++i)
+		buffers[i].resize((start[i] % 8 + start[i + 1] - start[i] + 7) / 8);
+
+	pool.parallel_for(n_segments, n_segments, 1, [&](uint32_t i)
+	{
+		if (i == 0)
+			segment_encode(dst, data_bit, src, segment_length(0), lookup);
+		else
+			segment_encode(buffers[i].data(), start[i] % 8, src + segment_offset(i), segment_length(i), lookup);
+	});
+
+	for (uint32_t i = 1; i < n_segments; ++i)
+	{
+		if (start[i + 1] == start[i])
+			continue;
+
+		// Only the segment's own bits of its first and last byte are replaced
+		const uint8_t* buffer = buffers[i].data();
+		const size_t first = start[i] / 8;
+		const size_t last = (start[i + 1] - 1) / 8;
+
+		uint8_t first_mask = 0xFF >> (start[i] % 8);
+		const uint8_t last_mask = start[i + 1] % 8 ? 0xFF << (8 - start[i + 1] % 8) : 0xFF;
+		if (first == last)
+			first_mask &= last_mask;
+
+		dst[first] = (dst[first] & ~first_mask) | (buffer[0] & first_mask);
+		if (last > first)
+		{
+			std::memcpy(dst + first + 1, buffer + 1, last - first - 1);
+			dst[last] = (dst[last] & ~last_mask) | (buffer[last - first] & last_mask);
+		}
+	}
+
+	return start[n_segments];
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "defines.h"
+
+#include <stdint.h>
+#include <cstddef>
+
+#include "huffman.h"
+
+namespace lib_pac
+{
+	// Encodes src over n_segments threads, starting data_bit bits into dst. Code lengths are known
+	// up front, so a prefix sum of each segment's size gives every segment its starting bit.
+	// The output is identical to a serial encode. Returns the bit just past the encoded data.
+	size_t encode_parallel(uint8_t* dst, size_t data_bit, const uint8_t* src, size_t src_size, const bit_lookup& lookup,
+	                     uint32_t n_segments);
+}
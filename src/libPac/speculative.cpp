@@ -0,0 +1,146 @@
+#include "speculative.h"
+#include "kernels.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Code boundaries kept per segment to find where the previous segment joins it
+static const size_t SYNC_WINDOW = 1024;
+
+struct segment
+{
+	size_t begin;
+	size_t end;
+
+	uint8_t* out;
+	size_t capacity;
+	size_t count;
+
+	// Bit position before each of the first SYNC_WINDOW symbols
+	std::vector<size_t> boundaries;
+	// Bit position after the last symbol
+	size_t stop;
+};
+
+static inline uint32_t
+decode_symbol(lib_pac::bit_reader& reader, const lib_pac::bit_decoder& decoder, uint32_t primary_shift, uint8_t* value)
+{
+	const uint32_t code = reader.peek(decoder.max_length);
+
+	const lib_pac::bit_decoder::entry* entry = &decoder.primary[code >> primary_shift];
+	if (entry->sub_bits)
+	{
+		const uint32_t sub_shift = primary_shift - entry->sub_bits;
+		const uint32_t sub_mask = (1 << entry->sub_bits) - 1;
+		entry = &decoder.secondary[entry->value + ((code >> sub_shift) & sub_mask)];
+	}
+
+	*value = static_cast<uint8_t>(entry->value);
+	reader.consume(entry->length);
+	return entry->length;
+}
+
+static void
+decode_segment(segment& seg, const uint8_t* src, size_t src_size, const lib_pac::bit_decoder& decoder)
+{
+	const uint32_t primary_shift = decoder.max_length - decoder.primary_bits;
+
+	lib_pac::bit_reader reader(src, src_size);
+	reader.seek(seg.begin / 8, seg.begin % 8);
+
+	// The last symbol may run past the end, the next segment's guess is checked against where it stops
+	size_t position = seg.begin;
+	size_t count = 0;
+	while (position < seg.end && count < seg.capacity)
+	{
+		if (count < SYNC_WINDOW)
+			seg.boundaries.push_back(position);
+		position += decode_symbol(reader, decoder, primary_shift, seg.out + count);
+		count++;
+	}
+
+	seg.count = count;
+	seg.stop = position;
+}
+
+void
+lib_pac::decode_speculative(uint8_t* dst, size_t dst_size, const uint8_t* src, size_t src_size, size_t tree_bits,
+                            const bit_decoder& decoder, uint32_t n_segments)
+{
+	const size_t data_bits = src_size * 8 - tree_bits;
+	const size_t segment_bits = data_bits / n_segments;
+
+	// No segment can hold more symbols than its bits allow with the shortest code
+	uint32_t min_length = decoder.max_length;
+	for (uint32_t i = 0; i < (1u << decoder.primary_bits); ++i)
+	{
+		if (decoder.primary[i].length)
+			min_length = std::min<uint32_t>(min_length, decoder.primary[i].length);
+	}
+	const size_t segment_capacity = std::min(dst_size, segment_bits / min_length + 1);
+
+	std::vector<segment> segments(n_segments);
+	std::vector<uint8_t> buffer(segment_capacity * (n_segments - 1));
+	for (uint32_t i = 0; i < n_segments; ++i)
+	{
+		segment& seg = segments[i];
+		seg.begin = tree_bits + i * segment_bits;
+		seg.end = i + 1 < n_segments ? seg.begin + segment_bits : src_size * 8;
+
+		// The first segment starts in the right place, it goes straight to the output
+		seg.out = i ? buffer.data() + (i - 1) * segment_capacity : dst;
+		seg.capacity = i ? segment_capacity : dst_size;
+	}
+
+	thread_pool::instance().parallel_for(n_segments, n_segments, 1, [&](uint32_t i)
+	{
+		decode_segment(segments[i], src, src_size, decoder);
+	});
+
+	// Join the segments in order, each one is valid from the first boundary the real stream passes through
+	const uint32_t primary_shift = decoder.max_length - decoder.primary_bits;
+	bit_reader reader(src, src_size);
+	size_t written = std::min(segments[0].count, dst_size);
+	size_t position = segments[0].stop;
+
+	for (uint32_t i = 1; i < n_segments && written < dst_size; ++i)
+	{
+		const segment& seg = segments[i];
+		auto boundary = std::lower_bound(seg.boundaries.begin(), seg.boundaries.end(), position);
+
+		// Out of step so far, decode serially until the real stream lands on one of its boundaries
+		reader.seek(position / 8, position % 8);
+		while (boundary != seg.boundaries.end() && *boundary != position && written < dst_size)
+		{
+			position += decode_symbol(reader, decoder, primary_shift, dst + written);
+			written++;
+			while (boundary != seg.boundaries.end() && *boundary < position)
+				++boundary;
+		}
+
+		if (boundary != seg.boundaries.end() && *boundary == position)
+		{
+			const size_t first = boundary - seg.boundaries.begin();
+			const size_t count = std::min(seg.count - first, dst_size - written);
+			std::memcpy(dst + written, seg.out + first, count);
+			written += count;
+			position = seg.stop;
+			continue;
+		}
+
+		// Never lined up, the rest of the segment is decoded serially too
+		while (position < seg.end && written < dst_size)
+		{
+			position += decode_symbol(reader, decoder, primary_shift, dst + written);
+			written++;
+		}
+	}
+
+	// Only reached when the segments run out before the output does
+	if (written < dst_size)
+	{
+		reader.seek(position / 8, position % 8);
+		kernels().decode(dst + written, dst_size - written, reader, decoder);
+	}
+}
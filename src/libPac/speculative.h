@@ -0,0 +1,17 @@
+#pragma once
+#include "defines.h"
+
+#include <stdint.h>
+#include <cstddef>
+
+#include "huffman.h"
+
+namespace lib_pac
+{
+	// Decodes the data of one block over n_segments threads. Every segment but the first starts at a
+	// guessed bit offset, Huffman codes usually fall back in step within a few symbols, and the joins
+	// are confirmed afterwards. Stretches that never line up are decoded again serially.
+	// tree_bits is where the data starts, decoder must have codes of at least one bit.
+	void decode_speculative(uint8_t* dst, size_t dst_size, const uint8_t* src, size_t src_size, size_t tree_bits,
+	                        const bit_decoder& decoder, uint32_t n_segments);
+}
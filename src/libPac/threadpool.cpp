@@ -0,0 +1,193 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <exception>
+
+std::atomic<uint32_t> lib_pac::thread_pool::s_requested_size(0);
+
+// Pool and queue index of the worker running on this thread, null outside the pool
+static thread_local lib_pac::thread_pool* t_pool = nullptr;
+static thread_local uint32_t t_index = 0;
+
+lib_pac::thread_pool::thread_pool(uint32_t size)
+	: m_queued(0)
+{
+	for (uint32_t i = 0; i <= size; ++i)
+		m_queues.push_back(std::make_unique<task_queue>());
+
+	for (uint32_t i = 0; i < size; ++i)
+		m_threads.emplace_back(&thread_pool::work, this, i);
+}
+
+uint32_t
+lib_pac::thread_pool::size() const
+{
+	return static_cast<uint32_t>(m_threads.size());
+}
+
+void
+lib_pac::thread_pool::push(task t)
+{
+	// Workers keep what they spawn, nested steps stay close to the data their parent touched
+	task_queue& queue = t_pool == this ? *m_queues[t_index] : *m_queues.back();
+
+	// Counted first so the count never drops below the queued tasks
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_queued;
+	}
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(std::move(t));
+	}
+	m_wake.notify_one();
+}
+
+bool
+lib_pac::thread_pool::pop(task& t)
+{
+	const uint32_t n_queues = static_cast<uint32_t>(m_queues.size());
+	const uint32_t own = t_pool == this ? t_index : n_queues - 1;
+
+	// Newest task of our own queue first, then the oldest of every other one
+	for (uint32_t i = 0; i < n_queues; ++i)
+	{
+		task_queue& queue = *m_queues[(own + i) % n_queues];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+			continue;
+
+		if (i == 0)
+		{
+			t = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else
+		{
+			t = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		--m_queued;
+		return true;
+	}
+	return false;
+}
+
+bool
+lib_pac::thread_pool::run_one()
+{
+	task t;
+	if (!pop(t))
+		return false;
+	t();
+	return true;
+}
+
+void
+lib_pac::thread_pool::work(uint32_t index)
+{
+	t_pool = this;
+	t_index = index;
+
+	// The pool lives until the process exits, workers never stop
+	for (;;)
+	{
+		if (run_one())
+			continue;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wake.wait(lock, [this]() { return m_queued != 0; });
+	}
+}
+
+void
+lib_pac::thread_pool::notify_done()
+{
+	// Taking the lock orders the completion before any waiter's next check
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+	}
+	m_wake.notify_all();
+}
+
+void
+lib_pac::thread_pool::wait_until(const std::function<bool()>& done)
+{
+	while (!done())
+	{
+		if (run_one())
+			continue;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wake.wait(lock, [&]() { return m_queued != 0 || done(); });
+	}
+}
+
+void
+lib_pac::thread_pool::parallel_for(uint32_t count, uint32_t max_parallel, uint32_t grain,
+                                   const std::function<void(uint32_t)>& body)
+{
+	if (!count)
+		return;
+
+	grain = std::max(grain, 1u);
+	const uint32_t n_chunks = (count - 1) / grain + 1;
+	const uint32_t n_helpers = std::min({ std::max(max_parallel, 1u), n_chunks, size() + 1 }) - 1;
+
+	std::atomic<uint32_t> next_chunk(0);
+	std::atomic<uint32_t> running(n_helpers);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+
+	// Every thread takes chunks until none are left, so uneven blocks still balance
+	const auto run = [&]()
+	{
+		try
+		{
+			for (uint32_t chunk = next_chunk++; chunk < n_chunks; chunk = next_chunk++)
+			{
+				const uint32_t end = std::min(count, (chunk + 1) * grain);
+				for (uint32_t i = chunk * grain; i < end; ++i)
+					body(i);
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(error_mutex);
+			if (!error)
+				error = std::current_exception();
+			next_chunk = n_chunks;
+		}
+	};
+
+	for (uint32_t i = 0; i < n_helpers; ++i)
+	{
+		push([&]()
+		{
+			run();
+			--running;
+			notify_done();
+		});
+	}
+
+	run();
+	wait_until([&]() { return running == 0; });
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void
+lib_pac::thread_pool::set_size(uint32_t size)
+{
+	s_requested_size = size;
+}
+
+lib_pac::thread_pool&
+lib_pac::thread_pool::instance()
+{
+	// Never destroyed, joining workers from static destructors can hang while a DLL unloads
+	static thread_pool* pool = new thread_pool(s_requested_size ? s_requested_size.load()
+	                                                            : std::max(std::thread::hardware_concurrency(), 1u));
+	return *pool;
+}
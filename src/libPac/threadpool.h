@@ -0,0 +1,105 @@
+#pragma once
+#include "defines.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lib_pac
+{
+	// Workers shared by every parallel step of the library, created once on first use. Each worker has its own
+	// queue and steals from the others when it runs dry. Threads waiting on pool work run queued tasks meanwhile,
+	// so steps nested in pool tasks can't deadlock it.
+	class thread_pool
+	{
+	private:
+		typedef std::function<void()> task;
+
+		struct task_queue
+		{
+			std::mutex mutex;
+			std::deque<task> tasks;
+		};
+
+		// One queue per worker, then one for tasks pushed from outside the pool
+		std::vector<std::unique_ptr<task_queue>> m_queues;
+		std::vector<std::thread> m_threads;
+
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::atomic<uint32_t> m_queued;
+
+		static std::atomic<uint32_t> s_requested_size;
+
+		explicit thread_pool(uint32_t size);
+
+		void push(task t);
+		bool pop(task& t);
+		void work(uint32_t index);
+		void notify_done();
+
+	public:
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+
+		uint32_t size() const;
+
+		// Runs a queued task on the calling thread, false when every queue is empty
+		bool run_one();
+
+		// Runs body(i) for every i below count, grain indices per task, on at most max_parallel threads
+		// counting the caller. Returns once all are done, rethrowing the first exception a call threw.
+		void parallel_for(uint32_t count, uint32_t max_parallel, uint32_t grain, const std::function<void(uint32_t)>& body);
+
+		template <typename F>
+		std::future<typename std::result_of<F()>::type> submit(F&& f);
+
+		// Blocks until done returns true, running queued tasks meanwhile. done is checked again whenever a
+		// pool task finishes.
+		void wait_until(const std::function<bool()>& done);
+
+		// Blocks until the future is ready, running queued tasks meanwhile
+		template <typename T>
+		T get(std::future<T>& future);
+
+		// Takes effect if called before the pool is first used, 0 sizes it from hardware_concurrency
+		static void set_size(uint32_t size);
+		static thread_pool& instance();
+	};
+
+	template <typename F>
+	std::future<typename std::result_of<F()>::type>
+	thread_pool::submit(F&& f)
+	{
+		typedef typename std::result_of<F()>::type result;
+
+		// std::function needs a copyable target, the packaged task is shared
+		auto packaged = std::make_shared<std::packaged_task<result()>>(std::forward<F>(f));
+		std::future<result> future = packaged->get_future();
+		push([this, packaged]()
+		{
+			(*packaged)();
+			notify_done();
+		});
+		return future;
+	}
+
+	template <typename T>
+	T
+	thread_pool::get(std::future<T>& future)
+	{
+		wait_until([&future]()
+		{
+			return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		});
+		return future.get();
+	}
+}
@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include <archivefile.h>
+#include <compressor.h>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libPac_Test
+{
+	TEST_CLASS(ArchiveFileTests)
+	{
+	public:
+
+		static std::vector<char> write_file(const char* name, size_t size)
+		{
+			std::vector<char> data(size);
+			for (size_t i = 0; i < data.size(); ++i)
+				data[i] = static_cast<char>(i * 13 + i / 251);
+
+			std::ofstream file(name, std::ios::binary | std::ios::trunc);
+			file.write(data.data(), data.size());
+			return data;
+		}
+
+		TEST_METHOD(ArchiveFile_Read)
+		{
+			const std::vector<char> data = write_file("archivefile_read.bin", 0x12345);
+
+			for (const bool map : { true, false })
+			{
+				auto file = lib_pac::archive_file::open(L"archivefile_read.bin", map);
+				Assert::IsTrue(file != nullptr);
+				Assert::AreEqual(file->size(), (uint64_t) data.size());
+				Assert::AreEqual(file->mapped(), map);
+
+				std::vector<char> out(0x1000);
+				Assert::AreEqual(file->read(out.data(), 0x777, 0x1000), (uint32_t) 0x1000);
+				Assert::IsTrue(std::equal(out.begin(), out.end(), data.begin() + 0x777));
+
+				// Reads past the end come back short, views past the end not at all
+				Assert::AreEqual(file->read(out.data(), data.size() - 0x10, 0x1000), (uint32_t) 0x10);
+				Assert::AreEqual(file->read(out.data(), data.size(), 0x1000), (uint32_t) 0);
+				Assert::IsNull(file->view(data.size() - 0x10, 0x11));
+
+				const char* view = file->view(0x100, 0x200);
+				if (map)
+					Assert::IsTrue(std::equal(view, view + 0x200, data.begin() + 0x100));
+				else
+					Assert::IsNull(view);
+			}
+
+			Assert::IsTrue(lib_pac::archive_file::open(L"archivefile_missing.bin") == nullptr);
+			std::remove("archivefile_read.bin");
+		}
+
+		TEST_METHOD(ArchiveFile_ConcurrentReads)
+		{
+			const std::vector<char> data = write_file("archivefile_concurrent.bin", 0x100000);
+
+			for (const bool map : { true, false })
+			{
+				auto file = lib_pac::archive_file::open(L"archivefile_concurrent.bin", map);
+				Assert::IsTrue(file != nullptr);
+
+				// Positioned reads share no file position, every thread sees its own range
+				std::vector<int> mismatches(4, 0);
+				std::vector<std::thread> threads;
+				for (int t = 0; t < 4; ++t)
+				{
+					threads.emplace_back([&, t]()
+					{
+						std::mt19937 engine(t);
+						std::vector<char> out(0x3000);
+						for (int i = 0; i < 200; ++i)
+						{
+							const uint32_t offset = engine() % (data.size() - out.size());
+							file->read(out.data(), offset, static_cast<uint32_t>(out.size()));
+							if (!std::equal(out.begin(), out.end(), data.begin() + offset))
+								mismatches[t]++;
+						}
+					});
+				}
+				for (auto& thread : threads)
+					thread.join();
+
+				for (const int count : mismatches)
+					Assert::AreEqual(count, 0);
+			}
+			std::remove("archivefile_concurrent.bin");
+		}
+
+		TEST_METHOD(ArchiveFile_DecompressView)
+		{
+			std::vector<char> input(0x30000);
+			for (size_t i = 0; i < input.size(); ++i)
+				input[i] = static_cast<char>("mapped archive entry"[i % 20] + i / 0x1000);
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x8000, 0);
+			std::vector<char> comp(cinfo->output_size());
+			comp.resize(lib_pac::compressor::compress(*cinfo, comp.data()));
+
+			// The entry sits behind other data, as it would in an archive
+			{
+				std::ofstream file("archivefile_entry.bin", std::ios::binary | std::ios::trunc);
+				file.write(input.data(), 0x123);
+				file.write(comp.data(), comp.size());
+			}
+
+			auto file = lib_pac::archive_file::open(L"archivefile_entry.bin");
+			Assert::IsTrue(file != nullptr);
+			const char* view = file->view(0x123, comp.size());
+			Assert::IsNotNull(view);
+
+			auto dinfo = lib_pac::compressor::prepare_decompression(view, comp.size());
+			std::vector<char> dec(dinfo->output_size());
+			lib_pac::compressor::decompress(*dinfo, dec.data());
+			Assert::IsTrue(dec == input);
+
+			file = nullptr;
+			std::remove("archivefile_entry.bin");
+		}
+	};
+}
@@ -0,0 +1,84 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include <batch.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libPac_Test
+{
+	TEST_CLASS(BatchTests)
+	{
+	public:
+
+		TEST_METHOD(Batch_LargestFirst)
+		{
+			std::vector<std::string> order;
+			lib_pac::archive_batch batch;
+			for (const auto& job : std::vector<std::pair<std::string, uint64_t>>{
+				     { "small", 10 }, { "large", 1000 }, { "medium", 100 }, { "large too", 1000 }, { "empty", 0 } })
+			{
+				const std::string name = job.first;
+				batch.add(name, job.second, [&order, name, job]()
+				{
+					order.push_back(name);
+					return job.second;
+				});
+			}
+			Assert::AreEqual((uint64_t) batch.size(), (uint64_t) 5);
+
+			// A single runner takes the jobs one by one, equal sizes keep the order they were added in
+			const auto info = batch.run(1);
+			const std::vector<std::string> expected = { "large", "large too", "medium", "small", "empty" };
+			Assert::IsTrue(order == expected);
+			Assert::AreEqual(info.archives, (uint32_t) 5);
+			Assert::AreEqual(info.total_bytes, (uint64_t) 2110);
+			Assert::IsTrue(info.failures.empty());
+
+			// Running hands the jobs over, the batch starts empty again
+			Assert::AreEqual((uint64_t) batch.size(), (uint64_t) 0);
+			Assert::AreEqual(batch.run().archives, (uint32_t) 0);
+		}
+
+		TEST_METHOD(Batch_Failures)
+		{
+			std::mutex mutex;
+			std::vector<std::string> finished;
+			lib_pac::archive_batch batch;
+			for (int i = 0; i < 12; ++i)
+			{
+				const std::string name = "archive " + std::to_string(i);
+				batch.add(name, i, [&, name, i]() -> uint64_t
+				{
+					if (i % 4 == 1)
+						throw std::runtime_error("Cannot Read " + name);
+					if (i % 4 == 3)
+						throw 42;
+
+					std::lock_guard<std::mutex> lock(mutex);
+					finished.push_back(name);
+					return 100;
+				});
+			}
+
+			// Jobs that throw are listed, the others on the same and other runners still go through
+			const auto info = batch.run(3);
+			Assert::AreEqual(info.archives, (uint32_t) 12);
+			Assert::AreEqual((uint64_t) finished.size(), (uint64_t) 6);
+			Assert::AreEqual(info.total_bytes, (uint64_t) 600);
+			Assert::AreEqual((uint64_t) info.failures.size(), (uint64_t) 6);
+
+			for (const auto& failure : info.failures)
+			{
+				const int i = std::stoi(failure.name.substr(8));
+				if (i % 4 == 1)
+					Assert::IsTrue(failure.reason == "Cannot Read " + failure.name);
+				else
+					Assert::IsTrue(i % 4 == 3 && failure.reason == "Unknown Error");
+			}
+		}
+	};
+}
@@ -45,5 +45,34 @@ namespace libPac_Test
 			reader.seek(2, 0);
 			Assert::AreEqual(reader.read_byte(), (uint8_t) 0xFF);
 		}
+
+		TEST_METHOD(BitReader_PeekConsume)
+		{
+			uint8_t data[] = { 0xAC, 0xF0, 0x53, 0x0F, 0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC };
+			lib_pac::bit_reader reader(data, sizeof(data));
+
+			Assert::AreEqual(reader.peek(17), (uint32_t) 0x159E0);
+			Assert::AreEqual(reader.peek(4), (uint32_t) 0xA);
+			reader.consume(17);
+			Assert::AreEqual(reader.peek(15), (uint32_t) 0x530F);
+			reader.consume(15);
+			Assert::AreEqual(reader.peek(32), (uint32_t) 0x12345678);
+			reader.consume(28);
+
+			uint8_t bit;
+			Assert::AreEqual(reader.tell(&bit), (size_t) 7);
+			Assert::AreEqual(bit, (uint8_t) 4);
+		}
+
+		TEST_METHOD(BitReader_ReadPastEnd)
+		{
+			// Bounded readers pad with zeros instead of reading out of range
+			uint8_t data[] = { 0xFF, 0x81 };
+			lib_pac::bit_reader reader(data, sizeof(data));
+
+			Assert::AreEqual(reader.peek(24), (uint32_t) 0xFF8100);
+			reader.consume(12);
+			Assert::AreEqual(reader.read_byte(), (uint8_t) 0x10);
+		}
 	};
 }
\ No newline at end of file
@@ -19,6 +19,7 @@ namespace libPac_Test
 			for(int i = 0; i < sizeof(expected); ++i)
 				writer.write_bits(expected[i], 8);
 
+			writer.flush();
 			for(int i = 0; i < sizeof(expected); ++i)
 				Assert::AreEqual(actual[i], expected[i]);
 		}
@@ -34,6 +35,7 @@ namespace libPac_Test
 			writer.write_bits(0x1E, 6);
 			writer.write_bits(0x05, 6);
 
+			writer.flush();
 			for (int i = 0; i < sizeof(expected); ++i)
 				Assert::AreEqual(actual[i], expected[i]);
 		}
@@ -46,6 +48,7 @@ namespace libPac_Test
 			lib_pac::bit_writer writer(actual);
 			writer.write_bits(0xFF7F6432, 32);
 
+			writer.flush();
 			for (int i = 0; i < sizeof(expected); ++i)
 				Assert::AreEqual(actual[i], expected[i]);
 		}
@@ -59,6 +62,7 @@ namespace libPac_Test
 			writer.write_bits(0x159E0, 17);
 			writer.write_bits(0x530F, 15);
 
+			writer.flush();
 			for (int i = 0; i < sizeof(expected); ++i)
 				Assert::AreEqual(actual[i], expected[i]);
 		}
@@ -89,6 +93,7 @@ namespace libPac_Test
 			writer.write_bit(false);
 			writer.write_bit(false);
 
+			writer.flush();
 			for (int i = 0; i < sizeof(actual); ++i)
 				Assert::AreEqual(actual[i], expected[i]);
 		}
@@ -102,6 +107,7 @@ namespace libPac_Test
 			writer.seek(0, 4);
 			writer.write_bits(0x9A, 8);
 
+			writer.flush();
 			for (int i = 0; i < sizeof(actual); ++i)
 				Assert::AreEqual(actual[i], expected[i]);
 		}
@@ -1,15 +1,40 @@
 #include "stdafx.h"
 #include "CppUnitTest.h"
 #include <compressor.h>
+#include <filesourcebase.h>
 #include <random>
 #include <array>
 #include <functional>
 #include <fstream>
+#include <algorithm>
+#include <future>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
 namespace libPac_Test
 {
+	// Serves compressed data from memory, as an archive entry would from disk
+	class memory_source : public lib_pac::file_source_base
+	{
+	public:
+		const std::vector<char>& data;
+		uint32_t size;
+
+		memory_source(const std::vector<char>& data, uint32_t size = 0) : data(data), size(size)
+		{
+		}
+
+		bool compressed() override { return true; }
+		uint32_t data_size() override { return (uint32_t) data.size(); }
+		uint32_t unpacked_size() override { return size; }
+		std::unique_ptr<file_source_base> get_copy() const override { return nullptr; }
+
+		void copy_data(char* dst, uint32_t offset, uint32_t count) override
+		{
+			std::copy(data.begin() + offset, data.begin() + offset + count, dst);
+		}
+	};
+
 	TEST_CLASS(CompressorTests)
 	{
 	public:
@@ -47,5 +72,537 @@ namespace libPac_Test
 			delete comp;
 			delete dec;
 		}
+
+		TEST_METHOD(Compressor_CycleLongCodes)
+		{
+			// Fibonacci weighted symbols give the deepest tree a block can have,
+			// so this runs through the secondary decode tables and the cursor fallback
+			std::vector<char> input;
+			uint32_t a = 1, b = 1;
+			for (int i = 0; i < 26; i++)
+			{
+				input.insert(input.end(), a, static_cast<char>('A' + i));
+				const uint32_t c = a + b;
+				a = b;
+				b = c;
+			}
+			std::mt19937 eng(1234);
+			std::shuffle(input.begin(), input.end(), eng);
+
+			for (uint32_t max_code_length : { 0u, 12u })
+			for (uint32_t block_size : { 0x2000u, 0x20000u, 0x80000u })
+			{
+				auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), block_size, 0, max_code_length);
+				std::vector<char> comp(cinfo->output_size());
+				lib_pac::compressor::compress(*cinfo, comp.data());
+
+				auto dinfo = lib_pac::compressor::prepare_decompression(comp.data(), comp.size());
+				std::vector<char> dec(dinfo->output_size());
+				lib_pac::compressor::decompress(*dinfo, dec.data());
+
+				Assert::AreEqual(input.size(), dec.size());
+				int rv = std::memcmp(input.data(), dec.data(), dec.size());
+				Assert::AreEqual(rv, 0);
+			}
+		}
+
+		TEST_METHOD(Compressor_DecoderCache)
+		{
+			// Every block holds the same bytes, so all of them carry the same tree
+			std::vector<char> input(0x2000 * 16);
+			for (size_t i = 0; i < input.size(); ++i)
+				input[i] = static_cast<char>("libPac decoder cache"[i % 0x2000 % 20]);
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x2000, 0);
+			std::vector<char> comp(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, comp.data());
+
+			// The capacity is global, other tests run with whatever it was before
+			const size_t previous = lib_pac::compressor::cache_capacity();
+			Assert::AreEqual(previous, (size_t) 0);
+
+			for (size_t capacity : { (size_t) 0, (size_t) 4 })
+			{
+				lib_pac::compressor::set_cache_capacity(capacity);
+				lib_pac::compressor::reset_cache_stats();
+
+				auto dinfo = lib_pac::compressor::prepare_decompression(comp.data(), comp.size());
+				std::vector<char> dec(dinfo->output_size());
+				lib_pac::compressor::decompress(*dinfo, dec.data(), 1);
+				Assert::IsTrue(dec == input);
+
+				const lib_pac::decoder_cache_stats stats = lib_pac::compressor::cache_stats();
+				Assert::AreEqual(stats.hits, (uint64_t) (capacity ? 15 : 0));
+			}
+			lib_pac::compressor::set_cache_capacity(previous);
+		}
+
+		TEST_METHOD(Compressor_SpeculativeDecode)
+		{
+			// One block holding everything, decoded as several segments
+			std::vector<char> input(0x200000);
+			std::mt19937 eng(4321);
+			std::geometric_distribution<int> dist(0.05);
+			for (char& c : input)
+				c = static_cast<char>(dist(eng));
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), input.size(), 0);
+			std::vector<char> comp(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, comp.data());
+
+			auto dinfo = lib_pac::compressor::prepare_decompression(comp.data(), comp.size());
+			for (uint32_t segment_size : { 0x100u, 0x4000u })
+			{
+				std::vector<char> dec(dinfo->output_size());
+				lib_pac::compressor::decompress(*dinfo, dec.data(), 8, segment_size);
+				Assert::IsTrue(dec == input);
+			}
+		}
+
+		TEST_METHOD(Compressor_SpeculativeDecodeBlocks)
+		{
+			// Blocks with trees of their own, a thread waiting on its segments decodes other blocks meanwhile
+			std::vector<char> input(0x40000 * 16);
+			std::mt19937 eng(8765);
+			for (size_t block = 0; block < 16; ++block)
+			{
+				std::geometric_distribution<int> dist(0.02 + block * 0.03);
+				for (size_t i = 0; i < 0x40000; ++i)
+					input[block * 0x40000 + i] = static_cast<char>(dist(eng) + block);
+			}
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x40000, 0);
+			std::vector<char> comp(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, comp.data());
+
+			const size_t previous = lib_pac::compressor::cache_capacity();
+			lib_pac::compressor::set_cache_capacity(0);
+			auto dinfo = lib_pac::compressor::prepare_decompression(comp.data(), comp.size());
+			for (int run = 0; run < 4; ++run)
+			{
+				std::vector<char> dec(dinfo->output_size());
+				Assert::IsTrue(lib_pac::compressor::decompress(*dinfo, dec.data(), 8, 0x2000));
+				Assert::IsTrue(dec == input);
+			}
+			lib_pac::compressor::set_cache_capacity(previous);
+		}
+
+		TEST_METHOD(Compressor_SegmentedEncode)
+		{
+			// A single thread encodes serially, more threads split the block into segments
+			std::vector<char> input(0x180001);
+			std::mt19937 eng(5678);
+			std::geometric_distribution<int> dist(0.1);
+			for (char& c : input)
+				c = static_cast<char>(dist(eng));
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), input.size(), 0);
+			std::vector<char> serial(cinfo->output_size());
+			std::vector<char> segmented(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, serial.data(), 1);
+			lib_pac::compressor::compress(*cinfo, segmented.data(), 8);
+			Assert::IsTrue(serial == segmented);
+
+			auto dinfo = lib_pac::compressor::prepare_decompression(segmented.data(), segmented.size());
+			std::vector<char> dec(dinfo->output_size());
+			lib_pac::compressor::decompress(*dinfo, dec.data());
+			Assert::IsTrue(dec == input);
+		}
+
+		TEST_METHOD(Compressor_ThreadPool)
+		{
+			std::mt19937 eng(2468);
+			std::geometric_distribution<int> dist(0.1);
+			std::vector<char> input(0x240000);
+			for (char& c : input)
+				c = static_cast<char>(dist(eng));
+
+			// Tiny blocks are batched into tasks, huge ones split into segments from inside pool tasks,
+			// and several callers share the pool at once. Every mix matches a single threaded run.
+			auto reference_info = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x200, 1);
+			std::vector<char> reference(reference_info->output_size());
+			lib_pac::compressor::compress(*reference_info, reference.data(), 1);
+
+			const auto cycle = [&input](uint32_t block_size, uint32_t n_threads)
+			{
+				auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), block_size, n_threads);
+				std::vector<char> comp(cinfo->output_size());
+				lib_pac::compressor::compress(*cinfo, comp.data(), n_threads);
+
+				auto dinfo = lib_pac::compressor::prepare_decompression(comp.data(), comp.size());
+				std::vector<char> dec(dinfo->output_size());
+				lib_pac::compressor::decompress(*dinfo, dec.data(), n_threads, 0x20000);
+				return std::make_pair(comp, dec == input);
+			};
+
+			Assert::IsTrue(lib_pac::compressor::thread_count() > 0);
+
+			std::vector<std::future<std::pair<std::vector<char>, bool>>> callers;
+			for (uint32_t n_threads : { 0u, 2u, 16u })
+			{
+				callers.push_back(std::async(std::launch::async, cycle, 0x200, n_threads));
+				callers.push_back(std::async(std::launch::async, cycle, (uint32_t) input.size(), n_threads));
+			}
+
+			for (size_t i = 0; i < callers.size(); ++i)
+			{
+				const auto result = callers[i].get();
+				Assert::IsTrue(result.second);
+				if (i % 2 == 0)
+					Assert::IsTrue(result.first == reference);
+			}
+		}
+
+		TEST_METHOD(Compressor_DegenerateBlocks)
+		{
+			// Constant fill, two symbols, four even symbols and uniform bytes each take their own kernel
+			std::mt19937 eng(2468);
+			const std::function<char(size_t)> generators[] = {
+				[](size_t) { return '\0'; },
+				[&](size_t) { return eng() % 100 < 90 ? 'x' : 'y'; },
+				[&](size_t) { return static_cast<char>('a' + eng() % 4); },
+				[&](size_t i) { return static_cast<char>(i * 7); },
+			};
+			const uint32_t lengths[] = { 0, 1, 2, 8 };
+
+			for (int g = 0; g < 4; ++g)
+			{
+				std::vector<char> input(0x10003);
+				for (size_t i = 0; i < input.size(); ++i)
+					input[i] = generators[g](i);
+
+				lib_pac::huffman_tree tree;
+				tree.create(reinterpret_cast<const uint8_t*>(input.data()), 0x8000);
+				Assert::AreEqual(tree.fixed_length(), lengths[g]);
+
+				auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x8000, 0);
+				std::vector<char> comp(cinfo->output_size());
+				lib_pac::compressor::compress(*cinfo, comp.data());
+
+				auto dinfo = lib_pac::compressor::prepare_decompression(comp.data(), comp.size());
+				std::vector<char> dec(dinfo->output_size());
+				lib_pac::compressor::decompress(*dinfo, dec.data());
+				Assert::IsTrue(dec == input);
+			}
+		}
+
+		TEST_METHOD(Compressor_FastLevel)
+		{
+			// Skewed text with rare bytes the sample is unlikely to catch, they still need codes
+			std::mt19937 eng(1357);
+			std::geometric_distribution<int> dist(0.2);
+			std::vector<char> input(0x123457);
+			for (auto& c : input)
+				c = static_cast<char>('a' + std::min(dist(eng), 25));
+			for (int i = 0; i < 200; ++i)
+				input[eng() % input.size()] = static_cast<char>(0x80 + i % 0x80);
+
+			auto normal = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x20000, 0);
+			const uint32_t normal_size = normal->output_size();
+
+			for (uint32_t block_size : { 0x20000u, 0x100000u })
+			{
+				auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), block_size, 4, 0,
+				                                                      lib_pac::compression_level::fast);
+				std::vector<char> comp(cinfo->output_size());
+				const uint32_t comp_size = lib_pac::compressor::compress(*cinfo, comp.data(), 4);
+				Assert::IsTrue(comp_size <= cinfo->output_size());
+				Assert::IsTrue(comp_size < normal_size * 1.05);
+				comp.resize(comp_size);
+
+				auto dinfo = lib_pac::compressor::prepare_decompression(comp.data(), comp.size());
+				std::vector<char> dec(dinfo->output_size());
+				lib_pac::compressor::decompress(*dinfo, dec.data());
+				Assert::IsTrue(dec == input);
+			}
+		}
+
+		TEST_METHOD(Compressor_ChooseBlockSize)
+		{
+			// Every 16 KiB switches alphabet, small blocks each get a tree fitted to one of them
+			std::mt19937 eng(8642);
+			std::vector<char> input(0x64321);
+			for (size_t i = 0; i < input.size(); ++i)
+				input[i] = static_cast<char>((i / 0x4000 % 2 ? 'a' : 'A') + eng() % 8);
+
+			auto choice = lib_pac::compressor::choose_block_size(input.data(), input.size(), 0x20000, 0x20000);
+			Assert::AreEqual(choice.block_size, (uint32_t) 0x4000);
+			Assert::IsTrue(choice.output_size < choice.reference_output_size);
+
+			// Predictions are exact for the normal level
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), choice.block_size, 0);
+			Assert::AreEqual(cinfo->output_size(), choice.output_size);
+			auto rinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x20000, 0);
+			Assert::AreEqual(rinfo->output_size(), choice.reference_output_size);
+
+			// Trees built from the prediction's counts match the ones built from the data
+			auto reused = lib_pac::compressor::prepare_compression(input.data(), input.size(), choice, 0);
+			Assert::AreEqual(reused->output_size(), choice.output_size);
+			std::vector<char> expected(cinfo->output_size());
+			std::vector<char> actual(reused->output_size());
+			lib_pac::compressor::compress(*cinfo, expected.data());
+			lib_pac::compressor::compress(*reused, actual.data());
+			Assert::IsTrue(actual == expected);
+
+			// Uniform data only pays for trees, the largest blocks allowed win
+			for (size_t i = 0; i < input.size(); ++i)
+				input[i] = static_cast<char>(i * 7);
+			choice = lib_pac::compressor::choose_block_size(input.data(), input.size(), 0x80000, 0x20000);
+			Assert::AreEqual(choice.block_size, (uint32_t) 0x80000);
+			reused = lib_pac::compressor::prepare_compression(input.data(), input.size(), choice, 0);
+			Assert::AreEqual(reused->output_size(), choice.output_size);
+
+			choice = lib_pac::compressor::choose_block_size(input.data(), input.size(), 0x10000, 0x20000);
+			Assert::AreEqual(choice.block_size, (uint32_t) 0x10000);
+		}
+
+		TEST_METHOD(Compressor_Stream)
+		{
+			class vector_sink : public lib_pac::compress_sink
+			{
+			public:
+				std::vector<char> data;
+
+				void write(const char* src, size_t size) override
+				{
+					data.insert(data.end(), src, src + size);
+				}
+
+				void write_at(size_t offset, const char* src, size_t size) override
+				{
+					std::copy(src, src + size, data.begin() + offset);
+				}
+			};
+
+			std::mt19937 eng(9753);
+			std::geometric_distribution<int> dist(0.1);
+			std::vector<char> input(0x234567);
+			for (auto& c : input)
+				c = static_cast<char>(dist(eng));
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x10000, 0);
+			std::vector<char> expected(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, expected.data());
+
+			for (auto level : { lib_pac::compression_level::normal, lib_pac::compression_level::fast })
+			{
+				vector_sink sink;
+				lib_pac::stream_compressor stream(sink, input.size(), 0x10000, 3, 0, level);
+				for (size_t offset = 0; offset < input.size();)
+				{
+					const size_t n = std::min<size_t>(eng() % 0x18000, input.size() - offset);
+					stream.push(input.data() + offset, n);
+					offset += n;
+				}
+				const uint32_t comp_size = stream.finish();
+				Assert::AreEqual(comp_size, (uint32_t) sink.data.size());
+
+				if (level == lib_pac::compression_level::normal)
+					Assert::IsTrue(sink.data == expected);
+
+				auto dinfo = lib_pac::compressor::prepare_decompression(sink.data.data(), sink.data.size());
+				std::vector<char> dec(dinfo->output_size());
+				lib_pac::compressor::decompress(*dinfo, dec.data());
+				Assert::IsTrue(dec == input);
+			}
+		}
+
+		TEST_METHOD(Compressor_StreamDecompress)
+		{
+			class vector_sink : public lib_pac::data_sink
+			{
+			public:
+				std::vector<char> data;
+
+				void write(const char* src, size_t size) override
+				{
+					data.insert(data.end(), src, src + size);
+				}
+			};
+
+			std::mt19937 eng(1122);
+			std::geometric_distribution<int> dist(0.05);
+			std::vector<char> input(0x345678);
+			for (auto& c : input)
+				c = static_cast<char>(dist(eng));
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x8000, 0);
+			std::vector<char> comp(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, comp.data());
+
+			vector_sink from_memory;
+			Assert::IsTrue(lib_pac::compressor::decompress_stream(comp.data(), comp.size(), from_memory, 3));
+			Assert::IsTrue(from_memory.data == input);
+
+			memory_source source(comp);
+			vector_sink from_source;
+			Assert::IsTrue(lib_pac::compressor::decompress_stream(source, from_source, 2));
+			Assert::IsTrue(from_source.data == input);
+
+			// Truncated data fails instead of reading past the end
+			vector_sink truncated;
+			Assert::IsFalse(lib_pac::compressor::decompress_stream(comp.data(), comp.size() / 2, truncated));
+			Assert::IsTrue(truncated.data.size() < input.size());
+		}
+
+		TEST_METHOD(Compressor_ReadRange)
+		{
+			std::mt19937 eng(3344);
+			std::geometric_distribution<int> dist(0.08);
+			std::vector<char> input(0x123456);
+			for (auto& c : input)
+				c = static_cast<char>(dist(eng));
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x10000, 0);
+			std::vector<char> comp(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, comp.data());
+
+			memory_source source(comp, (uint32_t) input.size());
+			const auto table = lib_pac::compressor::read_block_table(source);
+			Assert::IsTrue(table != nullptr);
+			Assert::AreEqual(input.size(), (size_t) table->output_offsets.back());
+
+			// Inside one block, across block edges, whole blocks, and the tail
+			const std::array<std::pair<uint32_t, uint32_t>, 6> ranges = { {
+				{ 0x20000 + 0x1234, 0x1000 }, { 0x1fff0, 0x20 }, { 0x10000, 0x30000 },
+				{ 0, (uint32_t) input.size() }, { (uint32_t) input.size() - 10, 100 }, { 0x5000, 0 }
+			} };
+
+			for (const auto& range : ranges)
+			{
+				const uint32_t expected = std::min<uint32_t>(range.second, (uint32_t) input.size() - range.first);
+				std::vector<char> output(range.second);
+
+				Assert::AreEqual(expected, lib_pac::compressor::read_range(source, *table, output.data(), range.first, range.second));
+				Assert::IsTrue(std::equal(output.begin(), output.begin() + expected, input.begin() + range.first));
+
+				std::fill(output.begin(), output.end(), 0);
+				Assert::AreEqual(expected, source.read_range(output.data(), range.first, range.second));
+				Assert::IsTrue(std::equal(output.begin(), output.begin() + expected, input.begin() + range.first));
+			}
+
+			char byte;
+			Assert::AreEqual(0u, source.read_range(&byte, (uint32_t) input.size(), 1));
+
+			// A table pointing past the data is rejected
+			std::vector<char> truncated(comp.begin(), comp.begin() + comp.size() / 2);
+			memory_source broken(truncated);
+			Assert::IsTrue(lib_pac::compressor::read_block_table(broken) == nullptr);
+			Assert::AreEqual(0u, broken.read_range(&byte, 0, 1));
+		}
+
+		TEST_METHOD(Compressor_CorruptTree)
+		{
+			std::mt19937 eng(5566);
+			std::geometric_distribution<int> dist(0.1);
+			std::vector<char> input(0x2000 * 8);
+			for (auto& c : input)
+				c = static_cast<char>(dist(eng));
+
+			auto cinfo = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x2000, 0);
+			std::vector<char> comp(cinfo->output_size());
+			lib_pac::compressor::compress(*cinfo, comp.data());
+
+			// Branch bits only, the fourth block's tree grows past the node limit. In the second copy the fourth
+			// block claims two bytes, its tree runs past them into the zeros the reader pads with.
+			memory_source original(comp, (uint32_t) input.size());
+			const auto original_table = lib_pac::compressor::read_block_table(original);
+			const size_t tree_start = original_table->header_size + original_table->data_offsets[3];
+			std::vector<std::vector<char>> corrupted(2, comp);
+			std::fill(corrupted[0].begin() + tree_start, corrupted[0].begin() + tree_start + 0x80, static_cast<char>(0xFF));
+			const uint32_t short_size = 2;
+			std::memcpy(corrupted[1].data() + 16 + 3 * 12 + 4, &short_size, sizeof(short_size));
+
+			// Decoded with and without the decoder cache, both read the tree their own way
+			const size_t previous = lib_pac::compressor::cache_capacity();
+			for (const auto& corrupt : corrupted)
+			{
+				memory_source source(corrupt, (uint32_t) input.size());
+				const auto table = lib_pac::compressor::read_block_table(source);
+				Assert::IsTrue(table != nullptr);
+
+				for (size_t capacity : { (size_t) 0, (size_t) 4 })
+				{
+					lib_pac::compressor::set_cache_capacity(capacity);
+
+					auto dinfo = lib_pac::compressor::prepare_decompression(corrupt.data(), corrupt.size());
+					std::vector<char> dec(dinfo->output_size());
+					Assert::IsFalse(lib_pac::compressor::decompress(*dinfo, dec.data()));
+					Assert::IsTrue(std::equal(input.begin(), input.begin() + 0x6000, dec.begin()));
+
+					class vector_sink : public lib_pac::data_sink
+					{
+					public:
+						std::vector<char> data;
+
+						void write(const char* src, size_t size) override
+						{
+							data.insert(data.end(), src, src + size);
+						}
+					};
+					vector_sink sink;
+					Assert::IsFalse(lib_pac::compressor::decompress_stream(corrupt.data(), corrupt.size(), sink, 2));
+					Assert::IsTrue(sink.data.size() <= 0x6000);
+
+					std::vector<char> output(0x2000);
+					Assert::AreEqual(0u, lib_pac::compressor::read_range(source, *table, output.data(), 0x6100, 0x100));
+					Assert::AreEqual(0x2000u, lib_pac::compressor::read_range(source, *table, output.data(), 0x4000, 0x2000));
+				}
+			}
+			lib_pac::compressor::set_cache_capacity(previous);
+		}
+
+		TEST_METHOD(Compressor_InvalidHeader)
+		{
+			class vector_sink : public lib_pac::data_sink
+			{
+			public:
+				std::vector<char> data;
+
+				void write(const char* src, size_t size) override
+				{
+					data.insert(data.end(), src, src + size);
+				}
+			};
+
+			const auto make = [](std::vector<uint32_t> words)
+			{
+				std::vector<char> data(words.size() * 4 + 0x40);
+				std::memcpy(data.data(), words.data(), words.size() * 4);
+				return data;
+			};
+
+			// Full 16 MiB blocks, enough of them to add up past 4 GiB
+			std::vector<uint32_t> overflow = { 0x1234, 0x101, 0x1000000, 16 + 12 * 0x101 };
+			for (uint32_t i = 0; i < 0x101; ++i)
+				overflow.insert(overflow.end(), { 0x1000000, 0x20, 0 });
+
+			const std::vector<std::vector<char>> headers = {
+				// 16 + 12 * blk_cnt wraps around to 24 in 32 bits
+				make({ 0x1234, 0x15555556, 0x20000, 24, 0x20000, 0x40, 0 }),
+				// A block bigger than the block size
+				make({ 0x1234, 1, 0x20000, 28, 0xFFFFFFF0, 0x40, 0 }),
+				// A block size over the format's limit
+				make({ 0x1234, 1, 0x40000000, 28, 0x40000000, 0x40, 0 }),
+				make(overflow),
+				// A block past the end of the data
+				make({ 0x1234, 1, 0x20000, 28, 0x100, 0x40, 0x100 }),
+			};
+
+			for (const auto& header : headers)
+			{
+				Assert::IsTrue(lib_pac::compressor::prepare_decompression(header.data(), header.size()) == nullptr);
+
+				vector_sink sink;
+				Assert::IsFalse(lib_pac::compressor::decompress_stream(header.data(), header.size(), sink));
+				Assert::IsTrue(sink.data.empty());
+
+				memory_source source(header);
+				Assert::IsTrue(lib_pac::compressor::read_block_table(source) == nullptr);
+			}
+
+			// Too short to hold a header
+			Assert::IsTrue(lib_pac::compressor::prepare_decompression(headers[0].data(), 12) == nullptr);
+		}
 	};
 }
\ No newline at end of file
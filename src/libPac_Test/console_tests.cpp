@@ -0,0 +1,76 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include <console.h>
+#include <stdint.h>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libPac_Test
+{
+	TEST_CLASS(ConsoleTests)
+	{
+	public:
+
+		TEST_METHOD(Console_ParseOptions)
+		{
+			typedef lib_pac::console::option_result option_result;
+
+			const wchar_t* argv[] = { L"pack.exe", L"--memory", L"64", L"--jobs", L"0", L"--store", L"TXT", L"dir" };
+			const int argc = sizeof(argv) / sizeof(argv[0]);
+			lib_pac::pac_archive::save_options options;
+			uint32_t n_jobs = 4;
+
+			int i = 1;
+			Assert::IsTrue(lib_pac::console::parse_save_option(argc, argv, i, options) == option_result::parsed);
+			Assert::AreEqual(i, 2);
+			Assert::AreEqual(options.max_buffered_bytes, (uint64_t) 64 << 20);
+
+			// Jobs are at least 1
+			i = 3;
+			Assert::IsTrue(lib_pac::console::parse_save_option(argc, argv, i, options) == option_result::not_option);
+			Assert::IsTrue(lib_pac::console::parse_jobs_option(argc, argv, i, n_jobs) == option_result::parsed);
+			Assert::AreEqual(n_jobs, (uint32_t) 1);
+
+			i = 5;
+			Assert::IsTrue(lib_pac::console::parse_save_option(argc, argv, i, options) == option_result::parsed);
+			Assert::IsTrue(options.extension_storage[".txt"] == lib_pac::pac_archive::entry_storage::store);
+
+			i = 7;
+			Assert::IsTrue(lib_pac::console::parse_save_option(argc, argv, i, options) == option_result::not_option);
+			Assert::IsTrue(lib_pac::console::parse_jobs_option(argc, argv, i, n_jobs) == option_result::not_option);
+			Assert::AreEqual(i, 7);
+		}
+
+		TEST_METHOD(Console_InvalidValues)
+		{
+			typedef lib_pac::console::option_result option_result;
+			lib_pac::pac_archive::save_options options;
+			uint32_t n_jobs = 4;
+
+			// Values that aren't whole numbers, and options missing their value, stop the tool
+			for (const wchar_t* value : { L"x", L"", L"-1", L"12MB", L" 5" })
+			{
+				const wchar_t* argv[] = { L"pack.exe", L"--jobs", value, L"--memory", value };
+				int i = 1;
+				Assert::IsTrue(lib_pac::console::parse_jobs_option(5, argv, i, n_jobs) == option_result::invalid);
+				i = 3;
+				Assert::IsTrue(lib_pac::console::parse_save_option(5, argv, i, options) == option_result::invalid);
+			}
+			Assert::AreEqual(n_jobs, (uint32_t) 4);
+			Assert::AreEqual(options.max_buffered_bytes, (uint64_t) lib_pac::pac_archive::DEFAULT_BUFFERED_BYTES);
+
+			const wchar_t* missing[] = { L"pack.exe", L"--store" };
+			int i = 1;
+			Assert::IsTrue(lib_pac::console::parse_save_option(2, missing, i, options) == option_result::invalid);
+
+			// Numbers too big are clamped, the memory cap to what still fits in bytes
+			const wchar_t* huge[] = { L"pack.exe", L"--memory", L"99999999999999999999999", L"--jobs", L"5000000000" };
+			i = 1;
+			Assert::IsTrue(lib_pac::console::parse_save_option(5, huge, i, options) == option_result::parsed);
+			Assert::AreEqual(options.max_buffered_bytes, (UINT64_MAX >> 20) << 20);
+			i = 3;
+			Assert::IsTrue(lib_pac::console::parse_jobs_option(5, huge, i, n_jobs) == option_result::parsed);
+			Assert::AreEqual(n_jobs, (uint32_t) UINT32_MAX);
+		}
+	};
+}
@@ -0,0 +1,126 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include <huffman.h>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libPac_Test
+{
+	TEST_CLASS(HuffmanTests)
+	{
+	public:
+
+		TEST_METHOD(Huffman_WriteRead)
+		{
+			const char text[] = "the quick brown fox jumps over the lazy dog";
+			const uint8_t* data = reinterpret_cast<const uint8_t*>(text);
+
+			lib_pac::huffman_tree tree;
+			tree.create(data, sizeof(text));
+
+			std::vector<uint8_t> buffer(0x400);
+			lib_pac::bit_writer writer(buffer.data());
+			tree.write(writer);
+			writer.flush();
+
+			lib_pac::huffman_tree copy;
+			lib_pac::bit_reader reader(buffer.data());
+			Assert::IsTrue(copy.read(reader));
+
+			size_t branches = 0, leaves = 0;
+			size_t copy_branches = 0, copy_leaves = 0;
+			tree.node_count(branches, leaves);
+			copy.node_count(copy_branches, copy_leaves);
+			Assert::AreEqual(branches, copy_branches);
+			Assert::AreEqual(leaves, copy_leaves);
+			Assert::AreEqual(leaves, branches + 1);
+
+			lib_pac::bit_lookup expected;
+			lib_pac::bit_lookup actual;
+			tree.generate_lookup(expected);
+			copy.generate_lookup(actual);
+			for (int i = 0; i < 0x100; ++i)
+			{
+				Assert::AreEqual(expected.entries[i].pattern, actual.entries[i].pattern);
+				Assert::AreEqual(expected.entries[i].lenght, actual.entries[i].lenght);
+			}
+		}
+
+		TEST_METHOD(Huffman_SingleSymbol)
+		{
+			const std::vector<uint8_t> data(1000, 0x5A);
+
+			lib_pac::huffman_tree tree;
+			tree.create(data.data(), data.size());
+
+			size_t tree_bits, data_bits;
+			tree.bit_count(tree_bits, data_bits);
+			Assert::AreEqual(tree_bits, (size_t) 9);
+			Assert::AreEqual(data_bits, (size_t) 0);
+
+			auto cursor = tree.get_cursor();
+			Assert::IsTrue(cursor.is_leaf());
+			Assert::AreEqual(cursor.get_value(), (uint8_t) 0x5A);
+		}
+
+		TEST_METHOD(Huffman_Rebuild)
+		{
+			// Trees are rebuilt in place, the second build must not see the first one's nodes
+			std::vector<uint8_t> data(0x1000);
+			for (size_t i = 0; i < data.size(); ++i)
+				data[i] = static_cast<uint8_t>(i * i);
+
+			lib_pac::huffman_tree tree;
+			tree.create(data.data(), data.size());
+			tree.create(data.data(), 16);
+
+			size_t branches = 0, leaves = 0;
+			tree.node_count(branches, leaves);
+			Assert::AreEqual(leaves, branches + 1);
+			Assert::IsTrue(leaves <= 16);
+		}
+
+		TEST_METHOD(Huffman_LengthLimited)
+		{
+			// Fibonacci weights would need codes 25 bits long
+			uint32_t weights[0x100] = {};
+			uint32_t a = 1, b = 1;
+			for (int i = 0; i < 26; i++)
+			{
+				weights['A' + i] = a;
+				const uint32_t c = a + b;
+				a = b;
+				b = c;
+			}
+
+			for (uint32_t max_length : { 5u, 11u, 15u })
+			{
+				lib_pac::huffman_tree tree;
+				tree.create(weights, max_length);
+
+				lib_pac::bit_lookup lookup;
+				tree.generate_lookup(lookup);
+
+				// Complete prefix code, every symbol within the limit
+				uint64_t kraft = 0;
+				for (int i = 0; i < 0x100; ++i)
+				{
+					if (!weights[i])
+						continue;
+					Assert::IsTrue(lookup.entries[i].lenght > 0);
+					Assert::IsTrue(lookup.entries[i].lenght <= max_length);
+					kraft += 1ull << (max_length - lookup.entries[i].lenght);
+				}
+				Assert::AreEqual(kraft, 1ull << max_length);
+			}
+
+			// Unlimited trees are left as they were
+			lib_pac::huffman_tree tree;
+			tree.create(weights, 0);
+			lib_pac::bit_lookup lookup;
+			tree.generate_lookup(lookup);
+			Assert::AreEqual(lookup.entries['A'].lenght, (uint8_t) 25);
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include <kernels.h>
+#include <compressor.h>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace libPac_Test
+{
+	TEST_CLASS(KernelsTests)
+	{
+	public:
+
+		TEST_METHOD(Histogram_Counts)
+		{
+			// Odd length so the tail loop runs too
+			std::vector<uint8_t> data(0x1003);
+			for (size_t i = 0; i < data.size(); ++i)
+				data[i] = static_cast<uint8_t>(i * 7 + i / 3);
+
+			uint32_t expected[0x100] = {};
+			for (const uint8_t value : data)
+				expected[value]++;
+
+			uint32_t actual[0x100];
+			lib_pac::byte_histogram(data.data(), data.size(), actual);
+			for (int i = 0; i < 0x100; ++i)
+				Assert::AreEqual(expected[i], actual[i]);
+		}
+
+		TEST_METHOD(Histogram_SingleValue)
+		{
+			const std::vector<uint8_t> data(0x10000, 0x00);
+
+			uint32_t actual[0x100];
+			lib_pac::byte_histogram(data.data(), data.size(), actual);
+			Assert::AreEqual(actual[0], (uint32_t) 0x10000);
+			for (int i = 1; i < 0x100; ++i)
+				Assert::AreEqual(actual[i], (uint32_t) 0);
+		}
+
+		TEST_METHOD(Presence_Values)
+		{
+			std::vector<uint8_t> data(0x10000, 'a');
+			data[0x8001] = 0xFF;
+
+			uint8_t present[0x100];
+			Assert::AreEqual(lib_pac::byte_presence(data.data(), data.size(), present), (uint32_t) 2);
+			for (int i = 0; i < 0x100; ++i)
+				Assert::AreEqual(present[i], (uint8_t) (i == 'a' || i == 0xFF));
+
+			for (size_t i = 0; i < data.size(); ++i)
+				data[i] = static_cast<uint8_t>(i);
+			Assert::AreEqual(lib_pac::byte_presence(data.data(), data.size(), present), (uint32_t) 0x100);
+		}
+
+		TEST_METHOD(Checksum_KnownValue)
+		{
+			const char text[] = "123456789";
+			const uint8_t* data = reinterpret_cast<const uint8_t*>(text);
+
+			Assert::AreEqual(lib_pac::block_checksum(data, 9), (uint32_t) 0xE3069283);
+		}
+
+		TEST_METHOD(Kernels_AllLevels)
+		{
+			// Every supported level must produce the same results. The second input halves each value's
+			// share, its codes run past the primary decode table up to 21 bits.
+			std::vector<std::vector<char>> inputs(2, std::vector<char>(0x30001));
+			for (size_t i = 0; i < inputs[0].size(); ++i)
+			{
+				inputs[0][i] = static_cast<char>((i * i) >> (i % 11));
+
+				uint64_t x = (i + 1) * 0x9E3779B97F4A7C15ull;
+				x ^= x >> 29;
+				char value = 0;
+				while (value < 20 && (x >> value & 1) == 0)
+					++value;
+				inputs[1][i] = value;
+			}
+
+			const lib_pac::cpu_level detected = lib_pac::detect_cpu_level();
+			for (const auto& input : inputs)
+			{
+				const uint8_t* input8 = reinterpret_cast<const uint8_t*>(input.data());
+				std::vector<char> reference;
+				uint32_t reference_crc = 0;
+
+				for (int level = 0; level <= static_cast<int>(detected); ++level)
+				{
+					Assert::IsTrue(lib_pac::force_cpu_level(static_cast<lib_pac::cpu_level>(level)));
+
+					auto info = lib_pac::compressor::prepare_compression(input.data(), input.size(), 0x10000);
+					std::vector<char> cmp(info->output_size());
+					lib_pac::compressor::compress(*info, cmp.data());
+
+					auto dec_info = lib_pac::compressor::prepare_decompression(cmp.data(), cmp.size());
+					std::vector<char> dec(dec_info->output_size());
+					lib_pac::compressor::decompress(*dec_info, dec.data());
+					Assert::IsTrue(dec == input);
+
+					const uint32_t crc = lib_pac::block_checksum(input8, input.size());
+					if (level == 0)
+					{
+						reference = cmp;
+						reference_crc = crc;
+					}
+					Assert::IsTrue(cmp == reference);
+					Assert::AreEqual(crc, reference_crc);
+				}
+			}
+
+			lib_pac::force_cpu_level(detected);
+		}
+	};
+}
\ No newline at end of file
@@ -0,0 +1,272 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include <pac.h>
+#include <structs.h>
+#include <systemfilesource.h>
+#include <cstdio>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <map>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+namespace fs = std::experimental::filesystem;
+
+namespace libPac_Test
+{
+	// Generates its bytes instead of holding them, big enough to be streamed without using the memory. Each
+	// 16 KiB of the skewed part repeats its own byte one time in hot_every, the rest is noise.
+	class generated_source : public lib_pac::file_source_base
+	{
+	public:
+		uint32_t size;
+		uint32_t noise_from;
+		uint32_t hot_every;
+
+		generated_source(uint32_t size, uint32_t noise_from, uint32_t hot_every = 8)
+			: size(size), noise_from(noise_from), hot_every(hot_every)
+		{
+		}
+
+		static char byte_at(uint64_t position, uint32_t noise_from, uint32_t hot_every)
+		{
+			uint64_t x = (position + 1) * 0x9E3779B97F4A7C15ull;
+			x ^= x >> 31;
+			x *= 0xBF58476D1CE4E5B9ull;
+			x ^= x >> 29;
+			if (position < noise_from && (x >> 8) % hot_every == 0)
+				return static_cast<char>((position / 0x4000) * 37);
+			return static_cast<char>(x);
+		}
+
+		bool compressed() override { return false; }
+		uint32_t data_size() override { return size; }
+		uint32_t unpacked_size() override { return size; }
+		std::unique_ptr<file_source_base> get_copy() const override { return std::make_unique<generated_source>(*this); }
+
+		void copy_data(char* dst, uint32_t offset, uint32_t count) override
+		{
+			for (uint32_t i = 0; i < count; ++i)
+				dst[i] = byte_at(uint64_t(offset) + i, noise_from, hot_every);
+		}
+	};
+
+	TEST_CLASS(PacTests)
+	{
+	public:
+
+		static std::string read_file(const char* name)
+		{
+			std::ifstream file(name, std::ios::binary);
+			return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		}
+
+		TEST_METHOD(Pac_ExtractAll)
+		{
+			std::map<std::string, std::string> contents;
+			contents["top.txt"] = "stored entry";
+			contents["a/b/bad.bin"] = std::string(0x8000, 'x');
+			contents["a/size.bin"] = std::string(0x8000, 'y');
+			for (size_t i = 0; contents["a/b/c/deep.bin"].size() < 0x100000; ++i)
+				contents["a/b/c/deep.bin"] += "line " + std::to_string(i % 613) + " of a compressed entry\n";
+
+			{
+				lib_pac::pac_archive archive;
+				for (const auto& content : contents)
+				{
+					const std::string source = "pac_" + std::to_string(archive.num_files()) + ".bin";
+					std::ofstream file(source, std::ios::binary | std::ios::trunc);
+					file.write(content.second.data(), content.second.size());
+					file.close();
+					archive.insert(content.first, std::make_shared<lib_pac::system_file_source>(fs::path(source).wstring()));
+				}
+
+				lib_pac::pac_archive::save_options options;
+				options.extension_storage[".bin"] = lib_pac::pac_archive::entry_storage::compress;
+				options.extension_storage[".txt"] = lib_pac::pac_archive::entry_storage::store;
+				archive.save(L"pac_extract.pac", nullptr, options);
+
+				for (size_t i = 0; i < contents.size(); ++i)
+					std::remove(("pac_" + std::to_string(i) + ".bin").c_str());
+			}
+
+			// One entry loses its stream magic, another claims a byte more than it decodes to
+			std::vector<char> data;
+			{
+				std::ifstream file("pac_extract.pac", std::ios::binary);
+				data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			}
+
+			lib_pac::structs::PAC_HEADER header;
+			std::memcpy(&header, data.data(), sizeof(header));
+			const size_t data_start = sizeof(header) + header.NumFiles * sizeof(lib_pac::structs::PAC_DIRECTORY_ENTRY);
+			for (uint32_t i = 0; i < header.NumFiles; ++i)
+			{
+				char* entry_data = data.data() + sizeof(header) + i * sizeof(lib_pac::structs::PAC_DIRECTORY_ENTRY);
+				lib_pac::structs::PAC_DIRECTORY_ENTRY entry;
+				std::memcpy(&entry, entry_data, sizeof(entry));
+				if (strcmp(entry.FileName, "a/b/bad.bin") == 0)
+				{
+					Assert::AreEqual(entry.Compressed, (uint32_t) 1);
+					data[data_start + entry.Offset] ^= 0x5a;
+				}
+				else if (strcmp(entry.FileName, "a/size.bin") == 0)
+				{
+					entry.RawSize++;
+					std::memcpy(entry_data, &entry, sizeof(entry));
+				}
+			}
+			{
+				std::ofstream file("pac_extract.pac", std::ios::binary | std::ios::trunc);
+				file.write(data.data(), data.size());
+			}
+
+			std::error_code error;
+			fs::remove_all("pac_extract", error);
+			{
+				lib_pac::pac_archive archive(L"pac_extract.pac");
+
+				int calls = 0;
+				lib_pac::pac_archive::extract_options options;
+				options.callback = [&calls](const lib_pac::pac_archive::progress_info& info)
+				{
+					Assert::AreEqual(info.cur_file, ++calls);
+				};
+				const auto info = archive.extract_all(L"pac_extract", options);
+
+				Assert::AreEqual(calls, 4);
+				Assert::AreEqual(info.total_files, (uint32_t) 4);
+				Assert::AreEqual(info.extracted_size, (uint64_t) (contents["top.txt"].size() + contents["a/b/c/deep.bin"].size()));
+
+				// Failures come back sorted by name, the other entries are still extracted
+				Assert::AreEqual((uint64_t) info.failures.size(), (uint64_t) 2);
+				Assert::IsTrue(info.failures[0].file_name == "a/b/bad.bin");
+				Assert::IsTrue(info.failures[0].reason == "Invalid Data");
+				Assert::IsTrue(info.failures[1].file_name == "a/size.bin");
+				Assert::IsTrue(info.failures[1].reason == "Size Mismatch - Expected 32769 got 32768");
+			}
+
+			// Nested directories are created for the entries that need them
+			Assert::IsTrue(fs::is_directory("pac_extract/a/b/c"));
+			Assert::IsTrue(read_file("pac_extract/top.txt") == contents["top.txt"]);
+			Assert::IsTrue(read_file("pac_extract/a/b/c/deep.bin") == contents["a/b/c/deep.bin"]);
+
+			fs::remove_all("pac_extract", error);
+			std::remove("pac_extract.pac");
+		}
+
+		TEST_METHOD(Pac_KeepsSources)
+		{
+			std::string content;
+			for (size_t i = 0; content.size() < 0x100000; ++i)
+				content += "row " + std::to_string(i % 331) + " of a kept entry\n";
+			{
+				std::ofstream file("pac_kept.bin", std::ios::binary | std::ios::trunc);
+				file.write(content.data(), content.size());
+			}
+			{
+				lib_pac::pac_archive archive;
+				archive.insert("kept.bin", std::make_shared<lib_pac::system_file_source>(fs::path("pac_kept.bin").wstring()));
+				archive.save(L"pac_kept.pac");
+			}
+			std::remove("pac_kept.bin");
+
+			// Every lookup hands out the same source, the block table it reads for the first range is kept
+			{
+				lib_pac::pac_archive archive(L"pac_kept.pac");
+				const auto source = archive.get("kept.bin");
+				Assert::IsTrue(source != nullptr);
+				Assert::IsTrue(archive.get("kept.bin") == source);
+
+				std::string out(0x100, '\0');
+				for (uint32_t offset : { 0x100u, 0x80000u, 0xFFE00u })
+				{
+					Assert::AreEqual(archive.get("kept.bin")->read_range(&out[0], offset, 0x100), 0x100u);
+					Assert::IsTrue(out == content.substr(offset, 0x100));
+				}
+			}
+			std::remove("pac_kept.pac");
+		}
+
+		typedef std::map<std::string, std::shared_ptr<generated_source>> generated_sources;
+		typedef std::map<std::string, std::pair<uint32_t, int32_t>> saved_blocks;
+
+		// Saves the sources and reads every one back at a few offsets, the block size and saving reported
+		// for each entry go in blocks
+		static lib_pac::pac_archive::archive_info save_generated(const generated_sources& sources,
+		                                                         lib_pac::compression_level level, saved_blocks& blocks)
+		{
+			lib_pac::pac_archive::archive_info info;
+			{
+				lib_pac::pac_archive archive;
+				for (const auto& source : sources)
+					archive.insert(source.first, source.second);
+
+				lib_pac::pac_archive::save_options options;
+				options.level = level;
+				info = archive.save(L"pac_streamed.pac", [&blocks](const lib_pac::pac_archive::progress_info& entry)
+				{
+					blocks[entry.file_name] = std::make_pair(entry.block_size, entry.saved_size);
+				}, options);
+			}
+			Assert::AreEqual((uint64_t) fs::file_size("pac_streamed.pac"), (uint64_t) info.header_size + info.compressed_size);
+
+			{
+				lib_pac::pac_archive archive(L"pac_streamed.pac");
+				for (const auto& source : sources)
+				{
+					const auto entry = archive.get(source.first);
+					const generated_source& generated = *source.second;
+					Assert::AreEqual(entry->unpacked_size(), generated.size);
+
+					std::vector<char> out(0x100000);
+					for (uint32_t offset : { 0u, 0x7F0000u, 0x2345678u, generated.size - 0x100000u })
+					{
+						Assert::AreEqual(entry->read_range(out.data(), offset, 0x100000), 0x100000u);
+						uint32_t mismatches = 0;
+						for (uint32_t i = 0; i < out.size(); ++i)
+							mismatches += out[i] != generated_source::byte_at(uint64_t(offset) + i, generated.noise_from,
+							                                                  generated.hot_every);
+						Assert::AreEqual(mismatches, 0u);
+					}
+				}
+			}
+			std::remove("pac_streamed.pac");
+			return info;
+		}
+
+		TEST_METHOD(Pac_SaveStreamed)
+		{
+			// Both files are streamed. The first compresses all the way. The second looks compressible in its
+			// first chunk only, it is compressed to more than its size, copied in stored, and the archive is cut
+			// back to where the entries end.
+			const uint32_t size = 0x4000010;
+			generated_sources sources;
+			sources["a_skewed.bin"] = std::make_shared<generated_source>(size, size);
+			sources["z_noise.bin"] = std::make_shared<generated_source>(size, 0x800000);
+
+			saved_blocks blocks;
+			auto info = save_generated(sources, lib_pac::compression_level::normal, blocks);
+			Assert::AreEqual(info.stored_files, (uint32_t) 1);
+
+			// The first chunk picked small blocks over the default ones, the saving covers the whole file
+			Assert::AreEqual(blocks["a_skewed.bin"].first, 0x4000u);
+			Assert::IsTrue(blocks["a_skewed.bin"].second > 0x10000);
+			Assert::AreEqual(blocks["z_noise.bin"].first, 0u);
+			Assert::AreEqual(blocks["z_noise.bin"].second, 0);
+
+			// The fast level predicts nothing. It compresses with the default size even where small blocks would
+			// save more, and the output alone stores the file small blocks made worth compressing.
+			sources.erase("z_noise.bin");
+			sources["b_hot.bin"] = std::make_shared<generated_source>(size, size, 2);
+			blocks.clear();
+			info = save_generated(sources, lib_pac::compression_level::fast, blocks);
+			Assert::AreEqual(info.stored_files, (uint32_t) 1);
+
+			Assert::AreEqual(blocks["a_skewed.bin"].first, 0u);
+			Assert::AreEqual(blocks["b_hot.bin"].first, (uint32_t) lib_pac::pac_archive::DEFAULT_BLOCK_SIZE);
+			Assert::AreEqual(blocks["b_hot.bin"].second, 0);
+		}
+	};
+}
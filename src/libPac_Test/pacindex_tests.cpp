@@ -0,0 +1,160 @@
+#include "stdafx.h"
+#include "CppUnitTest.h"
+#include <pac.h>
+#include <structs.h>
+#include <systemfilesource.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <map>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+namespace fs = std::experimental::filesystem;
+
+namespace libPac_Test
+{
+	TEST_CLASS(PacIndexTests)
+	{
+	public:
+
+		// Saves a few small files and one spanning several blocks, returns their contents by name
+		static std::map<std::string, std::string> save_archive(const wchar_t* name, bool write_index,
+		                                                       lib_pac::pac_archive::archive_info* info = nullptr)
+		{
+			std::map<std::string, std::string> contents;
+			contents["b.txt"] = "stored entry";
+			contents["dir/c.txt"] = "another stored entry";
+			for (size_t i = 0; contents["dir/a.bin"].size() < 0x100000; ++i)
+				contents["dir/a.bin"] += "block " + std::to_string(i % 977) + " of a compressed entry\n";
+
+			lib_pac::pac_archive archive;
+			for (const auto& content : contents)
+			{
+				const std::string source = "pacindex_" + std::to_string(archive.num_files()) + ".bin";
+				std::ofstream file(source, std::ios::binary | std::ios::trunc);
+				file.write(content.second.data(), content.second.size());
+				file.close();
+				archive.insert(content.first, std::make_shared<lib_pac::system_file_source>(fs::path(source).wstring()));
+			}
+
+			lib_pac::pac_archive::save_options options;
+			options.write_index = write_index;
+			const auto saved = archive.save(name, nullptr, options);
+			if (info)
+				*info = saved;
+
+			for (size_t i = 0; i < contents.size(); ++i)
+				std::remove(("pacindex_" + std::to_string(i) + ".bin").c_str());
+			return contents;
+		}
+
+		static void check_archive(const wchar_t* name, const std::map<std::string, std::string>& contents)
+		{
+			lib_pac::pac_archive archive(name);
+			Assert::AreEqual((uint64_t) archive.num_files(), (uint64_t) contents.size());
+
+			auto expected = contents.begin();
+			for (const auto entry : archive)
+			{
+				Assert::IsTrue(expected->first == entry.name);
+				Assert::AreEqual((uint64_t) entry.raw_size, (uint64_t) expected->second.size());
+				++expected;
+			}
+
+			for (const auto& content : contents)
+			{
+				auto source = archive.get(content.first);
+				Assert::IsTrue(source != nullptr);
+
+				const uint32_t offset = static_cast<uint32_t>(content.second.size() / 3);
+				std::string out(content.second.size() - offset, '\0');
+				Assert::AreEqual(source->read_range(&out[0], offset, static_cast<uint32_t>(out.size())), (uint32_t) out.size());
+				Assert::IsTrue(out == content.second.substr(offset));
+			}
+			Assert::IsTrue(archive.get("dir/missing.bin") == nullptr);
+		}
+
+		TEST_METHOD(PacIndex_Sidecar)
+		{
+			lib_pac::pac_archive::archive_info info;
+			const auto contents = save_archive(L"pacindex_sidecar.pac", true, &info);
+			Assert::IsFalse(info.index_failed);
+			Assert::IsTrue(fs::exists("pacindex_sidecar.pacidx"));
+			check_archive(L"pacindex_sidecar.pac", contents);
+
+			// A sidecar written for another mtime is ignored, the archive's own directory is read instead
+			fs::last_write_time("pacindex_sidecar.pac", fs::last_write_time("pacindex_sidecar.pac") + std::chrono::seconds(2));
+			check_archive(L"pacindex_sidecar.pac", contents);
+
+			Assert::IsTrue(lib_pac::pac_archive::write_index(L"pacindex_sidecar.pac"));
+			check_archive(L"pacindex_sidecar.pac", contents);
+
+			// Saving without an index drops the stale one
+			save_archive(L"pacindex_sidecar.pac", false);
+			Assert::IsFalse(fs::exists("pacindex_sidecar.pacidx"));
+			check_archive(L"pacindex_sidecar.pac", contents);
+
+			std::remove("pacindex_sidecar.pac");
+		}
+
+		TEST_METHOD(PacIndex_CorruptBlock)
+		{
+			const auto contents = save_archive(L"pacindex_corrupt.pac", true);
+
+			std::vector<char> data;
+			{
+				std::ifstream file("pacindex_corrupt.pac", std::ios::binary);
+				data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			}
+
+			lib_pac::structs::PAC_HEADER header;
+			std::memcpy(&header, data.data(), sizeof(header));
+			const size_t data_start = sizeof(header) + header.NumFiles * sizeof(lib_pac::structs::PAC_DIRECTORY_ENTRY);
+
+			size_t entry_start = 0;
+			for (uint32_t i = 0; i < header.NumFiles; ++i)
+			{
+				lib_pac::structs::PAC_DIRECTORY_ENTRY entry;
+				std::memcpy(&entry, data.data() + sizeof(header) + i * sizeof(entry), sizeof(entry));
+				if (strcmp(entry.FileName, "dir/a.bin") == 0)
+					entry_start = data_start + entry.Offset;
+			}
+			Assert::IsTrue(entry_start != 0);
+
+			// A byte of the first block changes, size and mtime stay so the sidecar is still used
+			const auto write_time = fs::last_write_time("pacindex_corrupt.pac");
+			{
+				std::fstream file("pacindex_corrupt.pac", std::ios::binary | std::ios::in | std::ios::out);
+				file.seekp(entry_start + 0x1000);
+				file.put(static_cast<char>(data[entry_start + 0x1000] ^ 0x5a));
+			}
+			fs::last_write_time("pacindex_corrupt.pac", write_time);
+
+			{
+				lib_pac::pac_archive archive(L"pacindex_corrupt.pac");
+				std::vector<char> out(0x100);
+				Assert::AreEqual(archive.get("dir/a.bin")->read_range(out.data(), 0, 0x100), (uint32_t) 0);
+				Assert::AreEqual(archive.get("b.txt")->read_range(out.data(), 0, 0x100), static_cast<uint32_t>(contents.at("b.txt").size()));
+			}
+
+			std::remove("pacindex_corrupt.pac");
+			std::remove("pacindex_corrupt.pacidx");
+		}
+
+		TEST_METHOD(PacIndex_WriteFails)
+		{
+			// A directory where the sidecar goes, saving still writes the archive and reports the index
+			fs::create_directory("pacindex_fail.pacidx");
+			lib_pac::pac_archive::archive_info info;
+			const auto contents = save_archive(L"pacindex_fail.pac", true, &info);
+			Assert::IsTrue(info.index_failed);
+			check_archive(L"pacindex_fail.pac", contents);
+
+			fs::remove("pacindex_fail.pacidx");
+			std::remove("pacindex_fail.pac");
+		}
+	};
+}
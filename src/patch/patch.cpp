@@ -5,17 +5,21 @@
 
 #include <filesystem>
 #include <iostream>
-#include <iomanip>
+#include <algorithm>
+#include <vector>
 
 #include "pac.h"
+#include "batch.h"
+#include "console.h"
 #include "pacfilesource.h"
 #include "systemfilesource.h"
 
 namespace fs = std::experimental::filesystem;
+using lib_pac::console::print_line;
 
 static fs::path path_make_relative(const fs::path& from, const fs::path& to);
-void patch_archive(const fs::path& path);
-void report_progress(const lib_pac::pac_archive::progress_info& prog_info);
+uint64_t patch_archive(const fs::path& path, const lib_pac::pac_archive::save_options& options);
+static void print_usage();
 
 int
 wmain(int argc, const wchar_t** argv)
@@ -23,25 +27,65 @@ wmain(int argc, const wchar_t** argv)
 	std::cout << "PAC Patcher" << std::endl;
 	if (argc == 1)
 	{
-		std::cout << "Usage: patch.exe <directory or pac file>" << std::endl;
+		print_usage();
 		return 1;
 	}
 
+	lib_pac::pac_archive::save_options options;
+	uint32_t n_jobs = lib_pac::archive_batch::DEFAULT_PARALLEL_ARCHIVES;
+	std::vector<fs::path> directories;
 	for (int i = 1; i < argc; ++i)
 	{
-		const std::wstring arg = argv[i];
-		fs::path path = arg;
+		auto result = lib_pac::console::parse_save_option(argc, argv, i, options);
+		if (result == lib_pac::console::option_result::not_option)
+			result = lib_pac::console::parse_jobs_option(argc, argv, i, n_jobs);
+		if (result == lib_pac::console::option_result::invalid)
+		{
+			print_usage();
+			return 1;
+		}
+		if (result == lib_pac::console::option_result::parsed)
+			continue;
+
+		fs::path path = argv[i];
 		path.replace_extension();
 		if (fs::is_directory(path))
-			patch_archive(path);
+			directories.push_back(path);
+	}
+
+	// The memory cap is shared by the archives patched at once
+	const uint32_t n_parallel = std::max(std::min(n_jobs, static_cast<uint32_t>(directories.size())), 1u);
+	options.max_buffered_bytes /= n_parallel;
+
+	lib_pac::archive_batch batch;
+	for (const auto& path : directories)
+	{
+		// The whole archive is rewritten, its size is the work
+		fs::path archive_file = path;
+		archive_file.replace_extension(".pac.bak");
+		if (!fs::is_regular_file(archive_file))
+			archive_file.replace_extension(".pac");
+
+		const uint64_t size = fs::is_regular_file(archive_file) ? fs::file_size(archive_file) : 0;
+		batch.add(path.stem().string(), size, [path, &options]() { return patch_archive(path, options); });
 	}
+
+	return lib_pac::console::report_batch(batch.run(n_parallel));
 }
 
-void
-patch_archive(const fs::path& path)
+static void
+print_usage()
+{
+	std::cout << "Usage: patch.exe [options] <directory or pac file>" << std::endl;
+	lib_pac::console::print_save_usage();
+	std::cout << "  --jobs <n>        Archives patched at once, default 4" << std::endl;
+}
+
+uint64_t
+patch_archive(const fs::path& path, const lib_pac::pac_archive::save_options& options)
 {
 	fs::path root = path.parent_path();
-	fs::path base = path.stem();
+	const std::string base = path.stem().string();
 
 	fs::path source = path;
 	source.replace_extension();
@@ -54,19 +98,19 @@ patch_archive(const fs::path& path)
 
 	if (!is_regular_file(target) && !is_regular_file(bak_file))
 	{
-		std::cout << "Unable to find PAC file or Backup: " << base;
-		return;
+		print_line(base, "Unable to find PAC file or Backup");
+		return 0;
 	}
 
 	if (!is_regular_file(bak_file))
 	{
-		std::cout << "Creating Backup File..." << std::endl;
+		print_line(base, "Creating Backup File...");
 		fs::rename(target, bak_file);
 	}
 
-	std::cout << "Reading archive: " << target.stem() << std::endl;
+	print_line(base, "Reading archive: " + target.stem().string());
 	lib_pac::pac_archive archive(bak_file);
-	std::cout << "Replacing Files..." << std::endl;
+	print_line(base, "Replacing Files...");
 	fs::recursive_directory_iterator iter(path);
 
 	int n_repl = 0;
@@ -83,31 +127,23 @@ patch_archive(const fs::path& path)
 			}
 			else
 			{
-				std::cout << "File '" << virt_path << "' not found in archive" << std::endl;
+				print_line(base, "File '" + virt_path.string() + "' not found in archive");
 			}
 		}
 	}
 
-	std::cout << "Archive has " << archive.num_files() << " Files" << std::endl;
-	std::cout << "Replacing " << n_repl << " File(s)" << std::endl;
-	std::cout << "Compressing..." << std::endl;
-
-	const auto save_info = archive.save(target, report_progress);
+	print_line(base, "Archive has " + std::to_string(archive.num_files()) + " Files");
+	print_line(base, "Replacing " + std::to_string(n_repl) + " File(s)");
+	print_line(base, "Compressing...");
 
-	const float ratio = (save_info.compressed_size + save_info.header_size) * 100.f / (save_info.original_size);
-
-	std::cout << "Total Size       : " << save_info.compressed_size + save_info.header_size << std::endl;
-	std::cout << "Compression Ratio: " << std::fixed << std::setprecision(2) << ratio << "%" << std::endl;
-}
+	const auto save_info = archive.save(target, [&base](const lib_pac::pac_archive::progress_info& prog_info)
+	{
+		lib_pac::console::report_save_progress(base, prog_info);
+	}, options);
 
-void
-report_progress(const lib_pac::pac_archive::progress_info& prog_info)
-{
-	const int n_digits = ceil(log10(prog_info.num_files));
-	const float ratio = prog_info.compressed_size * 100.f / prog_info.raw_size;
+	lib_pac::console::report_save(base, save_info);
 
-	std::cout << "[" << std::setw(n_digits) << prog_info.cur_file << "/" << prog_info.num_files << "] ";
-	std::cout << std::fixed << std::setprecision(0) << ratio << "% - " << prog_info.file_name << std::endl;
+	return save_info.original_size;
 }
 
 static fs::path
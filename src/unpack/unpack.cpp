@@ -7,15 +7,19 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
-#include <future>
+#include <sstream>
+#include <vector>
 
 #include "pac.h"
-#include "membuf.h""
-#include "compressor.h"
+#include "batch.h"
+#include "console.h"
 
 namespace fs = std::experimental::filesystem;
+using lib_pac::console::print_line;
 
-void extract_archive(fs::path path);
+uint64_t extract_archive(const fs::path& path);
+void report_progress(const std::string& archive, const lib_pac::pac_archive::progress_info& prog_info);
+static void print_usage();
 
 int
 wmain(int argc, const wchar_t** argv)
@@ -23,94 +27,67 @@ wmain(int argc, const wchar_t** argv)
 	std::cout << "PAC Unpacker" << std::endl;
 	if (argc == 1)
 	{
-		std::cout << "Usage: unpack.exe <pac file>" << std::endl;
+		print_usage();
 		return 1;
 	}
 
+	uint32_t n_jobs = lib_pac::archive_batch::DEFAULT_PARALLEL_ARCHIVES;
+	lib_pac::archive_batch batch;
 	for (int i = 1; i < argc; ++i)
 	{
-		const std::wstring arg = argv[i];
-		const fs::path path = arg;
+		const auto result = lib_pac::console::parse_jobs_option(argc, argv, i, n_jobs);
+		if (result == lib_pac::console::option_result::invalid)
+		{
+			print_usage();
+			return 1;
+		}
+		if (result == lib_pac::console::option_result::parsed)
+			continue;
+
+		const fs::path path = argv[i];
 		if (fs::is_regular_file(path))
-			extract_archive(path);
+			batch.add(path.stem().string(), fs::file_size(path), [path]() { return extract_archive(path); });
 	}
+
+	return lib_pac::console::report_batch(batch.run(n_jobs));
+}
+
+static void
+print_usage()
+{
+	std::cout << "Usage: unpack.exe [options] <pac file>" << std::endl;
+	std::cout << "  --jobs <n>        Archives unpacked at once, default 4" << std::endl;
 }
 
 void
-extract_archive(fs::path path)
+report_progress(const std::string& archive, const lib_pac::pac_archive::progress_info& prog_info)
 {
-	memory_buffer comp_buffer;
-	memory_buffer dec_buffer;
+	const int n_digits = ceil(log10(prog_info.num_files));
 
-	std::wcout << L"Extracting Archive: " << path.filename() << std::endl;
-	lib_pac::pac_archive archive(path);
+	std::ostringstream line;
+	line << "[" << std::setw(n_digits) << prog_info.cur_file << "/" << prog_info.num_files << "] ";
+	line << prog_info.file_name;
+	print_line(archive, line.str());
+}
 
+uint64_t
+extract_archive(const fs::path& path)
+{
+	const std::string base = path.stem().string();
 
-	const int n_files = archive.num_files();
-	const int f_digits = ceil(log10(n_files));
+	print_line(base, "Extracting Archive: " + path.filename().string());
+	lib_pac::pac_archive archive(path);
 
-	int cur_file = 0;
-	
-	for (auto& elem : archive)
+	// Entries are decoded many at a time, so progress lines come in completion order
+	lib_pac::pac_archive::extract_options options;
+	options.callback = [&base](const lib_pac::pac_archive::progress_info& prog_info)
 	{
-		const fs::path v_path = path.stem().append(elem);
-		auto file_source = archive.get(elem);
+		report_progress(base, prog_info);
+	};
+	const auto extract_info = archive.extract_all(path.stem().wstring(), options);
 
-		size_t dec_sz;
+	for (const auto& failure : extract_info.failures)
+		print_line(base, failure.reason + ": " + failure.file_name);
 
-		std::cout << "[" << std::setw(f_digits) << cur_file + 1 << "/" << n_files << "] " << v_path << std::endl;
-		if (file_source->compressed())
-		{
-			comp_buffer.reserve(file_source->data_size());
-
-			file_source->copy_data(comp_buffer.data(), 0, file_source->data_size());
-
-			const auto dec_info = lib_pac::compressor::prepare_decompression(comp_buffer.data(), file_source->data_size());
-
-			dec_sz = dec_info->output_size();
-			const uint32_t expected_size = file_source->unpacked_size();
-
-			if (dec_sz != expected_size)
-			{
-				std::cerr << "Size Mismatch: " << v_path;
-				std::cerr << " - Expected " << expected_size << " got " << dec_sz << std::endl;
-			}
-
-			dec_buffer.reserve(dec_sz);
-
-			lib_pac::compressor::decompress(*dec_info, dec_buffer.data());
-		}
-		else
-		{
-			dec_sz = file_source->unpacked_size();
-			dec_buffer.reserve(dec_sz);
-
-			file_source->copy_data(dec_buffer.data(), 0, dec_sz);
-		}
-		fs::create_directories(v_path.parent_path());
-
-#if 0
-		HANDLE hFile = CreateFileA(v_path.string().c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW,
-			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_WRITE_THROUGH,
-			nullptr);
-		
-		WriteFile(hFile, dec_buffer.data(), dec_sz, nullptr, nullptr);
-		CloseHandle(hFile);
-#endif
-#if 0
-		std::ofstream output(v_path, std::ios::trunc | std::ios::binary);
-		output.write(dec_buffer.data(), dec_sz);
-		output.flush();
-		output.close();
-#endif
-#if 1
-		FILE* f;
-		fopen_s(&f, v_path.string().c_str(), "wb");
-		fwrite(dec_buffer.data(), 1, dec_sz, f);
-		fflush(f);
-		fclose(f);
-#endif
-
-		cur_file++;
-	}
+	return extract_info.extracted_size;
 }